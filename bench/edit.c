@@ -0,0 +1,267 @@
+/* IMPORTS */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../term.c"
+
+/* DATA */
+
+struct editorConfig E; // The frontend runs headless, frames are built but never written
+
+#define BENCH_ROWS 40    // Screen the frames are built for
+#define BENCH_COLS 120
+#define BENCH_OPS 500    // Repetitions of the quick operations
+#define BENCH_FRAMES 100 // Frames built at every position
+
+/* FILES */
+
+static unsigned int seed = 12345;
+
+static unsigned int nextRand(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 16;
+}
+
+static long writeC(FILE *fp, int n)
+{
+    // A function with the comments, strings and numbers the C lexer sees most
+    return fprintf(fp,
+                   "/* Render row %d of the buffer into its display form,\n"
+                   " * expanding tabs and escaping control characters */\n"
+                   "static int render_%d(struct buffer *buf, const char *name, int index)\n"
+                   "{\n"
+                   "\t// Scaled index of the row, %u columns wide\n"
+                   "\tint value = index * %u + 0x%x;\n"
+                   "\tif (value > %u && name[0] != '\\0')\n"
+                   "\t\tprintf(\"value %%d of \\\"%%s\\\"\\n\", value, name);\n"
+                   "\twhile (buf->len < value)\n"
+                   "\t\tbuf->data[buf->len++] = ' ';\n"
+                   "\treturn value;\n"
+                   "}\n\n",
+                   n, n, nextRand() % 200, nextRand() % 64, nextRand(), nextRand() % 4096);
+}
+
+static long writeTS(FILE *fp, int n)
+{
+    // An interface and a class with template strings, like a frontend module
+    return fprintf(fp,
+                   "import { Buffer%d } from \"./buffer%d\";\n\n"
+                   "export interface Row%d {\n"
+                   "    index: number;\n"
+                   "    text: string;\n"
+                   "}\n\n"
+                   "/** View over rows %u to %u */\n"
+                   "export class View%d {\n"
+                   "    private rows: Row%d[] = [];\n"
+                   "    // Rendered lazily, see render\n"
+                   "    render(index: number): string {\n"
+                   "        const text = `row ${index} of ${this.rows.length}`;\n"
+                   "        return this.rows.length > %u ? text : \"empty\";\n"
+                   "    }\n"
+                   "}\n\n",
+                   n, n % 16, n, n * 64, n * 64 + 63, n, n, nextRand() % 100);
+}
+
+static long writeLog(FILE *fp, int n)
+{
+    // A request log line, which no syntax highlights
+    static const char *levels[] = {"INFO ", "INFO ", "INFO ", "DEBUG", "WARN ", "ERROR"};
+    return fprintf(fp, "2026-10-18T%02d:%02d:%02d.%03dZ %s worker-%u request id=%d path=/api/v1/items/%u status=%d took=%ums\n",
+                   n / 3600000 % 24, n / 60000 % 60, n / 1000 % 60, n % 1000, levels[nextRand() % 6], nextRand() % 8, n,
+                   nextRand() % 100000, nextRand() % 16 ? 200 : 500, nextRand() % 250);
+}
+
+static void writeFile(const char *path, const char *type, long bytes)
+{
+    // A file of at least the given size, made of one kind of block repeated with
+    // pseudo-random names and numbers so runs see the same text
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+    {
+        perror(path);
+        exit(1);
+    }
+    seed = 12345;
+    long total = 0;
+    for (int n = 0; total < bytes; n++)
+        total += strcmp(type, "c") == 0 ? writeC(fp, n) : strcmp(type, "ts") == 0 ? writeTS(fp, n) : writeLog(fp, n);
+    fclose(fp);
+}
+
+/* BENCH */
+
+static const char *type; // File the results are of
+static long bytes;
+
+static void report(const char *op, long ops, long long ns)
+{
+    // One line per operation: op type bytes ops seconds ns/op
+    printf("%-20s %-4s %10ld %8ld %10.6f %14.1f\n", op, type, bytes, ops, ns / 1e9, ops ? (double)ns / ops : 0.0);
+    fflush(stdout);
+}
+
+static void drawFrame(void)
+{
+    // Everything refreshScreen appends for one window, without writing it out
+    struct abuf ab = ABUF_INIT;
+    scroll();
+    drawRows(&ab, &E.windows[E.active], 1);
+    drawBar(&ab, &E.windows[E.active], 1);
+    drawStatus(&ab);
+    abFree(&ab);
+}
+
+static void benchFrames(const char *op, int row)
+{
+    E.cy = row;
+    E.cx = log10(E.doc->numrows) + 2;
+    long long start = monotonicNs();
+    for (int i = 0; i < BENCH_FRAMES; i++)
+        drawFrame();
+    report(op, BENCH_FRAMES, monotonicNs() - start);
+}
+
+static void benchRows(const char *name, int at_end, double where)
+{
+    // Insert rows at a place in the file, then delete them again
+    static const char line[] = "\tint value = render(buffer, index + 1); // Inserted";
+    char op[32];
+    long long start = monotonicNs();
+    for (int i = 0; i < BENCH_OPS; i++)
+        insertRow(E.doc, at_end ? E.doc->numrows : (int)(E.doc->numrows * where), (char *)line, sizeof(line) - 1);
+    snprintf(op, sizeof(op), "insert_row_%s", name);
+    report(op, BENCH_OPS, monotonicNs() - start);
+
+    start = monotonicNs();
+    for (int i = 0; i < BENCH_OPS; i++)
+        deleteRow(E.doc, at_end ? E.doc->numrows - 1 : (int)((E.doc->numrows - 1) * where));
+    snprintf(op, sizeof(op), "delete_row_%s", name);
+    report(op, BENCH_OPS, monotonicNs() - start);
+}
+
+static void benchLongLine(const char *op, int len, int ops)
+{
+    // Type into the middle of a long line, every key renders and lexes it again
+    char *line = malloc(len);
+    for (int i = 0; i < len; i++)
+        line[i] = "int value = 42; "[i % 16];
+    int at = E.doc->numrows / 2;
+    insertRow(E.doc, at, line, len);
+    free(line);
+    long long start = monotonicNs();
+    for (int i = 0; i < ops; i++)
+        rowInsertChar(E.doc, &E.doc->row[at], len / 2, 'a' + i % 26);
+    report(op, ops, monotonicNs() - start);
+    deleteRow(E.doc, at);
+}
+
+static void benchSearch(const char *query)
+{
+    // Type a query into find one key at a time, then step through the matches
+    char typed[64];
+    int len = strlen(query);
+    long long start = monotonicNs();
+    for (int i = 1; i <= len; i++)
+    {
+        memcpy(typed, query, i);
+        typed[i] = '\0';
+        search(typed, typed[i - 1]);
+    }
+    report("search_type", len, monotonicNs() - start);
+
+    start = monotonicNs();
+    for (int i = 0; i < BENCH_OPS; i++)
+        search(typed, ARROW_DOWN);
+    report("search_next", BENCH_OPS, monotonicNs() - start);
+    search(typed, '\x1b');
+    clearSearchCache(E.doc);
+    clearMatchIndex(E.doc);
+}
+
+static void benchFile(const char *filetype, long size)
+{
+    // Every operation on one generated file, opened cold and after saving
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/qtedit_bench.%s", filetype);
+    writeFile(path, filetype, size);
+    char *cache = sidecarPath(path, CACHE_SUFFIX);
+    unlink(cache); // Left by an earlier run
+    struct stat st;
+    stat(path, &st);
+    type = filetype;
+    bytes = st.st_size;
+
+    long long start = monotonicNs();
+    eopen(path);
+    report("open", 1, monotonicNs() - start);
+
+    start = monotonicNs();
+    renderSyntax(E.doc);
+    report("highlight_rows", E.doc->numrows, monotonicNs() - start);
+
+    benchRows("top", 0, 0);
+    benchRows("middle", 0, 0.5);
+    benchRows("bottom", 1, 0);
+    benchLongLine("insert_char_1k", 1024, BENCH_OPS);
+    benchLongLine("insert_char_64k", 65536, BENCH_OPS / 10);
+    benchSearch(strcmp(filetype, "log") == 0 ? "status=500" : "render");
+
+    benchFrames("frame_top", 0);
+    benchFrames("frame_middle", E.doc->numrows / 2);
+    benchFrames("frame_bottom", E.doc->numrows - 1);
+
+    start = monotonicNs();
+    esave();
+    report("save", 1, monotonicNs() - start);
+    eclose();
+
+    // Large highlighted files left a cache when saved, so only the rows shown get lexed
+    start = monotonicNs();
+    eopen(path);
+    report("open_saved", 1, monotonicNs() - start);
+    E.cy = E.doc->numrows / 2;
+    start = monotonicNs();
+    drawFrame();
+    report("frame_first", 1, monotonicNs() - start);
+    eclose();
+
+    unlink(cache);
+    unlink(path);
+    free(cache);
+}
+
+int main(int argc, char *argv[])
+{
+    // Usage: edit [bytes...], every size is run for a C, a TypeScript and a log file
+    long sizes[16] = {1048576, 16777216};
+    int nsizes = 2;
+    if (argc > 1)
+    {
+        nsizes = 0;
+        for (int i = 1; i < argc && nsizes < 16; i++)
+            sizes[nsizes++] = atol(argv[i]);
+    }
+
+    E.headless = 1;
+    E.undo_limit = UNDO_LIMIT * 1048576L;
+    E.windows = calloc(1, sizeof(struct window));
+    E.nwindows = 1;
+    E.watchfd = -1;
+    newBuffer();
+    resizeWindows(BENCH_ROWS - 1, BENCH_COLS); // The status line is below the windows
+
+    printf("# op type bytes ops seconds ns_per_op\n");
+    static const char *types[] = {"c", "ts", "log"};
+    for (int s = 0; s < nsizes; s++)
+        for (int t = 0; t < 3; t++)
+            benchFile(types[t], sizes[s]);
+    return 0;
+}
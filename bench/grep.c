@@ -0,0 +1,82 @@
+/* IMPORTS */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../core.h"
+
+/* BENCH */
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void benchSearch(const char *name, const char *dir, const char *query, int flags)
+{
+    // Walk and search the tree the way project search does, batch by batch
+    double t = now();
+    struct grepTree tree;
+    grepWalk(&tree, dir);
+    double walked = now();
+
+    struct searchQuery q;
+    compileQuery(&q, query, flags);
+    struct grepJob job;
+    job.q = &q;
+    job.tree = &tree;
+    job.results = malloc(sizeof(struct grepResult) * GREP_BATCH);
+    long hits = 0, bytes = 0;
+    for (int done = 0; done < tree.nfiles; done += job.count)
+    {
+        job.first = done;
+        job.count = (tree.nfiles - done < GREP_BATCH) ? tree.nfiles - done : GREP_BATCH;
+        job.nparts = (job.count < poolSize() * 4) ? job.count : poolSize() * 4;
+        poolRun(grepPart, &job, job.nparts);
+        for (int i = 0; i < job.count; i++)
+        {
+            hits += job.results[i].hits;
+            bytes += job.results[i].bytes;
+            free(job.results[i].out);
+        }
+    }
+    double secs = now() - t;
+
+    printf("%-24s %8d files %10ld bytes walk %7.4f s total %7.4f s %7.3f GB/s %8ld hits\n",
+           name, tree.nfiles, bytes,
+           walked - t, secs, bytes / secs / 1e9, hits);
+    free(job.results);
+    freeQuery(&q);
+    grepFreeTree(&tree);
+}
+
+static void benchCommand(const char *name, const char *fmt, const char *dir, const char *query)
+{
+    // An external tool over the same tree, for comparison
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), fmt, query, dir);
+    double t = now();
+    int status = system(cmd);
+    printf("%-24s %s (exit %d) %7.4f s\n", name, cmd, status, now() - t);
+}
+
+int main(int argc, char *argv[])
+{
+    // Usage: grep [directory] [query]
+    const char *dir = argc > 1 ? argv[1] : ".";
+    const char *query = argc > 2 ? argv[2] : "static";
+    printf("%d worker threads\n", poolSize());
+
+    benchSearch("project search", dir, query, 0);
+    benchSearch("project search icase", dir, query, SEARCH_ICASE);
+    benchSearch("project search regex", dir, query, SEARCH_REGEX);
+    benchCommand("grep -rnF", "grep -rnF -e '%s' '%s' > /dev/null", dir, query);
+    benchCommand("grep -rniF", "grep -rniF -e '%s' '%s' > /dev/null", dir, query);
+    return 0;
+}
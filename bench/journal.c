@@ -0,0 +1,112 @@
+/* IMPORTS */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../core.h"
+
+/* DATA */
+
+static struct document doc; // Text the benchmarks run on
+
+/* BENCH */
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void writeFile(const char *path, int rows)
+{
+    // A file of tab indented lines, like source code
+    FILE *fp = fopen(path, "w");
+    for (int r = 0; r < rows; r++)
+        fprintf(fp, "\tint value%d = render(buffer, index + %d);\n", r, r * 7);
+    fclose(fp);
+}
+
+static double typeKeys(long keys, long pause_us)
+{
+    // Type keys spread over the rows the way undo and highlighting see them, returns
+    // the seconds spent in the edits alone
+    double spent = 0;
+    for (long i = 0; i < keys; i++)
+    {
+        erow *row = &doc.row[(i / 8) % doc.numrows];
+        double start = now();
+        rowInsertChar(&doc, row, 1 + i % 8, 'a' + i % 26);
+        spent += now() - start;
+        if (pause_us)
+            usleep(pause_us);
+    }
+    return spent;
+}
+
+static void report(const char *name, long keys, double secs)
+{
+    printf("%-24s %10ld keys %8.4f s %8.3f us/key\n", name, keys, secs, secs / keys * 1e6);
+}
+
+static void reportCommits(const char *name)
+{
+    // Records and syncs since the last report, once the writer caught up
+    static long records = 0, commits = 0;
+    pthread_mutex_lock(&doc.journal.lock);
+    long r = doc.journal.records - records;
+    long c = doc.journal.commits - commits;
+    records = doc.journal.records;
+    commits = doc.journal.commits;
+    pthread_mutex_unlock(&doc.journal.lock);
+    printf("%-24s %10ld records %8ld commits %6.1f records/commit\n", name, r, c, c ? (double)r / c : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+    // Usage: journal [keys] [rows]
+    long keys = argc > 1 ? atol(argv[1]) : 200000;
+    int rows = argc > 2 ? atoi(argv[2]) : 100000;
+    const char *path = "/tmp/qtedit_bench_journal.c";
+    writeFile(path, rows);
+    docInit(&doc);
+
+    docOpen(&doc, path);
+    report("no journal", keys, typeKeys(keys, 0));
+    docClear(&doc);
+
+    docOpen(&doc, path);
+    docJournal(&doc);
+    report("journal", keys, typeKeys(keys, 0));
+    usleep(JOURNAL_BATCH_MS * 4000);
+    reportCommits("group commit, burst");
+    long paced = 2000;
+    report("journal, 2 ms apart", paced, typeKeys(paced, 2000));
+    usleep(JOURNAL_BATCH_MS * 4000);
+    reportCommits("group commit, paced");
+    int len;
+    char *want = rowsToString(&doc, &len);
+    docJournalClose(&doc, 1);
+    docClear(&doc);
+
+    docOpen(&doc, path);
+    double start = now();
+    int ops = docRecover(&doc);
+    double secs = now() - start;
+    int gotlen;
+    char *got = rowsToString(&doc, &gotlen);
+    printf("%-24s %10d records %8.4f s %8.3f us/record %s\n", "replay", ops, secs, secs / ops * 1e6,
+           (gotlen == len && memcmp(got, want, len) == 0) ? "text matches" : "TEXT DIFFERS");
+    free(got);
+    free(want);
+
+    docJournal(&doc); // Takes over the journal with a copy of the text
+    docJournalClose(&doc, 0);
+    unlink(path);
+    return 0;
+}
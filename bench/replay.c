@@ -0,0 +1,543 @@
+/* IMPORTS */
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include "../term.h"
+
+/* DATA */
+
+#define REPLAY_SETTLE 100 // Milliseconds without output after which a step is drawn
+#define REPLAY_WAIT 5000  // Milliseconds a step may take to start drawing
+
+struct cell
+{
+    char ch[5]; // UTF-8 of the character shown, empty for a blank
+};
+
+struct vt
+{
+    int rows, cols;
+    struct cell *cells;
+    int cy, cx;        // Cursor, from 0
+    int wrap;          // A character went in the last column, the next one wraps
+    int hidden;        // Cursor hidden
+    int state;         // Where in an escape sequence the parser is, see vtFeed
+    char seq[64];      // Parameters of the sequence being parsed
+    int seqlen;
+    int utf8;          // Bytes of the character being read still to come
+    long bytes;        // Bytes fed
+    long escapes;      // Escape sequences fed
+    long frames;       // Frames begun, every refreshScreen hides the cursor first
+    long frame_escapes; // Escapes since the current frame began
+    long max_escapes;  // Most escapes a frame had
+    int master;        // Where replies to queries go
+};
+
+enum vtState
+{
+    VT_TEXT = 0,
+    VT_ESC,
+    VT_CSI,
+    VT_OSC,
+    VT_OSC_ESC
+};
+
+/* TERMINAL */
+
+static struct cell *vtCell(struct vt *t, int y, int x)
+{
+    return &t->cells[y * t->cols + x];
+}
+
+static void vtClear(struct vt *t, int y, int from, int to)
+{
+    // Blank columns from to to (exclusive) of a row
+    for (int x = from; x < to; x++)
+        vtCell(t, y, x)->ch[0] = '\0';
+}
+
+static void vtLineFeed(struct vt *t)
+{
+    if (t->cy + 1 < t->rows)
+    {
+        t->cy++;
+        return;
+    }
+    memmove(t->cells, &t->cells[t->cols], sizeof(struct cell) * t->cols * (t->rows - 1));
+    vtClear(t, t->rows - 1, 0, t->cols);
+}
+
+static void vtPut(struct vt *t, unsigned char c)
+{
+    // Put a byte of text at the cursor, continuation bytes join the character before
+    if (t->utf8 > 0 && (c & 0xc0) == 0x80)
+    {
+        int x = t->wrap ? t->cx : t->cx - 1;
+        struct cell *cell = vtCell(t, t->cy, x < 0 ? 0 : x);
+        int len = strlen(cell->ch);
+        if (len < 4)
+        {
+            cell->ch[len] = c;
+            cell->ch[len + 1] = '\0';
+        }
+        t->utf8--;
+        return;
+    }
+    t->utf8 = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+    if (t->wrap)
+    {
+        t->cx = 0;
+        vtLineFeed(t);
+        t->wrap = 0;
+    }
+    struct cell *cell = vtCell(t, t->cy, t->cx);
+    cell->ch[0] = c;
+    cell->ch[1] = '\0';
+    if (t->cx + 1 < t->cols)
+        t->cx++;
+    else
+        t->wrap = 1;
+}
+
+static int vtParam(struct vt *t, int n, int def)
+{
+    // The nth number of the sequence's parameters, def if left out or 0
+    const char *p = t->seq;
+    if (*p == '?')
+        p++;
+    for (int i = 0; i < n && p; i++)
+    {
+        p = strchr(p, ';');
+        if (p)
+            p++;
+    }
+    int v = p ? atoi(p) : 0;
+    return v ? v : def;
+}
+
+static void vtCursor(struct vt *t, int y, int x)
+{
+    t->cy = y < 0 ? 0 : y >= t->rows ? t->rows - 1 : y;
+    t->cx = x < 0 ? 0 : x >= t->cols ? t->cols - 1 : x;
+    t->wrap = 0;
+}
+
+static void vtCSI(struct vt *t, char final)
+{
+    // Apply a control sequence, the ones the editor draws with
+    int n = vtParam(t, 0, 1);
+    switch (final)
+    {
+    case 'H':
+    case 'f':
+        vtCursor(t, vtParam(t, 0, 1) - 1, vtParam(t, 1, 1) - 1);
+        break;
+    case 'A':
+        vtCursor(t, t->cy - n, t->cx);
+        break;
+    case 'B':
+        vtCursor(t, t->cy + n, t->cx);
+        break;
+    case 'C':
+        vtCursor(t, t->cy, t->cx + n);
+        break;
+    case 'D':
+        vtCursor(t, t->cy, t->cx - n);
+        break;
+    case 'K':
+    {
+        int mode = vtParam(t, 0, 0);
+        vtClear(t, t->cy, mode == 0 ? t->cx : 0, mode == 1 ? t->cx + 1 : t->cols);
+        break;
+    }
+    case 'J':
+    {
+        int mode = vtParam(t, 0, 0);
+        for (int y = 0; y < t->rows; y++)
+            if ((mode == 0 && y > t->cy) || (mode == 1 && y < t->cy) || mode == 2)
+                vtClear(t, y, 0, t->cols);
+        if (mode == 0)
+            vtClear(t, t->cy, t->cx, t->cols);
+        else if (mode == 1)
+            vtClear(t, t->cy, 0, t->cx + 1);
+        break;
+    }
+    case 'h':
+    case 'l':
+        if (strcmp(t->seq, "?25") == 0)
+        {
+            t->hidden = final == 'l';
+            if (t->hidden)
+            {
+                // A frame begins
+                t->frames++;
+                t->frame_escapes = 0;
+            }
+        }
+        break;
+    case 'n':
+        if (vtParam(t, 0, 0) == 6)
+        {
+            char reply[32];
+            int len = snprintf(reply, sizeof(reply), "\x1b[%d;%dR", t->cy + 1, t->cx + 1);
+            if (write(t->master, reply, len) != len)
+                perror("write");
+        }
+        break;
+    }
+}
+
+static void vtEscape(struct vt *t)
+{
+    // An escape sequence ended
+    t->escapes++;
+    t->frame_escapes++;
+    if (t->frame_escapes > t->max_escapes)
+        t->max_escapes = t->frame_escapes;
+}
+
+static void vtFeed(struct vt *t, const char *s, long len)
+{
+    // Parse what the editor wrote into the screen
+    t->bytes += len;
+    for (long i = 0; i < len; i++)
+    {
+        unsigned char c = s[i];
+        switch (t->state)
+        {
+        case VT_TEXT:
+            if (c == '\x1b')
+                t->state = VT_ESC;
+            else if (c == '\r')
+                vtCursor(t, t->cy, 0);
+            else if (c == '\n')
+                vtLineFeed(t);
+            else if (c == '\b')
+                vtCursor(t, t->cy, t->cx - 1);
+            else if (c == '\t')
+                vtCursor(t, t->cy, (t->cx / 8 + 1) * 8);
+            else if (c >= ' ' && c != 0x7f)
+                vtPut(t, c);
+            break;
+        case VT_ESC:
+            t->seqlen = 0;
+            t->seq[0] = '\0';
+            t->state = c == '[' ? VT_CSI : c == ']' ? VT_OSC : VT_TEXT;
+            if (t->state == VT_TEXT)
+                vtEscape(t);
+            break;
+        case VT_CSI:
+            if (c >= 0x40 && c <= 0x7e)
+            {
+                vtCSI(t, c);
+                vtEscape(t);
+                t->state = VT_TEXT;
+            }
+            else if (t->seqlen + 1 < (int)sizeof(t->seq))
+            {
+                t->seq[t->seqlen++] = c;
+                t->seq[t->seqlen] = '\0';
+            }
+            break;
+        case VT_OSC:
+            // Clipboard copies and titles, ended by BEL or ESC backslash
+            if (c == '\a')
+            {
+                vtEscape(t);
+                t->state = VT_TEXT;
+            }
+            else if (c == '\x1b')
+                t->state = VT_OSC_ESC;
+            break;
+        case VT_OSC_ESC:
+            vtEscape(t);
+            t->state = VT_TEXT;
+            break;
+        }
+    }
+}
+
+static void vtPrint(struct vt *t, FILE *fp)
+{
+    // The screen as text, rows with their trailing blanks cut, then the cursor
+    fprintf(fp, "screen %d %d\n", t->rows, t->cols);
+    for (int y = 0; y < t->rows; y++)
+    {
+        int end = t->cols;
+        while (end > 0 && vtCell(t, y, end - 1)->ch[0] == '\0')
+            end--;
+        fputc('|', fp);
+        for (int x = 0; x < end; x++)
+        {
+            const char *ch = vtCell(t, y, x)->ch;
+            fputs(ch[0] ? ch : " ", fp);
+        }
+        fputc('\n', fp);
+    }
+    fprintf(fp, "cursor %d %d%s\n", t->cy + 1, t->cx + 1, t->hidden ? " hidden" : "");
+}
+
+/* EDITOR */
+
+static pid_t startEditor(char **argv, int rows, int cols, int *master)
+{
+    // Run the editor on a new pseudo-terminal of the given size
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd == -1 || grantpt(fd) == -1 || unlockpt(fd) == -1)
+    {
+        perror("posix_openpt");
+        exit(1);
+    }
+    struct winsize ws = {.ws_row = rows, .ws_col = cols};
+    char *slave = ptsname(fd);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        setsid();
+        int s = open(slave, O_RDWR);
+        if (s == -1)
+            _exit(127);
+        ioctl(s, TIOCSCTTY, 0);
+        ioctl(s, TIOCSWINSZ, &ws);
+        dup2(s, STDIN_FILENO);
+        dup2(s, STDOUT_FILENO);
+        dup2(s, STDERR_FILENO);
+        close(s);
+        close(fd);
+        setenv("TERM", "xterm-256color", 0);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    *master = fd;
+    return pid;
+}
+
+static int drain(struct vt *t, int timeout)
+{
+    // Feed the output to the screen until the editor has been quiet for a while,
+    // waiting up to timeout for it to start. Returns 0 once the editor exited.
+    char buf[65536];
+    struct pollfd pfd = {.fd = t->master, .events = POLLIN};
+    int wait = timeout;
+    while (poll(&pfd, 1, wait) > 0)
+    {
+        ssize_t n = read(t->master, buf, sizeof(buf));
+        if (n <= 0)
+            return 0; // EIO once the slave side is closed
+        vtFeed(t, buf, n);
+        wait = REPLAY_SETTLE;
+    }
+    return 1;
+}
+
+/* SCRIPT */
+
+static int unescape(char *s)
+{
+    // Keys of a script line: \e escape, \r, \n, \t, \xHH, \\, and ^X for Ctrl-X
+    // (\^ for a caret). Returns the length.
+    char *out = s;
+    for (char *p = s; *p; p++)
+    {
+        if (*p == '^' && p[1])
+        {
+            *out++ = p[1] == '?' ? 0x7f : (p[1] & 0x1f);
+            p++;
+        }
+        else if (*p == '\\' && p[1])
+        {
+            p++;
+            if (*p == 'e')
+                *out++ = '\x1b';
+            else if (*p == 'r')
+                *out++ = '\r';
+            else if (*p == 'n')
+                *out++ = '\n';
+            else if (*p == 't')
+                *out++ = '\t';
+            else if (*p == 'x' && p[1] && p[2])
+            {
+                char hex[3] = {p[1], p[2], '\0'};
+                *out++ = strtol(hex, NULL, 16);
+                p += 2;
+            }
+            else
+                *out++ = *p;
+        }
+        else
+        {
+            *out++ = *p;
+        }
+    }
+    *out = '\0';
+    return out - s;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-r rows] [-c cols] [-b max_bytes] [-s screen_file] [-v] script -- editor [args...]\n",
+            name);
+    fprintf(stderr, "Every line of script is a step of keys sent at once, drawn before the next is sent.\n");
+    fprintf(stderr, "Lines starting with # are comments, *N before the keys sends them N times.\n");
+    fprintf(stderr, "The final screen is compared with screen_file, written to it if it does not exist.\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    int rows = 24, cols = 80;
+    long max_bytes = 0;
+    const char *golden = NULL;
+    int verbose = 0;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && strcmp(argv[i], "--") != 0; i++)
+    {
+        if (strcmp(argv[i], "-v") == 0)
+            verbose = 1;
+        else if (i + 1 >= argc)
+            usage(argv[0]);
+        else if (strcmp(argv[i], "-r") == 0)
+            rows = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0)
+            cols = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-b") == 0)
+            max_bytes = atol(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0)
+            golden = argv[++i];
+        else
+            usage(argv[0]);
+    }
+    if (i + 2 >= argc || strcmp(argv[i + 1], "--") != 0 || rows < 2 || cols < 2)
+        usage(argv[0]);
+    FILE *script = fopen(argv[i], "r");
+    if (!script)
+    {
+        perror(argv[i]);
+        return 2;
+    }
+
+    struct vt t;
+    memset(&t, 0, sizeof(t));
+    t.rows = rows;
+    t.cols = cols;
+    t.cells = calloc(rows * cols, sizeof(struct cell));
+    signal(SIGPIPE, SIG_IGN);
+    pid_t pid = startEditor(&argv[i + 2], rows, cols, &t.master);
+    int alive = drain(&t, REPLAY_WAIT);
+    printf("# step bytes frames escapes\n");
+    printf("step %-4d %10ld %6ld %8ld\n", 0, t.bytes, t.frames, t.escapes);
+
+    // Steps, each drawn before the next one is sent
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    int step = 0;
+    while (alive && (linelen = getline(&line, &linecap, script)) != -1)
+    {
+        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+            line[--linelen] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+        char *keys = line;
+        long times = 1;
+        if (keys[0] == '*')
+        {
+            times = strtol(&keys[1], &keys, 10);
+            while (*keys == ' ')
+                keys++;
+        }
+        int len = unescape(keys);
+        for (long n = 0; n < times && alive; n++)
+        {
+            long bytes = t.bytes, frames = t.frames, escapes = t.escapes;
+            if (write(t.master, keys, len) != len)
+                break;
+            alive = drain(&t, REPLAY_WAIT);
+            step++;
+            printf("step %-4d %10ld %6ld %8ld\n", step, t.bytes - bytes, t.frames - frames, t.escapes - escapes);
+            if (verbose)
+                vtPrint(&t, stdout);
+        }
+    }
+    free(line);
+    fclose(script);
+
+    // The screen the script left, before quitting draws over it
+    char *screen = NULL;
+    size_t screenlen = 0;
+    FILE *mem = open_memstream(&screen, &screenlen);
+    vtPrint(&t, mem);
+    fclose(mem);
+    for (int q = 0; q < QUIT_PROT + 1 && alive; q++)
+    {
+        if (write(t.master, "\x18", 1) != 1)
+            break;
+        alive = drain(&t, REPLAY_SETTLE);
+    }
+    if (alive)
+        kill(pid, SIGTERM);
+    int status;
+    waitpid(pid, &status, 0);
+    close(t.master);
+
+    printf("bytes %ld\n", t.bytes);
+    printf("frames %ld\n", t.frames);
+    printf("escapes %ld\n", t.escapes);
+    printf("bytes_per_frame %.1f\n", t.frames ? (double)t.bytes / t.frames : 0.0);
+    printf("escapes_per_frame %.1f\n", t.frames ? (double)t.escapes / t.frames : 0.0);
+    printf("max_escapes_per_frame %ld\n", t.max_escapes);
+    fputs(screen, stdout);
+
+    int failed = 0;
+    if (max_bytes && t.bytes > max_bytes)
+    {
+        printf("FAIL %ld bytes written, over the %ld allowed\n", t.bytes, max_bytes);
+        failed = 1;
+    }
+    if (golden)
+    {
+        FILE *fp = fopen(golden, "r");
+        if (!fp)
+        {
+            // Nothing to compare with yet, so this screen becomes what is expected
+            fp = fopen(golden, "w");
+            if (!fp || fwrite(screen, 1, screenlen, fp) != screenlen)
+                perror(golden);
+            else
+                printf("screen written to %s\n", golden);
+        }
+        else
+        {
+            char *want = malloc(screenlen + 2);
+            size_t wantlen = fread(want, 1, screenlen + 1, fp);
+            if (wantlen != screenlen || memcmp(want, screen, screenlen) != 0)
+            {
+                printf("FAIL screen differs from %s\n", golden);
+                failed = 1;
+            }
+            else
+            {
+                printf("screen matches %s\n", golden);
+            }
+            free(want);
+        }
+        if (fp)
+            fclose(fp);
+    }
+    free(screen);
+    free(t.cells);
+    return failed;
+}
@@ -0,0 +1,253 @@
+/* IMPORTS */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../core.h"
+
+/* DATA */
+
+static struct document doc; // Text the benchmarks run on
+
+/* CHECKS */
+
+struct regexCase
+{
+    const char *pattern;
+    const char *text;
+    const char *matches; // Every match find reports, as "start-end" spans apart by spaces
+};
+
+static const struct regexCase regexCases[] = {
+    {"a$|b", "xa", "1-2"},
+    {"a$|b", "a$b", "2-3"},
+    {"(a$)", "xa", "1-2"},
+    {"a$b", "a$b", ""},
+    {"a\\$b", "a$b", "0-3"},
+    {"c$", "abc abc", "6-7"},
+    {"a(b$|c)", "abacab", "2-4 4-6"},
+    {"^a|b", "bab", "0-1 2-3"},
+    {"x|^a", "aa", "0-1"},
+    {"(^|x)a", "aaxa", "0-1 2-4"},
+    {"a*$", "baa", "1-3"},
+    {"b|abc", "abc", "0-3"},
+    {"abcd|c", "abcd", "0-4"},
+    {"xabc|b", "xabc", "0-4"},
+    {"abcde|bcdefgh|c", "abcdefgh", "0-5"},
+    {"(a|ab)(c|bcd)", "abcd", "0-4"},
+};
+
+static int checkRegex(void)
+{
+    // Step through the matches of each case the way find does, returns how many failed
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(regexCases) / sizeof(regexCases[0]); i++)
+    {
+        const struct regexCase *c = &regexCases[i];
+        struct searchQuery q;
+        char got[256] = "";
+        if (compileQuery(&q, c->pattern, SEARCH_REGEX) == -1)
+        {
+            snprintf(got, sizeof(got), "error: %s", q.error);
+        }
+        else
+        {
+            int len = strlen(c->text), from = 0, at, mlen, used = 0;
+            while (from < len && (at = findMatch(&q, c->text, len, from, &mlen)) != -1)
+            {
+                used += snprintf(&got[used], sizeof(got) - used, "%s%d-%d", used ? " " : "", at, at + mlen);
+                from = nextMatchFrom(&q, at, mlen);
+            }
+        }
+        freeQuery(&q);
+        if (strcmp(got, c->matches) != 0)
+        {
+            printf("FAIL regex \"%s\" on \"%s\": got \"%s\", want \"%s\"\n", c->pattern, c->text, got, c->matches);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+/* BENCH */
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fillRows(long bytes, int maxwords)
+{
+    // Fill the editor with pseudo-random words, tab indented like source code
+    static const char *words[] = {"int", "return", "static", "buffer", "index", "value",
+                                  "render", "struct", "while", "length", "config", "row"};
+    char *line = malloc(maxwords * 8 + 8);
+    unsigned int seed = 12345;
+    long total = 0;
+    while (total < bytes)
+    {
+        int len = 0;
+        int indent = seed % 3;
+        for (int i = 0; i < indent; i++)
+            line[len++] = '\t';
+        int nwords = maxwords / 2 + (seed >> 8) % (maxwords / 2 + 1);
+        for (int w = 0; w < nwords; w++)
+        {
+            seed = seed * 1103515245 + 12345;
+            const char *word = words[(seed >> 16) % 12];
+            int wl = strlen(word);
+            memcpy(&line[len], word, wl);
+            len += wl;
+            line[len++] = ' ';
+        }
+        insertRow(&doc, doc.numrows, line, len);
+        total += len + 1;
+    }
+    free(line);
+}
+
+static void clearRows(void)
+{
+    docClear(&doc);
+    doc.undo.suspended = 1; // Cleared along with the undo log
+}
+
+static long rowBytes(void)
+{
+    long total = 0;
+    for (int i = 0; i < doc.numrows; i++)
+        total += doc.row[i].size;
+    return total;
+}
+
+static void report(const char *name, long bytes, double secs, long hits)
+{
+    printf("%-24s %10ld bytes %8.4f s %7.3f GB/s %8ld hits\n", name, bytes, secs, bytes / secs / 1e9, hits);
+}
+
+static void benchLegacy(const char *query, long bytes)
+{
+    // The loop find used before: strstr over every rendered row
+    double t = now();
+    long hits = 0;
+    for (int i = 0; i < doc.numrows; i++)
+        if (strstr(doc.row[i].render, query))
+            hits++;
+    report("strstr(render)", bytes, now() - t, hits);
+}
+
+static void benchEngine(const char *name, const char *query, int flags, long bytes)
+{
+    double t = now();
+    struct searchQuery q;
+    compileQuery(&q, query, flags);
+    long hits = 0;
+    for (int i = 0; i < doc.numrows; i++)
+        if (findInText(&q, doc.row[i].chars, doc.row[i].size, 0) != -1)
+            hits++;
+    freeQuery(&q);
+    report(name, bytes, now() - t, hits);
+}
+
+static void benchRegex(const char *pattern, long bytes)
+{
+    // Lazy-DFA regex search, rows with at least one match
+    char name[64];
+    snprintf(name, sizeof(name), "regex %.18s", pattern);
+    double t = now();
+    struct searchQuery q;
+    compileQuery(&q, pattern, SEARCH_REGEX);
+    long hits = 0;
+    int mlen;
+    for (int i = 0; i < doc.numrows; i++)
+        if (findMatch(&q, doc.row[i].chars, doc.row[i].size, 0, &mlen) != -1)
+            hits++;
+    freeQuery(&q);
+    report(name, bytes, now() - t, hits);
+}
+
+static void benchIndex(const char *name, const char *query, long bytes)
+{
+    // Whole-buffer match index built across the worker pool
+    double t = now();
+    struct searchQuery q;
+    compileQuery(&q, query, 0);
+    struct searchMatch *matches;
+    int count;
+    collectMatches(&doc, &q, NULL, &matches, &count);
+    freeQuery(&q);
+    free(matches);
+    report(name, bytes, now() - t, count);
+}
+
+static void benchTrigram(long bytes)
+{
+    // A literal on a handful of rows, found with and without the trigram index
+    const char *marker = " trigram_marker";
+    for (int i = 1; i <= 4; i++)
+        rowAppendString(&doc, &doc.row[(long)doc.numrows * i / 5], (char *)marker, strlen(marker));
+    benchIndex("rare literal (scan)", marker + 1, bytes);
+
+    double t = now();
+    trigramInit(&doc.trigrams);
+    while (trigramBuildStep(&doc.trigrams, doc.row, doc.numrows, TRIGRAM_STEP_BYTES))
+        ;
+    report("trigram build", bytes, now() - t, doc.trigrams.nblocks);
+    printf("%-24s %10zu bytes %8ld entries\n", "trigram memory", trigramMemory(&doc.trigrams), doc.trigrams.entries);
+
+    benchIndex("rare literal (trigram)", marker + 1, bytes);
+    trigramFree(&doc.trigrams);
+}
+
+static void benchReplace(const char *query, const char *with, long bytes)
+{
+    // Batched replace-all: rows rewritten across the pool, each re-highlighted once
+    double t = now();
+    struct searchQuery q;
+    compileQuery(&q, query, 0);
+    long count = replaceMatches(&doc, &q, with, 0, 0, doc.numrows, 0);
+    freeQuery(&q);
+    report("replace all", bytes, now() - t, count);
+}
+
+static void runSuite(const char *label, long bytes, int maxwords, const char *query)
+{
+    fillRows(bytes, maxwords);
+    long total = rowBytes();
+    printf("%s: %d rows, query \"%s\"\n", label, doc.numrows, query);
+
+    benchLegacy(query, total);
+    benchEngine("findInText", query, 0, total);
+    benchEngine("findInText icase", query, SEARCH_ICASE, total);
+    benchEngine("findInText word", query, SEARCH_WORD, total);
+    benchIndex("collectMatches (pool)", query, total);
+    benchRegex("length\\s+con\\w+", total);
+    benchRegex("(value|index) [rs]\\w*t", total);
+    benchTrigram(total);
+    benchReplace("config", "setting", total);
+    clearRows();
+}
+
+int main(int argc, char *argv[])
+{
+    // Usage: search [megabytes] [query]
+    long mb = argc > 1 ? atol(argv[1]) : 64;
+    const char *query = argc > 2 ? argv[2] : "length config";
+    int failed = checkRegex();
+    printf("%zu regex checks, %d failed\n", sizeof(regexCases) / sizeof(regexCases[0]), failed);
+    if (failed)
+        return 1;
+    printf("%d worker threads\n", poolSize());
+    docInit(&doc);
+    doc.undo.suspended = 1; // Nothing here is undone, so skip logging edits
+
+    runSuite("short lines", mb * 1024 * 1024, 12, query);
+    runSuite("long lines", mb * 1024 * 1024, 800, query);
+    return 0;
+}
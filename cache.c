@@ -0,0 +1,165 @@
+/* IMPORTS */
+
+#include <stdint.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/* DATA */
+
+#define CACHE_MAGIC "QTCACHE2" // First bytes of every cache, without a NUL
+
+struct cacheHeader
+{
+    char magic[8];
+    int64_t size;      // File the cache is of
+    int64_t mtime;     // Nanoseconds, see statMtime
+    uint64_t hash;     // cacheHash of its bytes
+    int64_t rows;
+    char syntax[16];   // Filetype the comment states were lexed with
+};
+
+// Followed by the bytes each line takes in the file (uint32_t, newline and carriage
+// returns included), then one bit per row: if the row leaves a comment open
+
+/* FUNCTIONS */
+
+uint64_t cacheHash(const char *s, long len)
+{
+    // Hash of a file's bytes, eight at a time so it keeps up with reading them
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ (uint64_t)len;
+    long i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, &s[i], 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    uint64_t w = 0;
+    memcpy(&w, &s[i], len - i);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 33);
+}
+
+static void cacheSyntax(struct document *doc, char *name)
+{
+    memset(name, 0, 16);
+    if (doc->syntax)
+        strncpy(name, doc->syntax->filetype, 15);
+}
+
+int docCacheLoad(struct document *doc, const char *data, long size, long long mtime, uint64_t hash)
+{
+    // Build the rows of an empty document from the cache of its file, with the file's
+    // lines found and every row's comment state known, so nothing is lexed until it is
+    // drawn. Returns 0 if there is no cache of the file as it is.
+    char *path = sidecarPath(doc->filename, CACHE_SUFFIX);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    if (fd == -1)
+        return 0;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct cacheHeader))
+    {
+        close(fd);
+        return 0;
+    }
+    long csize = st.st_size;
+    char *cache = mmap(NULL, csize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (cache == MAP_FAILED)
+        return 0;
+
+    struct cacheHeader h;
+    char syntax[16];
+    memcpy(&h, cache, sizeof(h));
+    cacheSyntax(doc, syntax);
+    if (memcmp(h.magic, CACHE_MAGIC, sizeof(h.magic)) != 0 || h.size != size || h.mtime != mtime ||
+        h.hash != hash || memcmp(h.syntax, syntax, sizeof(syntax)) != 0 || h.rows < 0 || h.rows > INT_MAX ||
+        csize != (long)(sizeof(h) + h.rows * sizeof(uint32_t) + (h.rows + 7) / 8))
+    {
+        munmap(cache, csize);
+        return 0;
+    }
+    int n = h.rows;
+    const uint32_t *lens = (const uint32_t *)&cache[sizeof(h)];
+    const unsigned char *states = (const unsigned char *)&lens[n];
+    long total = 0;
+    for (int j = 0; j < n; j++)
+        total += lens[j];
+    if (total != size)
+    {
+        munmap(cache, csize);
+        return 0;
+    }
+
+    erow *rows = openRows(doc, doc->numrows, n);
+    long pos = 0;
+    for (int j = 0; j < n; j++)
+    {
+        long end = pos + lens[j];
+        long len = end;
+        if (len > pos && data[len - 1] == '\n')
+            len--;
+        while (len > pos && data[len - 1] == '\r')
+            len--;
+        rows[j].size = len - pos;
+        rows[j].chars = malloc(len - pos + 1);
+        memcpy(rows[j].chars, &data[pos], len - pos);
+        rows[j].chars[len - pos] = '\0';
+        renderRowText(&rows[j]);
+        rows[j].hl_open_comment = (states[j / 8] >> (j % 8)) & 1;
+        rows[j].hl_stale = doc->syntax ? HL_STALE_LAZY : 0;
+        pos = end;
+    }
+    munmap(cache, csize);
+    return 1;
+}
+
+void docCacheStore(struct document *doc, const uint32_t *lens, long size, long long mtime, uint64_t hash)
+{
+    // Write the cache of the document's file, which holds its text. lens has the bytes
+    // each row's line takes, NULL if every one ends in just a newline. The cache is
+    // written aside and renamed into place, and left out if it can't be.
+    struct cacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+    h.size = size;
+    h.mtime = mtime;
+    h.hash = hash;
+    h.rows = doc->numrows;
+    cacheSyntax(doc, h.syntax);
+
+    long len = sizeof(h) + doc->numrows * sizeof(uint32_t) + (doc->numrows + 7) / 8;
+    char *buf = calloc(len, 1);
+    memcpy(buf, &h, sizeof(h));
+    uint32_t *out = (uint32_t *)&buf[sizeof(h)];
+    unsigned char *states = (unsigned char *)&out[doc->numrows];
+    for (int j = 0; j < doc->numrows; j++)
+    {
+        out[j] = lens ? lens[j] : (uint32_t)doc->row[j].size + 1;
+        if (doc->row[j].hl_open_comment)
+            states[j / 8] |= 1 << (j % 8);
+    }
+
+    char *path = sidecarPath(doc->filename, CACHE_SUFFIX);
+    char *tmp = malloc(strlen(path) + 5);
+    sprintf(tmp, "%s.new", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd != -1)
+    {
+        ssize_t w = write(fd, buf, len);
+        close(fd);
+        if (w != len || rename(tmp, path) == -1)
+            unlink(tmp);
+    }
+    free(tmp);
+    free(path);
+    free(buf);
+}
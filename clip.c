@@ -0,0 +1,78 @@
+/* IMPORTS */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* FUNCTIONS */
+
+void killPush(struct killRing *ring, char *text, long len)
+{
+    // Keep a copy as the newest entry, taking ownership of text. The oldest one
+    // is dropped once the ring is full.
+    ring->head = (ring->head + 1) % KILL_RING_SIZE;
+    if (ring->count == KILL_RING_SIZE)
+        free(ring->text[ring->head]);
+    else
+        ring->count++;
+    ring->text[ring->head] = text;
+    ring->len[ring->head] = len;
+}
+
+const char *killGet(const struct killRing *ring, int back, long *len)
+{
+    // Entry copied back copies before the newest one, NULL if the ring is empty
+    if (ring->count == 0)
+        return NULL;
+    int at = ((ring->head - back % ring->count) % KILL_RING_SIZE + KILL_RING_SIZE) % KILL_RING_SIZE;
+    *len = ring->len[at];
+    return ring->text[at];
+}
+
+long base64Encode(const char *s, long len, char *out)
+{
+    // Write the base64 of s to out, which needs room for 4 bytes per 3 of s rounded up
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *p = (const unsigned char *)s;
+    long o = 0;
+    long i = 0;
+    for (; i + 2 < len; i += 3)
+    {
+        unsigned int v = p[i] << 16 | p[i + 1] << 8 | p[i + 2];
+        out[o++] = digits[v >> 18];
+        out[o++] = digits[(v >> 12) & 63];
+        out[o++] = digits[(v >> 6) & 63];
+        out[o++] = digits[v & 63];
+    }
+    if (i < len)
+    {
+        unsigned int v = p[i] << 16 | (i + 1 < len ? p[i + 1] << 8 : 0);
+        out[o++] = digits[v >> 18];
+        out[o++] = digits[(v >> 12) & 63];
+        out[o++] = (i + 1 < len) ? digits[(v >> 6) & 63] : '=';
+        out[o++] = '=';
+    }
+    return o;
+}
+
+int osc52Copy(int fd, const char *s, long len)
+{
+    // Set the terminal's clipboard with an OSC 52 sequence, built whole and sent in
+    // one write. Returns -1 if it could not be written.
+    long cap = 8 + (len + 2) / 3 * 4;
+    char *buf = malloc(cap);
+    memcpy(buf, "\x1b]52;c;", 7);
+    long n = 7 + base64Encode(s, len, &buf[7]);
+    buf[n++] = '\a';
+
+    long done = 0;
+    while (done < n)
+    {
+        ssize_t w = write(fd, &buf[done], n - done);
+        if (w <= 0)
+            break;
+        done += w;
+    }
+    free(buf);
+    return done == n ? 0 : -1;
+}
@@ -1,120 +1,157 @@
 /* IMPORTS */
 
-#include <termios.h>
+#define _DEFAULT_SOURCE
+
 #include <unistd.h>
 #include <stdlib.h>
-#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
-#include <stdarg.h>
-#include <time.h>
-#include <math.h>
 #include <fcntl.h>
+#include <limits.h>
 
 #include "core.h"
 #include "util.c"
-
-/* DATA */
-
-extern struct editorConfig E;
-
-/* PROTOTYPES */
-
-void setStatusMessage(const char *fmt, ...);
-
-void die(char *s);
-
-void resetScreen(void);
-
-void refreshScreen(void);
-
-char *askPrompt(char *prompt, void (*callback)(char *, int));
-
-void renderRowSyntax(erow *row);
-
-int syntaxToColor(int hl);
-
-void selectSyntax(void);
-
-void scroll(void);
-
-int getWindowSize(int *rows, int *cols);
-
-void clearSelection(void);
-
-void startSelection(void);
-
-void updateSelection(void);
-
-int isPositionSelected(int row, int col);
-
-void deleteSelection(void);
-
-void copySelection(void);
-
-void pasteFromClipboard(void);
+#include "search.c"
+#include "regex.c"
+#include "trigram.c"
+#include "undo.c"
+#include "journal.c"
+#include "cache.c"
+#include "hist.c"
+#include "mem.c"
+#include "pool.c"
+#include "grep.c"
+
+/* FILETYPES FOR HL */
+
+/** C **/
+char *C_HL_extensions[] = {".c", ".h", ".cpp", NULL};
+char *C_HL_keywords[] = {
+    "switch", "if", "while", "for", "break", "continue",
+    "enum", "case", "#include", "return", "else", "#define",
+    "int|", "long|", "double|", "float|", "char|", "unsigned|",
+    "void|", "extern|", "size_t|", "ssize_t|", "static|",
+    "struct|", "union|", "class|", "typedef|", "signed|",
+    "time_t|", NULL};
+
+/**  JS/TS **/
+char *JS_HL_extensions[] = {".js", ".jsx", NULL};
+char *JS_HL_keywords[] = {
+    "switch", "if", "while", "for", "break", "continue",
+    "case", "return", "else", "import", "from", "export",
+    "default", "async", "await", "try", "catch", "finally",
+    "function|", "const|", "var|", "class|", "static|",
+    "let|", "extends|", "keyof|", "typeof|", "in|",
+    "of|", "new|", "this|", NULL};
+
+char *TS_HL_extensions[] = {".ts", ".tsx", NULL};
+char *TS_HL_keywords[] = {
+    "switch", "if", "while", "for", "break", "continue",
+    "enum", "case", "return", "else", "import", "from", "export",
+    "default", "async", "await", "try", "catch", "finally",
+    "function|", "string|", "number|", "const|", "var|",
+    "interface|", "type|", "class|", "String|", "boolean|",
+    "let|", "public|", "extends|", "keyof|", "typeof|", "in|",
+    "of|", "new|", "this|", "static|", "private|", NULL};
+
+struct editorSyntax HLDB[] = {
+    {"c",
+     C_HL_extensions,
+     C_HL_keywords,
+     "//", "/*", "*/",
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+    {"javascript",
+     JS_HL_extensions,
+     JS_HL_keywords,
+     "//", "/*", "*/",
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+    {"typescript",
+     TS_HL_extensions,
+     TS_HL_keywords,
+     "//", "/*", "*/",
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
 /* ROW OPS */
 
-void renderRow(erow *row)
+void renderRowText(erow *row)
 {
-    // Changes row rendering for certain characters
+    // Changes row rendering for certain characters, copying the runs between tabs whole
     int t = 0;
-    int j;
-    for (j = 0; j < row->size; j++)
-        if (row->chars[j] == '\t')
-            t++;
+    const char *p = row->chars;
+    const char *end = row->chars + row->size;
+    while ((p = memchr(p, '\t', end - p)) != NULL)
+    {
+        t++;
+        p++;
+    }
 
     free(row->render);
     row->render = malloc(row->size + t * (TAB_STOP - 1) + 1);
 
     int i = 0;
-    for (j = 0; j < row->size; j++)
+    int j = 0;
+    while (j < row->size)
     {
-        if (row->chars[j] == '\t')
+        const char *tab = t ? memchr(&row->chars[j], '\t', row->size - j) : NULL;
+        int run = tab ? tab - &row->chars[j] : row->size - j;
+        memcpy(&row->render[i], &row->chars[j], run);
+        i += run;
+        j += run;
+        if (tab)
         {
             row->render[i++] = ' ';
             while (i % TAB_STOP != 0)
                 row->render[i++] = ' ';
-        }
-        else
-        {
-            row->render[i++] = row->chars[j];
+            j++;
         }
     }
     row->render[i] = '\0';
     row->rsize = i;
+}
 
-    renderRowSyntax(row);
+void renderRow(struct document *doc, erow *row)
+{
+    // Re-render an edited row and bring its highlighting and search indexes up to date
+    renderRowText(row);
+    renderRowSyntax(doc, row);
+    indexRowChanged(doc, row->index);
+    trigramRowChanged(&doc->trigrams, row->index, row->chars, row->size);
 }
 
-void insertRow(int at, char *s, size_t len)
+void insertRow(struct document *doc, int at, char *s, size_t len)
 {
     // Insert row to current text in memory
-    if (at < 0 || at > E.numrows)
+    if (at < 0 || at > doc->numrows)
         return;
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-    for (int j = at + 1; j <= E.numrows; j++)
-        E.row[j].index++;
-
-    E.row[at].index = at;
-
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
-
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    renderRow(&E.row[at]);
-
-    E.numrows++;
-    E.dirty++;
+    undoRecord(&doc->undo, UNDO_INSERT, at, 0, s, len, 1);
+    doc->row = realloc(doc->row, sizeof(erow) * (doc->numrows + 1));
+    memmove(&doc->row[at + 1], &doc->row[at], sizeof(erow) * (doc->numrows - at));
+    for (int j = at + 1; j <= doc->numrows; j++)
+        doc->row[j].index++;
+
+    doc->row[at].index = at;
+    indexRowsShifted(doc, at, 1);
+    trigramRowsInserted(&doc->trigrams, at, 1);
+
+    doc->row[at].size = len;
+    doc->row[at].chars = malloc(len + 1);
+    memcpy(doc->row[at].chars, s, len);
+    doc->row[at].chars[len] = '\0';
+
+    doc->row[at].rsize = 0;
+    doc->row[at].render = NULL;
+    doc->row[at].hl = NULL;
+    doc->row[at].hlsize = 0;
+    doc->row[at].hl_open_comment = (at > 0) ? doc->row[at - 1].hl_open_comment : 0; // What the next row was lexed with
+    doc->row[at].hl_stale = 0;
+    doc->numrows++;
+    renderRow(doc, &doc->row[at]);
+    doc->dirty++;
 }
 
 int getCursorRx(erow *row, int cx)
@@ -147,28 +184,30 @@ int getCursorCx(erow *row, int rx)
     return cx;
 }
 
-void rowInsertChar(erow *row, int at, char c)
+void rowInsertChar(struct document *doc, erow *row, int at, char c)
 {
     // Insert a character into a row at a specific position
     if (at < 0 || at > row->size)
         at = row->size;
+    undoRecord(&doc->undo, UNDO_INSERT, row->index, at, &c, 1, 0);
     row->chars = realloc(row->chars, row->size + 2);
     memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
     row->size++;
     row->chars[at] = c;
-    renderRow(row);
-    E.dirty++;
+    renderRow(doc, row);
+    doc->dirty++;
 }
 
-void rowDeleteChar(erow *row, int at)
+void rowDeleteChar(struct document *doc, erow *row, int at)
 {
     // Delete a character from a row at a specific position
     if (at < 0 || at >= row->size)
         return;
+    undoRecord(&doc->undo, UNDO_DELETE, row->index, at, &row->chars[at], 1, 0);
     memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
     row->size--;
-    renderRow(row);
-    E.dirty++;
+    renderRow(doc, row);
+    doc->dirty++;
 }
 
 void freeRow(erow *row)
@@ -179,181 +218,577 @@ void freeRow(erow *row)
     free(row->hl);
 }
 
-void deleteRow(int at)
+void deleteRow(struct document *doc, int at)
 {
     // Delete a row from the text in memory
-    if (at < 0 || at >= E.numrows)
+    if (at < 0 || at >= doc->numrows)
         return;
-    freeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    for (int j = at; j < E.numrows - 1; j++)
-        E.row[j].index--;
-    E.numrows--;
-    E.dirty++;
+    undoRecord(&doc->undo, UNDO_DELETE, at, 0, doc->row[at].chars, doc->row[at].size, 1);
+    int was = doc->row[at].hl_open_comment;
+    freeRow(&doc->row[at]);
+    memmove(&doc->row[at], &doc->row[at + 1], sizeof(erow) * (doc->numrows - at - 1));
+    for (int j = at; j < doc->numrows - 1; j++)
+        doc->row[j].index--;
+    doc->numrows--;
+    indexRowsDeleted(doc, at, 1);
+    trigramRowsDeleted(&doc->trigrams, at, 1);
+    if (at < doc->numrows && was != ((at > 0) ? doc->row[at - 1].hl_open_comment : 0))
+        renderRowSyntax(doc, &doc->row[at]); // The row below now follows a different comment state
+    doc->dirty++;
 }
 
-void rowAppendString(erow *row, char *s, size_t len)
+void rowAppendString(struct document *doc, erow *row, char *s, size_t len)
 {
     // Append a string to the end of a row
+    undoRecord(&doc->undo, UNDO_INSERT, row->index, row->size, s, len, 0);
     row->chars = realloc(row->chars, row->size + len + 1);
     memcpy(&row->chars[row->size], s, len);
     row->size += len;
     row->chars[row->size] = '\0';
-    renderRow(row);
-    E.dirty++;
+    renderRow(doc, row);
+    doc->dirty++;
 }
 
-/* OPS */
+char *rangeToString(struct document *doc, int r0, int c0, int r1, int c1, long *len)
+{
+    // Copy the text from (r0, c0) up to (r1, c1), with a newline after every row it
+    // leaves. (doc->numrows, 0) is the end of the text.
+    long total = 0;
+    for (int r = r0; r <= r1 && r < doc->numrows; r++)
+        total += doc->row[r].size + 1;
+    char *buf = malloc(total + 1);
+    char *p = buf;
+    for (int r = r0; r <= r1 && r < doc->numrows; r++)
+    {
+        erow *row = &doc->row[r];
+        int lo = (r == r0) ? c0 : 0;
+        int hi = (r == r1) ? c1 : row->size;
+        memcpy(p, &row->chars[lo], hi - lo);
+        p += hi - lo;
+        if (r < r1)
+            *p++ = '\n';
+    }
+    *p = '\0';
+    *len = p - buf;
+    return buf;
+}
 
-void insertChar(int c)
+erow *openRows(struct document *doc, int at, int n)
 {
-    // Insert char at cursor
-    int offset = log10(E.numrows) + 2; // Offset for line numbers
+    // Make room for n empty rows at `at` with a single move, for the caller to fill in
+    doc->row = realloc(doc->row, sizeof(erow) * (doc->numrows + n));
+    memmove(&doc->row[at + n], &doc->row[at], sizeof(erow) * (doc->numrows - at));
+    for (int j = at + n; j < doc->numrows + n; j++)
+        doc->row[j].index += n;
+    for (int j = at; j < at + n; j++)
+    {
+        doc->row[j].index = j;
+        doc->row[j].size = 0;
+        doc->row[j].chars = NULL;
+        doc->row[j].rsize = 0;
+        doc->row[j].render = NULL;
+        doc->row[j].hl = NULL;
+        doc->row[j].hlsize = 0;
+        doc->row[j].hl_open_comment = 0;
+        doc->row[j].hl_stale = 0;
+    }
+    doc->numrows += n;
+    indexRowsShifted(doc, at, n);
+    trigramRowsInserted(&doc->trigrams, at, n);
+    return &doc->row[at];
+}
 
-    if (E.cy == E.numrows)
+void renderRows(struct document *doc, int from, int to)
+{
+    // Highlight rows [from, to) once each after a bulk edit, going on below them only
+    // while the comment state still carries over, and update their search indexes.
+    // The last row must hold the comment state the row after it was highlighted with.
+    int carry = 0;
+    for (int r = from; r < doc->numrows && (r < to || carry); r++)
     {
-        if (E.numrows == 0)
+        carry = highlightRow(doc, &doc->row[r]);
+        if (r < to)
         {
-            E.cx = 2;
+            indexRowChanged(doc, r);
+            trigramRowChanged(&doc->trigrams, r, doc->row[r].chars, doc->row[r].size);
         }
-        insertRow(E.numrows, "", 0);
     }
-    rowInsertChar(&E.row[E.cy], E.cx - offset, c);
-    E.cx++;
 }
 
-void insertNewline(void)
+void insertText(struct document *doc, int r, int c, const char *s, long len)
 {
-    // Enter press basically
-    int offset = log10(E.numrows) + 2; // Offset for line numbers
-
-    erow *row = &E.row[E.cy];
-    char *indent = malloc(32);
-    int i = 0;
-    while (row->chars[i] == ' ' || row->chars[i] == '\t')
+    // Insert text that may span rows at (r, c). The rows it adds are spliced in with
+    // one move and every touched row is rendered once, so a paste costs its own size.
+    if (r < 0 || r > doc->numrows || len == 0)
+        return;
+    if (r == doc->numrows)
+        c = 0;
+    else if (c < 0 || c > doc->row[r].size)
+        c = doc->row[r].size;
+
+    // Rows past the end are newline terminated whether or not the text is
+    int eol = (r == doc->numrows && s[len - 1] != '\n');
+    undoRecord(&doc->undo, UNDO_INSERT, r, c, s, len, eol);
+    doc->undo.suspended++;
+
+    int k = 0; // Newlines in the text
+    for (const char *p = s; (p = memchr(p, '\n', s + len - p)) != NULL; p++)
+        k++;
+    int lastlen = 0; // Length of the text after the last newline
+    while (lastlen < len && s[len - 1 - lastlen] != '\n')
+        lastlen++;
+
+    int from, to;
+    if (r == doc->numrows || (c == 0 && k && lastlen == 0))
     {
-        indent[i] = row->chars[i];
-        i++;
+        // Whole lines before row r, or past the end: no existing row changes
+        int n = k + (lastlen > 0);
+        int before = (r > 0) ? doc->row[r - 1].hl_open_comment : 0;
+        erow *rows = openRows(doc, r, n);
+        const char *p = s;
+        for (int j = 0; j < n; j++)
+        {
+            const char *nl = memchr(p, '\n', s + len - p);
+            int l = nl ? nl - p : s + len - p;
+            rows[j].size = l;
+            rows[j].chars = malloc(l + 1);
+            memcpy(rows[j].chars, p, l);
+            rows[j].chars[l] = '\0';
+            renderRowText(&rows[j]);
+            p += l + 1;
+        }
+        rows[n - 1].hl_open_comment = before;
+        from = r;
+        to = r + n;
     }
-
-    if (E.cx == offset)
+    else if (k == 0)
     {
-        insertRow(E.cy, "", 0);
+        // Within row r
+        erow *row = &doc->row[r];
+        row->chars = realloc(row->chars, row->size + len + 1);
+        memmove(&row->chars[c + len], &row->chars[c], row->size - c + 1);
+        memcpy(&row->chars[c], s, len);
+        row->size += len;
+        renderRowText(row);
+        from = r;
+        to = r + 1;
     }
     else
     {
-        realloc(indent, row->size - E.cx + offset + i);
-        memcpy(indent + i, &row->chars[E.cx - offset], row->size - E.cx + offset);
-        insertRow(E.cy + 1, indent, row->size - E.cx + offset + i);
-        row = &E.row[E.cy];
-        row->size = E.cx - offset;
+        // Row r is split at c: its head takes the first line, the last line takes its tail
+        int state = doc->row[r].hl_open_comment;
+        erow *rows = openRows(doc, r + 1, k);
+        erow *row = &doc->row[r];
+        int taillen = row->size - c;
+        const char *first = memchr(s, '\n', len);
+        const char *p = first + 1;
+        for (int j = 0; j < k; j++)
+        {
+            const char *nl = (j < k - 1) ? memchr(p, '\n', s + len - p) : NULL;
+            int l = nl ? nl - p : lastlen;
+            int extra = (j == k - 1) ? taillen : 0;
+            rows[j].size = l + extra;
+            rows[j].chars = malloc(l + extra + 1);
+            memcpy(rows[j].chars, p, l);
+            memcpy(&rows[j].chars[l], &row->chars[c], extra);
+            rows[j].chars[l + extra] = '\0';
+            renderRowText(&rows[j]);
+            p += l + 1;
+        }
+        rows[k - 1].hl_open_comment = state;
+
+        int headlen = first - s;
+        row->chars = realloc(row->chars, c + headlen + 1);
+        memcpy(&row->chars[c], s, headlen);
+        row->size = c + headlen;
         row->chars[row->size] = '\0';
-        renderRow(row);
+        renderRowText(row);
+        from = r;
+        to = r + k + 1;
     }
-    E.cy++;
-    E.cx = offset + i;
+    renderRows(doc, from, to);
+
+    doc->undo.suspended--;
+    doc->dirty++;
 }
 
-void deleteChar(void)
+void deleteRange(struct document *doc, int r0, int c0, int r1, int c1)
 {
-    // Delete char at cursor
-    int offset = log10(E.numrows) + 2; // Offset for line numbers
-    if (E.cy == E.numrows)
+    // Delete the text from (r0, c0) up to (r1, c1). The rows it covers are freed in one
+    // sweep, the rest moved up once and only the row they join at is rendered again.
+    if (r0 < 0 || r0 >= doc->numrows)
         return;
-    if (E.cx == offset && E.cy == 0)
+    if (r1 >= doc->numrows)
+    {
+        if (c0 == 0)
+            r1 = doc->numrows, c1 = 0; // Whole rows up to the end
+        else
+            r1 = doc->numrows - 1, c1 = doc->row[r1].size;
+    }
+    if (c0 > doc->row[r0].size)
+        c0 = doc->row[r0].size;
+    if (r1 < doc->numrows && c1 > doc->row[r1].size)
+        c1 = doc->row[r1].size;
+    if (r1 < r0 || (r1 == r0 && c1 <= c0))
         return;
-    erow *row = &E.row[E.cy];
-    if (E.cx > offset)
+
+    if (!doc->undo.suspended)
     {
-        rowDeleteChar(row, E.cx - 1 - offset);
-        E.cx--;
+        long len;
+        char *text = rangeToString(doc, r0, c0, r1, c1, &len);
+        undoRecord(&doc->undo, UNDO_DELETE, r0, c0, text, len, 0);
+        free(text);
+    }
+
+    if (r0 == r1)
+    {
+        erow *row = &doc->row[r0];
+        memmove(&row->chars[c0], &row->chars[c1], row->size - c1 + 1);
+        row->size -= c1 - c0;
+        renderRowText(row);
+        renderRows(doc, r0, r0 + 1);
+        doc->dirty++;
+        return;
+    }
+
+    int at = r0 + 1; // First row to free
+    if (r1 == doc->numrows)
+    {
+        at = r0;
     }
     else
     {
-        E.cx = E.row[E.cy - 1].size + offset; // Move to end of previous line
-        rowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        deleteRow(E.cy);
-        E.cy--;
+        // Row r0 keeps its head and takes the tail of row r1, and with it the
+        // comment state the row after r1 was highlighted with
+        erow *head = &doc->row[r0];
+        erow *tail = &doc->row[r1];
+        int taillen = tail->size - c1;
+        head->chars = realloc(head->chars, c0 + taillen + 1);
+        memcpy(&head->chars[c0], &tail->chars[c1], taillen);
+        head->size = c0 + taillen;
+        head->chars[head->size] = '\0';
+        head->hl_open_comment = tail->hl_open_comment;
+    }
+    int n = r1 - at + (r1 == doc->numrows ? 0 : 1);
+    for (int j = at; j < at + n; j++)
+        freeRow(&doc->row[j]);
+    memmove(&doc->row[at], &doc->row[at + n], sizeof(erow) * (doc->numrows - at - n));
+    doc->numrows -= n;
+    for (int j = at; j < doc->numrows; j++)
+        doc->row[j].index -= n;
+    indexRowsDeleted(doc, at, n);
+    trigramRowsDeleted(&doc->trigrams, at, n);
+
+    if (at == r0 + 1)
+    {
+        renderRowText(&doc->row[r0]);
+        renderRows(doc, r0, r0 + 1);
     }
+    doc->dirty++;
 }
 
-void delCurRow(void)
+void recordRewrite(struct document *doc, int at, const char *old, int oldsize)
 {
-    deleteRow(E.cy);
+    // Log a row rewritten in place as a delete and an insert of the span that changed
+    if (doc->undo.suspended)
+        return;
+    erow *row = &doc->row[at];
+    int pre = 0;
+    while (pre < oldsize && pre < row->size && old[pre] == row->chars[pre])
+        pre++;
+    int post = 0;
+    while (post < oldsize - pre && post < row->size - pre &&
+           old[oldsize - 1 - post] == row->chars[row->size - 1 - post])
+        post++;
+    undoSeal(&doc->undo);
+    undoRecord(&doc->undo, UNDO_DELETE, at, pre, &old[pre], oldsize - pre - post, 0);
+    undoRecord(&doc->undo, UNDO_INSERT, at, pre, &row->chars[pre], row->size - pre - post, 0);
+    undoSeal(&doc->undo);
 }
 
-void paste(void)
+/* UNDO */
+
+void textEnd(int row, int col, const char *s, long len, int *end_row, int *end_col)
 {
+    // Position just past text s when it starts at (row, col)
+    *end_row = row;
+    *end_col = col;
+    for (long i = 0; i < len; i++)
+    {
+        if (s[i] == '\n')
+        {
+            (*end_row)++;
+            *end_col = 0;
+        }
+        else
+            (*end_col)++;
+    }
+}
+
+void applyUndoOp(struct document *doc, struct undoOp *op, int forward)
+{
+    // Replay an op, or its inverse when undoing. Recording is suspended, so the op
+    // replayed is journaled here.
+    char *text = undoText(&doc->undo, op);
+    int insert = (op->type == UNDO_INSERT) == forward;
+    if (doc->undo.journal)
+        journalAppend(doc->undo.journal, insert ? UNDO_INSERT : UNDO_DELETE, op->row, op->col, text, op->len, 0);
+    if (insert)
+    {
+        insertText(doc, op->row, op->col, text, op->len);
+    }
+    else
+    {
+        int end_row, end_col;
+        textEnd(op->row, op->col, text, op->len, &end_row, &end_col);
+        deleteRange(doc, op->row, op->col, end_row, end_col);
+    }
+    free(text);
+}
+
+int docUndo(struct document *doc, int *row, int *col)
+{
+    // Undo the last group of edits, returns -1 if there is none. (row, col) is set to
+    // where the cursor was before them.
+    struct undoLog *log = &doc->undo;
+    if (log->done == 0)
+        return -1;
+    unsigned int group = log->ops[log->done - 1].group;
+    log->suspended++;
+    while (log->done > 0 && log->ops[log->done - 1].group == group)
+        applyUndoOp(doc, &log->ops[--log->done], 0);
+    log->suspended--;
+    undoSeal(log);
+    *row = log->ops[log->done].cur_row;
+    *col = log->ops[log->done].cur_col;
+    return 0;
+}
+
+int docRedo(struct document *doc, int *row, int *col)
+{
+    // Redo the next undone group of edits, returns -1 if there is none. (row, col) is
+    // set to just after the last of them.
+    struct undoLog *log = &doc->undo;
+    if (log->done == log->count)
+        return -1;
+    unsigned int group = log->ops[log->done].group;
+    struct undoOp *op = NULL;
+    log->suspended++;
+    while (log->done < log->count && log->ops[log->done].group == group)
+    {
+        op = &log->ops[log->done++];
+        applyUndoOp(doc, op, 1);
+    }
+    log->suspended--;
+    undoSeal(log);
+
+    *row = op->row;
+    *col = op->col;
+    if (op->type == UNDO_INSERT)
+    {
+        char *text = undoText(log, op);
+        textEnd(op->row, op->col, text, op->len, row, col);
+        free(text);
+    }
+    return 0;
 }
 
 /* I/O */
 
-void *rowsToString(int *buflen)
+void *rowsToString(struct document *doc, int *buflen)
 {
     // Convert all rows to a single string for saving
     int totlen = 0;
     int j;
-    for (j = 0; j < E.numrows; j++)
-        totlen += E.row[j].size + 1;
+    for (j = 0; j < doc->numrows; j++)
+        totlen += doc->row[j].size + 1;
     *buflen = totlen;
     char *buf = malloc(totlen);
     char *p = buf;
-    for (j = 0; j < E.numrows; j++)
+    for (j = 0; j < doc->numrows; j++)
     {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
+        memcpy(p, doc->row[j].chars, doc->row[j].size);
+        p += doc->row[j].size;
         *p = '\n';
         p++;
     }
     return buf;
 }
 
-void eopen(char *filename)
+void docInit(struct document *doc)
 {
-    // Open a file and read its contents into memory
-    free(E.filename);
-    E.filename = strdup(filename);
-
-    selectSyntax();
+    // Start an empty unnamed document
+    doc->row = NULL;
+    doc->numrows = 0;
+    doc->dirty = 0;
+    doc->filename = NULL;
+    doc->syntax = NULL;
+    doc->search.query = NULL;
+    doc->search.levels = NULL;
+    doc->search.depth = 0;
+    doc->matches.q.needle = NULL;
+    doc->matches.matches = NULL;
+    doc->matches.count = 0;
+    doc->matches.cap = 0;
+    doc->matches.complete = 0;
+    doc->matches.current = -1;
+    doc->trigrams.postings = NULL;
+    doc->trigrams.blockrows = NULL;
+    doc->trigrams.blockstart = NULL;
+    doc->trigrams.rows = 0;
+    doc->trigrams.building = 0;
+    undoInit(&doc->undo, UNDO_LIMIT * 1048576L);
+    journalInit(&doc->journal);
+    doc->hl_deferred = 0;
+    doc->hl_clock = NULL;
+    doc->disk_size = doc->disk_mtime = doc->disk_ino = -1;
+}
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp)
-        die("fopen");
+void docClear(struct document *doc)
+{
+    // Drop the text and everything kept about it, leaving an empty unnamed document
+    docJournalClose(doc, 0);
+    for (int j = 0; j < doc->numrows; j++)
+        freeRow(&doc->row[j]);
+    free(doc->row);
+    doc->row = NULL;
+    doc->numrows = 0;
+    free(doc->filename);
+    doc->filename = NULL;
+    doc->syntax = NULL;
+    doc->dirty = 0;
+    clearMatchIndex(doc);
+    clearSearchCache(doc);
+    trigramFree(&doc->trigrams);
+    undoClear(&doc->undo);
+    doc->disk_size = doc->disk_mtime = doc->disk_ino = -1;
+}
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1)
-    { // Read file line by line and append to memory
-        while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                               line[linelen - 1] == '\r'))
-            linelen--;
-        insertRow(E.numrows, line, linelen);
+static char *readFile(int fd, const struct stat *st, long *size)
+{
+    // Map a regular file, or read anything else (a pipe, say) whole. Returns NULL for
+    // an empty one, MAP_FAILED with errno set if it could not be read.
+    *size = 0;
+    if (S_ISREG(st->st_mode))
+    {
+        *size = st->st_size;
+        return st->st_size ? mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
     }
+    char *data = NULL;
+    long cap = 0;
+    ssize_t n;
+    do
+    {
+        if (*size == cap)
+        {
+            cap = cap ? cap * 2 : 65536;
+            data = realloc(data, cap);
+        }
+        n = read(fd, &data[*size], cap - *size);
+        if (n > 0)
+            *size += n;
+    } while (n > 0 || (n == -1 && errno == EINTR));
+    if (n == -1)
+    {
+        free(data);
+        return MAP_FAILED;
+    }
+    return data;
+}
 
-    free(line);
-    fclose(fp);
-
-    E.cx = log10(E.numrows) + 2; // Set cursor to the start of the first line
-    E.dirty = 0;                 // Reset dirty flag
+static void splitRows(struct document *doc, const char *data, long size, uint32_t **lens)
+{
+    // Add a row for every line of data after the existing rows, the way every file is
+    // read: without the newline and carriage returns that end it. Each row is lexed
+    // once. If lens is not NULL it is set to the bytes each line took.
+    int n = 0;
+    for (const char *p = data; size && (p = memchr(p, '\n', data + size - p)) != NULL; p++)
+        n++;
+    if (size && data[size - 1] != '\n')
+        n++;
+    int at = doc->numrows;
+    erow *rows = openRows(doc, at, n);
+    if (lens)
+        *lens = malloc(sizeof(uint32_t) * (n + 1));
+    long pos = 0;
+    for (int j = 0; j < n; j++)
+    {
+        const char *nl = memchr(&data[pos], '\n', size - pos);
+        long end = nl ? nl - data : size;
+        long len = end;
+        while (len > pos && data[len - 1] == '\r')
+            len--;
+        rows[j].size = len - pos;
+        rows[j].chars = malloc(len - pos + 1);
+        memcpy(rows[j].chars, &data[pos], len - pos);
+        rows[j].chars[len - pos] = '\0';
+        renderRowText(&rows[j]);
+        long next = nl ? end + 1 : size;
+        if (lens)
+            (*lens)[j] = next - pos;
+        pos = next;
+    }
+    renderRows(doc, at, at + n);
 }
 
-void esave(void)
+int docOpen(struct document *doc, const char *filename)
 {
-    // Save the current text in memory to a file
-    if (E.filename == NULL)
+    // Read a file into the document after its current text, returns -1 (with errno
+    // set) if it could not be read. A large highlighted file read into an empty
+    // document gets a cache of its lines and the comment state each ends in, so the
+    // next time it is opened as it is now, rows are only lexed once they are shown.
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    long size = 0;
+    char *data = (fstat(fd, &st) == -1) ? MAP_FAILED : readFile(fd, &st, &size);
+    int err = errno;
+    close(fd);
+    if (data == MAP_FAILED)
     {
-        E.filename = askPrompt("Save as: %s (ESC to cancel)", NULL);
-        if (E.filename == NULL)
-        {
-            setStatusMessage("Save aborted");
-            return;
-        }
-        selectSyntax();
+        errno = err;
+        return -1;
+    }
+
+    free(doc->filename);
+    doc->filename = strdup(filename);
+    selectSyntax(doc);
+    trigramFree(&doc->trigrams);
+
+    doc->undo.suspended++; // Loading is not an edit
+    int cache = doc->syntax && doc->numrows == 0 && S_ISREG(st.st_mode) && size >= CACHE_MIN_BYTES;
+    uint64_t hash = cache ? cacheHash(data, size) : 0;
+    if (!cache || !docCacheLoad(doc, data, size, statMtime(&st), hash))
+    {
+        uint32_t *lens = NULL;
+        splitRows(doc, data, size, cache ? &lens : NULL);
+        if (cache)
+            docCacheStore(doc, lens, size, statMtime(&st), hash);
+        free(lens);
+    }
+    doc->undo.suspended--;
+    undoClear(&doc->undo);
+
+    if (S_ISREG(st.st_mode))
+    {
+        if (data)
+            munmap(data, size);
     }
+    else
+    {
+        free(data);
+    }
+    doc->dirty = 0; // Reset dirty flag
+    docStat(doc);
+    return 0;
+}
 
+int docSave(struct document *doc)
+{
+    // Write the text to the document's file, returns -1 (with errno set) if it was not saved
     int len;
-    char *buf = rowsToString(&len);
+    char *buf = rowsToString(doc, &len);
 
     int fd = open("qtedit_temp", O_RDWR | O_CREAT | O_TRUNC, 0644);
     if (fd != -1)
@@ -361,889 +796,879 @@ void esave(void)
         ssize_t res = write(fd, buf, len);
         if (res == len)
         {
-            if (rename("qtedit_temp", E.filename) != -1)
+            if (rename("qtedit_temp", doc->filename) != -1)
             {
                 close(fd);
+                doc->dirty = 0; // Reset dirty flag
+                docStat(doc);
+                docJournalReset(doc);
+                if (doc->syntax && !doc->hl_deferred && len >= CACHE_MIN_BYTES)
+                    docCacheStore(doc, NULL, len, doc->disk_mtime, cacheHash(buf, len)); // Opened again as saved
                 free(buf);
-                setStatusMessage("Saved to %s", E.filename);
-                E.dirty = 0; // Reset dirty flag
-                return;
+                return 0;
             }
         }
         close(fd);
     }
 
     free(buf);
-    setStatusMessage("Error saving to %s: %s", E.filename, strerror(errno));
+    return -1;
 }
 
-/* SEARCH */
-
-void search(char *query, int key)
+void docStat(struct document *doc)
 {
-    static int lm = -1;
-    static int dir = 1;
-
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
-
-    if (saved_hl)
-    {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
-    }
-
-    if (key == 'r' || key == '\x1b')
-    {
-        lm = -1;
-        dir = 1;
-        return;
-    }
-    else if (key == ARROW_RIGHT || key == ARROW_DOWN)
+    // Remember the file as it was read or written, so docChanged can tell when another
+    // program rewrote it. A writer that swaps in a new file changes the inode.
+    struct stat st;
+    if (doc->filename && stat(doc->filename, &st) == 0)
     {
-        dir = 1;
-    }
-    else if (key == ARROW_LEFT || key == ARROW_UP)
-    {
-        dir = -1;
+        doc->disk_size = st.st_size;
+        doc->disk_mtime = statMtime(&st);
+        doc->disk_ino = st.st_ino;
     }
     else
     {
-        lm = -1;
-        dir = 1;
+        doc->disk_size = doc->disk_mtime = doc->disk_ino = -1;
     }
+}
 
-    if (lm == -1)
-        dir = 1;
-    int cur = lm;
-    int i;
-    for (i = 0; i < E.numrows; i++)
-    {
-        cur += dir;
-        if (cur == -1)
-            cur = E.numrows - 1;
-        else if (cur == E.numrows)
-            cur = 0;
+int docChanged(struct document *doc)
+{
+    // Whether the file is not the one last read or written, 0 if it can't be looked at
+    struct stat st;
+    if (!doc->filename || doc->disk_size == -1 || stat(doc->filename, &st) == -1)
+        return 0;
+    return st.st_size != doc->disk_size || statMtime(&st) != doc->disk_mtime || (long long)st.st_ino != doc->disk_ino;
+}
 
-        erow *row = &E.row[cur];
-        char *match = strstr(row->render, query);
-        if (match)
-        {
-            lm = cur;
-            E.cy = cur;
-            E.cx = getCursorCx(row, match - row->render + strlen(query)) + log10(E.numrows) + 2;
-            E.rowoff = E.numrows;
-
-            saved_hl_line = cur;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
-        }
+static long stripReturns(char *out, const char *s, long len)
+{
+    // Copy lines without the carriage returns that end them, like every line read.
+    // Returns the length copied.
+    long n = 0;
+    for (long p = 0; p < len; p++)
+    {
+        long q = p;
+        while (q < len && s[q] == '\r')
+            q++;
+        if (q > p && (q == len || s[q] == '\n'))
+            p = q - 1; // Trailing ones only
+        else
+            out[n++] = s[p];
     }
+    return n;
 }
 
-void find(void)
+int docReload(struct document *doc, int *at, int *removed, int *added)
 {
-    int scy = E.cy; // Save current cursor position
-    int scx = E.cx;
-    int sco = E.coloff;
-    int sro = E.rowoff;
-
-    char *query = askPrompt(FIND_TEXT, search);
-
-    if (query)
+    // Bring the text up to date with its file after another program changed it. The
+    // rows that still match the file's first and last lines are kept as they are, with
+    // their highlighting and indexes, and only the rows between are replaced. That is
+    // one undo group, so the reload can be undone like an edit. Sets the rows replaced
+    // and returns 0, or -1 (with errno set) if the file could not be read.
+    *at = *removed = *added = 0;
+    int fd = open(doc->filename, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1)
     {
-        free(query);
+        close(fd);
+        return -1;
     }
-    else
+    long size = st.st_size;
+    char *data = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (data == MAP_FAILED)
+        return -1;
+
+    // Rows equal to the file's first lines, read the way docOpen reads them
+    int head = 0;
+    long pos = 0; // Start of the first line that differs
+    while (head < doc->numrows && pos < size)
     {
-        // If search was cancelled, restore cursor position
-        E.cy = scy;
-        E.cx = scx;
-        E.coloff = sco;
-        E.rowoff = sro;
+        const char *nl = memchr(&data[pos], '\n', size - pos);
+        long end = nl ? nl - data : size;
+        long len = end;
+        while (len > pos && data[len - 1] == '\r')
+            len--;
+        erow *row = &doc->row[head];
+        if (len - pos != row->size || memcmp(&data[pos], row->chars, row->size) != 0)
+            break;
+        head++;
+        pos = nl ? end + 1 : size;
     }
-}
 
-/* APPEND BUFFER */
+    // Rows equal to the file's last lines, stopping short of the ones above
+    int tail = 0;
+    long endpos = size; // Start of the lines after the ones that differ
+    while (head + tail < doc->numrows && endpos > pos)
+    {
+        long end = (endpos == size && data[size - 1] != '\n') ? size : endpos - 1;
+        long start = end;
+        while (start > pos && data[start - 1] != '\n')
+            start--;
+        long len = end;
+        while (len > start && data[len - 1] == '\r')
+            len--;
+        erow *row = &doc->row[doc->numrows - 1 - tail];
+        if (len - start != row->size || memcmp(&data[start], row->chars, row->size) != 0)
+            break;
+        tail++;
+        endpos = start;
+    }
 
-void abAppend(struct abuf *ab, const char *s, int len)
-{
-    // Append a string to the append buffer
-    char *new = realloc(ab->b, ab->len + len);
+    *at = head;
+    *removed = doc->numrows - head - tail;
+    for (long p = pos; p < endpos; p++)
+        *added += data[p] == '\n';
+    if (endpos > pos && data[endpos - 1] != '\n')
+        (*added)++;
 
-    if (new == NULL)
-        return;
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
-    ab->len += len;
+    if (*removed || endpos > pos)
+    {
+        char *text = malloc(endpos - pos + 2);
+        long len = stripReturns(text, &data[pos], endpos - pos);
+        if (endpos > pos && data[endpos - 1] != '\n')
+            text[len++] = '\n'; // Past the end, where a last line of only carriage returns is still a row
+
+        undoSeal(&doc->undo);
+        undoStartGroup(&doc->undo, head, 0);
+        if (*removed)
+            deleteRange(doc, head, 0, head + *removed, 0);
+        if (len)
+            insertText(doc, head, 0, text, len);
+        undoSeal(&doc->undo);
+        free(text);
+    }
+    if (data)
+        munmap(data, size);
+    doc->dirty = 0;
+    docStat(doc);
+    docJournalReset(doc);
+    return 0;
 }
 
-void abFree(struct abuf *ab)
+int docFollow(struct document *doc, int *added)
 {
-    // Free the memory allocated for the append buffer
-    free(ab->b);
-}
-
-/* TERMINAL */
+    // Read only what was appended to the file since it was last read, adding rows after
+    // the existing ones, which are not touched unless the last was a line still being
+    // written. Only the new rows are highlighted, and the appends are not undoable edits.
+    // Returns 0, 1 if the file did not just grow (it was truncated or replaced, see
+    // docReload), or -1 with errno set.
+    *added = 0;
+    int fd = open(doc->filename, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    if (doc->disk_size == -1 || (long long)st.st_ino != doc->disk_ino || st.st_size < doc->disk_size)
+    {
+        close(fd);
+        return 1;
+    }
 
-/** CONFIG **/
+    long long from = doc->disk_size;
+    long len = st.st_size - from;
+    char last = '\n'; // Byte that ended the text read before
+    if (from > 0 && pread(fd, &last, 1, from - 1) != 1)
+        last = '\n';
+    char *buf = malloc(len + 2);
+    long got = 0;
+    while (got < len)
+    {
+        ssize_t n = pread(fd, &buf[got], len - got, from + got);
+        if (n <= 0)
+            break; // Read up to here, the rest is picked up next time
+        got += n;
+    }
+    close(fd);
+    while (got > 0 && buf[got - 1] == '\r')
+        got--; // Left for next time, they only end the line if a newline follows
 
-void die(char *s)
-{
-    resetScreen();
-    perror(s);
-    exit(1);
-}
+    doc->undo.suspended++;
+    long p = 0;
+    if (last != '\n' && doc->numrows > 0 && got > 0)
+    {
+        // The last row's line was still being written, its rest comes first
+        const char *nl = memchr(buf, '\n', got);
+        long l = nl ? nl - buf : got;
+        char *rest = malloc(l + 1);
+        long rlen = stripReturns(rest, buf, l);
+        erow *row = &doc->row[doc->numrows - 1];
+        insertText(doc, doc->numrows - 1, row->size, rest, rlen);
+        free(rest);
+        p = nl ? l + 1 : got;
+    }
+    if (p < got)
+    {
+        int before = doc->numrows;
+        char *text = malloc(got - p + 1);
+        long tlen = stripReturns(text, &buf[p], got - p);
+        insertText(doc, doc->numrows, 0, text, tlen);
+        free(text);
+        *added = doc->numrows - before;
+    }
+    doc->undo.suspended--;
+    free(buf);
 
-void resetScreen(void)
-{
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
+    doc->dirty = 0;
+    doc->disk_size = from + got;
+    doc->disk_mtime = statMtime(&st);
+    docJournalReset(doc);
+    return 0;
 }
 
-void disableRawMode(void)
-{
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
-        die("tcsetattr");
-}
+/* SEARCH */
 
-void enableRawMode(void)
+struct scanJob
 {
-    if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1)
-        die("tcgetattr");
-    atexit(disableRawMode);
-
-    struct termios raw = E.orig_termios;
-    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-    raw.c_oflag &= ~(OPOST);
-    raw.c_cflag |= (CS8);
-    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-    raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
-
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
-        die("tcsetattr");
-}
-
-/** INPUT **/
-
-int readKey(void)
+    struct document *doc;
+    struct searchQuery *q;
+    struct searchLevel *from;    // Candidates to re-check, NULL to scan whole rows
+    int *rows;                   // Rows to scan when there are no candidates, NULL for all
+    int nrows;
+    int nparts;
+    struct searchMatch **out;    // Matches found by each part, in order
+    int *count;
+    int *overflow;               // Set by parts that found more than SEARCH_CACHE_MAX
+};
+
+void scanPart(void *arg, int part)
 {
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
-    {
-        int or = E.screenrows;
-        int oc = E.screencols;
-        getWindowSize(&E.screenrows, &E.screencols);
-        E.screenrows -= 2;
-        if (or != E.screenrows || oc != E.screencols)
-        {
-            return SKIP_KEY;
-        }
-
-        if (nread == -1 && errno != EAGAIN)
-            die("read");
-    }
-
-    if (c == '\x1b') // Escape sequence
+    // Collect the matches of one slice of the rows (or of the candidates to re-check)
+    struct scanJob *job = arg;
+    struct document *doc = job->doc;
+    int total = job->from ? job->from->count : job->rows ? job->nrows : doc->numrows;
+    int lo = (long)total * part / job->nparts;
+    int hi = (long)total * (part + 1) / job->nparts;
+    int cap = 0;
+    struct searchMatch *out = NULL;
+    int n = 0;
+
+    struct searchQuery q = *job->q; // Regex DFA caches can't be shared between threads
+    if (q.re)
+        q.re = cloneRegex(job->q->re);
+
+    for (int i = lo; i < hi; i++)
     {
-        char seq[3];
-
-        if (read(STDIN_FILENO, &seq[0], 1) != 1)
-            return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1)
-            return '\x1b';
-
-        if (seq[0] == '[') // Starts with '['
+        int r = job->from ? job->from->matches[i].row : job->rows ? job->rows[i] : i;
+        erow *row = &doc->row[r];
+        int mlen = q.len;
+        int at = job->from ? job->from->matches[i].col : findMatch(&q, row->chars, row->size, 0, &mlen);
+        while (at != -1)
         {
-            if (seq[1] >= '0' && seq[1] <= '9') // Possibly 3+ long sequences
+            if (!job->from || matchAt(&q, row->chars, row->size, at))
             {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1)
-                    return '\x1b';
-
-                if (seq[2] == '~') // Ends with '~'
-                {
-                    switch (seq[1])
-                    {
-                    case '1':
-                        return HOME_KEY;
-                    case '3':
-                        return DELETE_KEY;
-                    case '4':
-                        return END_KEY;
-                    case '5':
-                        return PAGE_UP;
-                    case '6':
-                        return PAGE_DOWN;
-                    case '7':
-                        return HOME_KEY;
-                    case '8':
-                        return END_KEY;
-                    }
-                }
-                else if (seq[1] == '1' && seq[2] == ';') // Extended sequences like ESC[1;2A
+                if (n == SEARCH_CACHE_MAX)
                 {
-                    char modifier;
-                    char direction;
-                    if (read(STDIN_FILENO, &modifier, 1) != 1)
-                        return '\x1b';
-                    if (read(STDIN_FILENO, &direction, 1) != 1)
-                        return '\x1b';
-
-                    // Check for Shift modifier (2) and handle direction
-                    if (modifier == '2') // Shift modifier
-                    {
-                        switch (direction)
-                        {
-                        case 'A':
-                            return SHIFT_ARROW_UP;
-                        case 'B':
-                            return SHIFT_ARROW_DOWN;
-                        case 'C':
-                            return SHIFT_ARROW_RIGHT;
-                        case 'D':
-                            return SHIFT_ARROW_LEFT;
-                        default:
-                            return '\x1b';
-                        }
-                    }
-                    else // Other modifiers - just handle as normal arrows
-                    {
-                        switch (direction)
-                        {
-                        case 'A':
-                            return ARROW_UP;
-                        case 'B':
-                            return ARROW_DOWN;
-                        case 'C':
-                            return ARROW_RIGHT;
-                        case 'D':
-                            return ARROW_LEFT;
-                        default:
-                            return '\x1b';
-                        }
-                    }
+                    job->overflow[part] = 1;
+                    i = hi;
+                    break;
                 }
-            }
-            else // 2 long sequences
-            {
-                switch (seq[1])
+                if (n == cap)
                 {
-                case 'A':
-                    return ARROW_UP;
-                case 'B':
-                    return ARROW_DOWN;
-                case 'C':
-                    return ARROW_RIGHT;
-                case 'D':
-                    return ARROW_LEFT;
-                case 'H':
-                    return HOME_KEY;
-                case 'F':
-                    return END_KEY;
+                    cap = cap ? cap * 2 : 64;
+                    out = realloc(out, sizeof(struct searchMatch) * cap);
                 }
+                out[n].row = r;
+                out[n].col = at;
+                out[n].len = mlen;
+                n++;
             }
+            at = job->from ? -1 : findMatch(&q, row->chars, row->size, nextMatchFrom(&q, at, mlen), &mlen);
         }
-        else if (seq[0] == 'O') // Starts with 'O'
-        {
-            switch (seq[1])
-            {
-            case 'H':
-                return HOME_KEY;
-            case 'F':
-                return END_KEY;
-            }
-        }
-        return '\x1b';
     }
 
-    return c;
+    if (q.re)
+        freeRegex(q.re);
+    job->out[part] = out;
+    job->count[part] = n;
 }
 
-int getCursorPosition(int *rows, int *cols)
+int *candidateRows(struct document *doc, struct searchQuery *q, int *nrows)
 {
-    // This function sends an escape sequence to the terminal to request the cursor position
-    // and reads the response to determine the current cursor position.
-    // The response is expected to be in the format: ESC [ rows ; cols R
-    char buf[32];
-    unsigned int i = 0;
-
-    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
-        return -1;
-
-    while (i < sizeof(buf) - 1)
+    // Rows the trigram index can't rule out for a query, plus any not indexed yet.
+    // Returns NULL if the query has no literal long enough to look up.
+    const char *lit = q->needle;
+    int len = q->len;
+    if (q->re)
     {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1)
-            break;
-        if (buf[i] == 'R')
-            break;
-        i++;
+        lit = q->re->prefix.needle;
+        len = q->re->prefix.len;
     }
-    buf[i] = '\0';
 
-    if (buf[0] != '\x1b' || buf[1] != '[')
-        return -1;
+    uint32_t *blocks;
+    int n = trigramCandidates(&doc->trigrams, lit, len, &blocks);
+    if (n == -1)
+        return NULL;
 
-    if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
-        return -1;
+    int total = doc->numrows - doc->trigrams.rows;
+    for (int i = 0; i < n; i++)
+        total += doc->trigrams.blockrows[blocks[i]];
+    int *rows = malloc(sizeof(int) * (total + 1));
+
+    *nrows = 0;
+    int b = 0;
+    int start = 0; // First row of block b
+    for (int i = 0; i < n; i++)
+    {
+        while (b < (int)blocks[i])
+            start += doc->trigrams.blockrows[b++];
+        for (int r = 0; r < doc->trigrams.blockrows[b]; r++)
+            rows[(*nrows)++] = start + r;
+    }
+    for (int r = doc->trigrams.rows; r < doc->numrows; r++)
+        rows[(*nrows)++] = r;
 
-    return -0;
+    free(blocks);
+    return rows;
 }
 
-int getWindowSize(int *rows, int *cols)
+int collectMatches(struct document *doc, struct searchQuery *q, struct searchLevel *from, struct searchMatch **matches, int *count)
 {
-    struct winsize ws;
+    // Find all matches of a query, spread over the worker pool for large files.
+    // Returns 0 (and no matches) if there are more than SEARCH_CACHE_MAX.
+    struct scanJob job;
+    job.rows = from ? NULL : candidateRows(doc, q, &job.nrows);
+
+    int total = from ? from->count : job.rows ? job.nrows : doc->numrows;
+    int nparts = (total < SEARCH_PARALLEL_MIN) ? 1 : poolSize() * 4;
+
+    job.doc = doc;
+    job.q = q;
+    job.from = from;
+    job.nparts = nparts;
+    job.out = calloc(nparts, sizeof(struct searchMatch *));
+    job.count = calloc(nparts, sizeof(int));
+    job.overflow = calloc(nparts, sizeof(int));
+    if (nparts == 1)
+        scanPart(&job, 0);
+    else
+        poolRun(scanPart, &job, nparts);
 
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+    // Parts cover consecutive slices, so concatenating them keeps matches sorted
+    long n = 0;
+    int complete = 1;
+    for (int i = 0; i < nparts; i++)
     {
-        // If ioctl fails, fallback to using escape sequences
-        if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
-            return -1;
-        return getCursorPosition(rows, cols);
+        n += job.count[i];
+        if (job.overflow[i])
+            complete = 0;
     }
-    *rows = ws.ws_row;
-    *cols = ws.ws_col;
+    if (n > SEARCH_CACHE_MAX)
+        complete = 0;
 
-    return 0;
+    *matches = NULL;
+    *count = 0;
+    if (complete && n > 0)
+    {
+        *matches = malloc(sizeof(struct searchMatch) * n);
+        for (int i = 0; i < nparts; i++)
+        {
+            memcpy(&(*matches)[*count], job.out[i], sizeof(struct searchMatch) * job.count[i]);
+            *count += job.count[i];
+        }
+    }
+
+    for (int i = 0; i < nparts; i++)
+        free(job.out[i]);
+    free(job.out);
+    free(job.count);
+    free(job.overflow);
+    free(job.rows);
+    return complete;
 }
 
-char *askPrompt(char *prompt, void (*callback)(char *, int))
+void clearSearchCache(struct document *doc)
 {
-    size_t bufsize = 128;
-    char *buf = malloc(bufsize);
+    // Drop every cached candidate level
+    for (int i = 0; i < doc->search.depth; i++)
+        free(doc->search.levels[i].matches);
+    free(doc->search.levels);
+    free(doc->search.query);
+    doc->search.levels = NULL;
+    doc->search.query = NULL;
+    doc->search.depth = 0;
+}
 
-    size_t buflen = 0;
-    buf[0] = '\0';
+void buildSearchLevel(struct document *doc, struct searchLevel *lv, char *query, int qlen, int flags,
+                      struct searchLevel *from)
+{
+    // Find every candidate of a query prefix, only re-checking the previous level's
+    // candidates when there is one. Whole-word checks are left to the match index,
+    // since a longer query can match where a shorter one failed the word test.
+    char *prefix = strndup(query, qlen);
+    struct searchQuery q;
+    compileQuery(&q, prefix, flags & ~(SEARCH_WORD | SEARCH_REGEX));
+    free(prefix);
+
+    lv->qlen = qlen;
+    lv->complete = collectMatches(doc, &q, (from && from->complete) ? from : NULL, &lv->matches, &lv->count);
+
+    freeQuery(&q);
+}
 
-    while (1)
+struct searchLevel *syncSearchCache(struct document *doc, char *query, int flags)
+{
+    // Bring the candidate stack in line with the query: keep levels for the common
+    // prefix with the last query (so backspace is a pop) and narrow from there
+    int qlen = strlen(query);
+    int keep = 0;
+    if (doc->search.query && doc->search.flags == flags)
+        while (keep < qlen && doc->search.query[keep] == query[keep])
+            keep++;
+
+    while (doc->search.depth > 0 && doc->search.levels[doc->search.depth - 1].qlen > keep)
+        free(doc->search.levels[--doc->search.depth].matches);
+
+    free(doc->search.query);
+    doc->search.query = strdup(query);
+    doc->search.flags = flags;
+
+    if (qlen == 0)
+        return NULL;
+
+    struct searchLevel *top = doc->search.depth ? &doc->search.levels[doc->search.depth - 1] : NULL;
+    if (!top || top->qlen < qlen)
     {
-        setStatusMessage(prompt, buf);
-        refreshScreen();
+        doc->search.levels = realloc(doc->search.levels, sizeof(struct searchLevel) * (doc->search.depth + 1));
+        top = doc->search.depth ? &doc->search.levels[doc->search.depth - 1] : NULL;
+        buildSearchLevel(doc, &doc->search.levels[doc->search.depth], query, qlen, flags, top);
+        doc->search.depth++;
+    }
+    return &doc->search.levels[doc->search.depth - 1];
+}
 
-        int c = readKey();
-        if (c == DELETE_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
-        {
-            if (buflen != 0)
-                buf[--buflen] = '\0';
-        }
-        else if (c == '\x1b')
-        {
-            setStatusMessage("");
-            if (callback)
-                callback(buf, c);
-            free(buf);
-            return NULL;
-        }
-        else if (c == '\r')
-        { // Enter key
-            if (buflen > 0)
-            {
-                setStatusMessage("");
-                if (callback)
-                    callback(buf, c);
-                return buf;
-            }
-        }
-        else if (!iscntrl(c) && c < 128)
-        {
-            if (buflen == bufsize - 1)
-            {
-                bufsize *= 2;
-                buf = realloc(buf, bufsize);
-            }
-            buf[buflen++] = c;
-            buf[buflen] = '\0';
-        }
+/** MATCH INDEX **/
+
+void clearMatchIndex(struct document *doc)
+{
+    // Forget the indexed query and its matches
+    if (doc->matches.q.needle)
+        freeQuery(&doc->matches.q);
+    free(doc->matches.matches);
+    doc->matches.matches = NULL;
+    doc->matches.count = 0;
+    doc->matches.cap = 0;
+    doc->matches.complete = 0;
+    doc->matches.current = -1;
+}
+
+void buildMatchIndex(struct document *doc, char *query, int flags, struct searchLevel *lv)
+{
+    // Index every match of the full query, reusing the narrowed candidates when
+    // they were all kept and only applying the whole-word test on top of them
+    clearMatchIndex(doc);
+    if (query[0] == '\0')
+        return;
+    if (compileQuery(&doc->matches.q, query, flags) == -1)
+    {
+        doc->matches.complete = 1; // A regex that does not compile matches nothing
+        return;
+    }
+
+    if (lv == NULL || !lv->complete)
+    {
+        doc->matches.complete = collectMatches(doc, &doc->matches.q, NULL, &doc->matches.matches, &doc->matches.count);
+    }
+    else if (flags & SEARCH_WORD)
+    {
+        doc->matches.complete = collectMatches(doc, &doc->matches.q, lv, &doc->matches.matches, &doc->matches.count);
+    }
+    else
+    {
+        doc->matches.complete = 1;
+        doc->matches.count = lv->count;
+        doc->matches.matches = malloc(sizeof(struct searchMatch) * (lv->count + 1));
+        memcpy(doc->matches.matches, lv->matches, sizeof(struct searchMatch) * lv->count);
+    }
+    doc->matches.cap = doc->matches.count;
+}
 
-        if (callback)
-            callback(buf, c);
+int matchLowerBound(struct document *doc, int row, int col)
+{
+    // Index of the first match at or after (row, col)
+    int lo = 0, hi = doc->matches.count;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        struct searchMatch *m = &doc->matches.matches[mid];
+        if (m->row < row || (m->row == row && m->col < col))
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    return lo;
 }
 
-void gotoLine(void)
+void indexRowChanged(struct document *doc, int at)
 {
-    // Function to go to a specific line in the text
-    int line = 0;
-    char *line_str = askPrompt("Goto line: %s (ESC to cancel)", NULL);
-    if (line_str)
+    // Re-scan one edited row and splice its matches into the index
+    if (!doc->matches.complete)
+        return;
+
+    int lo = matchLowerBound(doc, at, 0);
+    int hi = matchLowerBound(doc, at + 1, 0);
+
+    erow *row = &doc->row[at];
+    int n = 0;
+    int mlen;
+    for (int c = findMatch(&doc->matches.q, row->chars, row->size, 0, &mlen); c != -1;
+         c = findMatch(&doc->matches.q, row->chars, row->size, nextMatchFrom(&doc->matches.q, c, mlen), &mlen))
+        n++;
+
+    int count = doc->matches.count - (hi - lo) + n;
+    if (count > SEARCH_CACHE_MAX)
+    {
+        clearMatchIndex(doc);
+        return;
+    }
+    if (count > doc->matches.cap)
     {
-        line = atoi(line_str);
-        free(line_str);
+        doc->matches.cap = count * 2;
+        doc->matches.matches = realloc(doc->matches.matches, sizeof(struct searchMatch) * doc->matches.cap);
     }
-
-    if (line > 0 && line <= E.numrows)
+    memmove(&doc->matches.matches[lo + n], &doc->matches.matches[hi],
+            sizeof(struct searchMatch) * (doc->matches.count - hi));
+    n = lo;
+    for (int c = findMatch(&doc->matches.q, row->chars, row->size, 0, &mlen); c != -1;
+         c = findMatch(&doc->matches.q, row->chars, row->size, nextMatchFrom(&doc->matches.q, c, mlen), &mlen))
     {
-        E.cy = line - 1;
-        E.cx = log10(E.numrows) + 2;
-        scroll();
+        doc->matches.matches[n].row = at;
+        doc->matches.matches[n].col = c;
+        doc->matches.matches[n].len = mlen;
+        n++;
     }
+    doc->matches.count = count;
+    doc->matches.current = -1;
 }
 
-/** LOGIC **/
+void indexRowsShifted(struct document *doc, int at, int delta)
+{
+    // Renumber the matches of rows from at onwards after rows were inserted or deleted
+    if (!doc->matches.complete)
+        return;
+    for (int i = matchLowerBound(doc, at, 0); i < doc->matches.count; i++)
+        doc->matches.matches[i].row += delta;
+    doc->matches.current = -1;
+}
 
-void moveCursor(int key)
+void indexRowsDeleted(struct document *doc, int at, int n)
 {
-    int offset = log10(E.numrows) + 2; // Offset for line numbers
+    // Drop the matches of deleted rows and close the gap in the numbering
+    if (!doc->matches.complete)
+        return;
+    int lo = matchLowerBound(doc, at, 0);
+    int hi = matchLowerBound(doc, at + n, 0);
+    memmove(&doc->matches.matches[lo], &doc->matches.matches[hi],
+            sizeof(struct searchMatch) * (doc->matches.count - hi));
+    doc->matches.count -= hi - lo;
+    indexRowsShifted(doc, at + n, -n);
+}
 
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+/** REPLACE **/
 
-    switch (key)
+struct replaceJob
+{
+    struct document *doc;
+    struct searchQuery *q;
+    const char *with;      // Replacement text
+    int wlen;
+    int r0, c0;            // Replace matches starting at or after (r0, c0)
+    int r1, c1;            // and before (r1, c1)
+    int nparts;
+    char *changed;         // Set for every row of the range that was rewritten
+    char **old;            // Text those rows had before, for the undo log
+    int *oldsize;
+    long *count;           // Replacements made by each part
+};
+
+int rewriteRow(struct searchQuery *q, erow *row, int lo, int hi, const char *with, int wlen, char **old)
+{
+    // Replace the matches starting in columns [lo, hi) of a row, building its new text
+    // in one pass. Only the text and render are updated, highlighting is up to the caller.
+    // The old text is handed back through old if it is set, else freed.
+    // Returns how many matches were replaced.
+    int n = 0;
+    int size = 0;
+    int cap = 0;
+    char *chars = NULL;
+    int copied = 0; // Columns of the old text already carried over
+    int mlen;
+    int at = findMatch(q, row->chars, row->size, lo, &mlen);
+    while (at != -1 && at < hi)
     {
-    case ARROW_LEFT: // Move left
-        if (E.cx > offset)
-        {
-            E.cx--;
-        }
-        else if (E.cy > 0)
-        {
-            E.cy--;
-            E.cx = E.row[E.cy].size + offset;
-        }
-        break;
-    case ARROW_RIGHT: // Move right
-        if (row && E.cx < row->size + offset)
-        {
-            E.cx++;
-        }
-        else if (row && E.cx == row->size + offset)
+        int keep = at - copied;
+        int need = size + keep + wlen + (row->size - at - mlen) + 1;
+        if (need > cap)
         {
-            E.cy++;
-            E.cx = offset;
-            E.coloff = 0;
+            cap = (need > cap * 2) ? need : cap * 2;
+            chars = realloc(chars, cap);
         }
-        break;
-    case ARROW_DOWN: // Move down
-        if (E.cy < E.numrows)
-            E.cy++;
-        break;
-    case ARROW_UP: // Move up
-        if (E.cy > 0)
-            E.cy--;
-        break;
-    }
-
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-    int rowlen = row ? row->size : 0;
-    rowlen += offset;
-    if (E.cx > rowlen)
-        E.cx = rowlen;
-    if (E.cx < offset)
-        E.cx = offset;
-}
+        memcpy(&chars[size], &row->chars[copied], keep);
+        memcpy(&chars[size + keep], with, wlen);
+        size += keep + wlen;
+        copied = at + mlen;
+        n++;
+        at = findMatch(q, row->chars, row->size, copied, &mlen); // Matches don't overlap their replacement
+    }
+    if (n == 0)
+        return 0;
 
-void moveCursorWithSelection(int key)
-{
-    // Handle cursor movement with selection
-    if (!E.sel_active)
-    {
-        startSelection();
-    }
-
-    // Convert shift+arrow keys to regular arrow keys for movement
-    int movement_key;
-    switch (key)
-    {
-    case SHIFT_ARROW_LEFT:
-        movement_key = ARROW_LEFT;
-        break;
-    case SHIFT_ARROW_RIGHT:
-        movement_key = ARROW_RIGHT;
-        break;
-    case SHIFT_ARROW_UP:
-        movement_key = ARROW_UP;
-        break;
-    case SHIFT_ARROW_DOWN:
-        movement_key = ARROW_DOWN;
-        break;
-    default:
-        return; // Should not happen
-    }
-
-    moveCursor(movement_key);
-    updateSelection();
+    memcpy(&chars[size], &row->chars[copied], row->size - copied);
+    size += row->size - copied;
+    chars[size] = '\0';
+    if (old)
+        *old = row->chars;
+    else
+        free(row->chars);
+    row->chars = chars;
+    row->size = size;
+    renderRowText(row);
+    return n;
 }
 
-void processKeypress(void)
+void replacePart(void *arg, int part)
 {
-    static int quit_count = QUIT_PROT; // Counter for quitting when dirty
-
-    int c = readKey();
-
-    int offset = log10(E.numrows) + 2; // Offset for line numbers
-
-    switch (c)
+    // Rewrite one slice of the rows in the job's range
+    struct replaceJob *job = arg;
+    struct document *doc = job->doc;
+    int last = (job->r1 < doc->numrows) ? job->r1 : doc->numrows - 1;
+    int total = last - job->r0 + 1;
+    int lo = job->r0 + (long)total * part / job->nparts;
+    int hi = job->r0 + (long)total * (part + 1) / job->nparts;
+
+    struct searchQuery q = *job->q; // Regex DFA caches can't be shared between threads
+    if (q.re)
+        q.re = cloneRegex(job->q->re);
+
+    long count = 0;
+    for (int r = lo; r < hi; r++)
     {
-    case SKIP_KEY:
-        return;
+        int from = (r == job->r0) ? job->c0 : 0;
+        int to = (r == job->r1) ? job->c1 : INT_MAX;
+        job->oldsize[r - job->r0] = doc->row[r].size;
+        int n = rewriteRow(&q, &doc->row[r], from, to, job->with, job->wlen, &job->old[r - job->r0]);
+        job->changed[r - job->r0] = (n > 0);
+        count += n;
+    }
 
-    case '\r':
-        if (E.sel_active)
-        {
-            deleteSelection();
-        }
-        insertNewline();
-        break;
+    if (q.re)
+        freeRegex(q.re);
+    job->count[part] = count;
+}
 
-    case CTRL_KEY('x'): // Exit on Ctrl-X
-        if (E.dirty && --quit_count > 0)
-        {
-            setStatusMessage(QUIT_TEXT, quit_count, quit_count == 1 ? "" : "s");
-            return;
-        }
-        resetScreen();
-        exit(0);
-        break;
-
-    case CTRL_KEY('s'): // Save on Ctrl-S
-        esave();
-        break;
-
-    case CTRL_KEY('g'): // Goto line on Ctrl-G
-        gotoLine();
-        break;
-
-    case CTRL_KEY('h'): // Help on Ctrl-H
-        setStatusMessage(GUIDE_TEXT);
-        break;
-
-    case CTRL_KEY('k'):
-        delCurRow();
-        break;
-
-    case CTRL_KEY('c'): // Copy on Ctrl-C
-        copySelection();
-        break;
-
-    case CTRL_KEY('v'): // Paste on Ctrl-V
-        pasteFromClipboard();
-        break;
-
-    case HOME_KEY: // Return to start of line on HOME
-        E.cx = offset;
-        break;
-    case END_KEY: // Skip to end of line on END
-        if (E.cy < E.numrows)
-        {
-            E.cx = E.row[E.cy].size;
-        }
-        break;
+long replaceMatches(struct document *doc, struct searchQuery *q, const char *with, int r0, int c0, int r1, int c1)
+{
+    // Replace every match starting between (r0, c0) and (r1, c1) as one batch: the rows
+    // are rewritten across the worker pool, then each changed row is highlighted once.
+    // Returns how many matches were replaced.
+    int last = (r1 < doc->numrows) ? r1 : doc->numrows - 1;
+    if (r0 > last || q->needle == NULL || (q->len == 0 && q->re == NULL))
+        return 0;
 
-    case CTRL_KEY('f'): // Find on Ctrl-F
-        find();
-        break;
+    struct replaceJob job;
+    job.doc = doc;
+    job.q = q;
+    job.with = with;
+    job.wlen = strlen(with);
+    job.r0 = r0;
+    job.c0 = c0;
+    job.r1 = r1;
+    job.c1 = c1;
+    job.nparts = (last - r0 + 1 < SEARCH_PARALLEL_MIN) ? 1 : poolSize() * 4;
+    job.changed = calloc(last - r0 + 1, 1);
+    job.old = malloc(sizeof(char *) * (last - r0 + 1));
+    job.oldsize = malloc(sizeof(int) * (last - r0 + 1));
+    job.count = calloc(job.nparts, sizeof(long));
+    if (job.nparts == 1)
+        replacePart(&job, 0);
+    else
+        poolRun(replacePart, &job, job.nparts);
 
-    case BACKSPACE:
-    case DELETE_KEY:
-        if (E.sel_active)
-        {
-            deleteSelection();
-        }
-        else
-        {
-            if (c == DELETE_KEY)
-                moveCursor(ARROW_RIGHT); // Move right if DELETE is pressed
-            deleteChar();
-        }
-        break;
+    long count = 0;
+    for (int i = 0; i < job.nparts; i++)
+        count += job.count[i];
 
-    case PAGE_UP: // Go to top/bottom of file on PAGE_UP/PAGE_DOWN
-    case PAGE_DOWN:
+    // Highlight the rewritten rows in order, carrying on past them only while a comment
+    // state changes, so no row is lexed twice however many matches it had
+    int carry = 0;
+    for (int r = r0; r < doc->numrows && (r <= last || carry); r++)
     {
-        if (c == PAGE_UP)
-        {
-            E.cy = E.rowoff;
-        }
-        else
-        {
-            E.cy = E.rowoff + E.screenrows + 1;
-            if (E.cy > E.numrows)
-                E.cy = E.numrows;
-        }
-
-        int t = E.screenrows;
-        while (t--)
-            moveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-    }
-    break;
-
-    case ARROW_LEFT:      // Move left
-    case ARROW_RIGHT:     // Move right
-    case ARROW_DOWN:      // Move down
-    case ARROW_UP:        // Move up
-        clearSelection(); // Clear selection on normal movement
-        moveCursor(c);
-        break;
-
-    case SHIFT_ARROW_LEFT:  // Move left with selection
-    case SHIFT_ARROW_RIGHT: // Move right with selection
-    case SHIFT_ARROW_DOWN:  // Move down with selection
-    case SHIFT_ARROW_UP:    // Move up with selection
-        moveCursorWithSelection(c);
-        break;
-
-    case CTRL_KEY('l'):
-    case '\x1b':
-        break;
-
-    default:
-        if (iscntrl(c) || c >= 127)
-        {
-            break;
-        }
-        if (E.sel_active)
+        int changed = (r <= last && job.changed[r - r0]);
+        if (!changed && !carry)
+            continue;
+        carry = highlightRow(doc, &doc->row[r]);
+        if (changed)
         {
-            deleteSelection();
+            indexRowChanged(doc, r);
+            trigramRowChanged(&doc->trigrams, r, doc->row[r].chars, doc->row[r].size);
+            recordRewrite(doc, r, job.old[r - r0], job.oldsize[r - r0]);
+            free(job.old[r - r0]);
         }
-        insertChar(c); // Insert character
-        break;
     }
 
-    quit_count = QUIT_PROT; // Reset quit count after any keypress
+    free(job.changed);
+    free(job.old);
+    free(job.oldsize);
+    free(job.count);
+    if (count)
+        doc->dirty++;
+    return count;
 }
 
-/** OUTPUT **/
+/** PROJECT SEARCH **/
 
-void scroll(void)
+void grepPart(void *arg, int part)
 {
-    int offset = log10(E.numrows) + 2; // Offset for line numbers
+    // Search every nparts-th file of the batch
+    struct grepJob *job = arg;
+    struct searchQuery q = *job->q; // Regex DFA caches can't be shared between threads
+    if (q.re)
+        q.re = cloneRegex(job->q->re);
+    for (int i = part; i < job->count; i += job->nparts)
+        grepFile(&q, job->tree->root, job->tree->files[job->first + i], &job->results[i]);
+    if (q.re)
+        freeRegex(q.re);
+}
 
-    // Calculates scroll based on cursor position and text content
-    E.rx = E.cy < E.numrows ? getCursorRx(&E.row[E.cy], E.cx) : 0;
+/* SYNTAX HIGHLIGHTING */
 
-    if (E.cy < E.rowoff)
-    {
-        E.rowoff = E.cy;
-    }
-    if (E.cy >= E.rowoff + E.screenrows)
+void rowSetHighlight(erow *row, unsigned char *hl)
+{
+    // Compress per-column highlight classes into the row's runs, dropping normal text
+    int n = 0;
+    int i = 0;
+    while (i < row->rsize)
     {
-        E.rowoff = E.cy - E.screenrows + 1;
+        int j = i + 1;
+        while (j < row->rsize && hl[j] == hl[i] && j - i < HL_RUN_MAX)
+            j++;
+        if (hl[i] != HL_NORMAL)
+            n++;
+        i = j;
     }
-    if (E.rx - offset < E.coloff)
+
+    if (n == 0)
     {
-        E.coloff = E.rx - offset;
+        free(row->hl);
+        row->hl = NULL;
+        row->hlsize = 0;
+        return;
     }
-    if (E.rx >= E.coloff + E.screencols)
+    if (n != row->hlsize)
+        row->hl = realloc(row->hl, sizeof(hlrun) * n);
+
+    n = 0;
+    i = 0;
+    while (i < row->rsize)
     {
-        E.coloff = E.rx - E.screencols + 1;
+        int j = i + 1;
+        while (j < row->rsize && hl[j] == hl[i] && j - i < HL_RUN_MAX)
+            j++;
+        if (hl[i] != HL_NORMAL)
+        {
+            row->hl[n].start = i;
+            row->hl[n].len = j - i;
+            row->hl[n].type = hl[i];
+            n++;
+        }
+        i = j;
     }
+    row->hlsize = n;
 }
 
-void drawRows(struct abuf *ab)
+void rowOverlayHighlight(erow *row, int at, int len, int type)
 {
-    // Calculates the currently visible rows and appends them to the buffer
-    int y;
-    for (y = 0; y < E.screenrows; y++)
+    // Paint [at, at + len) with one highlight type, trimming or splitting the runs it covers
+    int end = at + len;
+    hlrun *out = malloc(sizeof(hlrun) * (row->hlsize + 2));
+    hlrun mark;
+    mark.start = at;
+    mark.len = len;
+    mark.type = type;
+
+    int n = 0;
+    int placed = 0;
+    for (int i = 0; i < row->hlsize; i++)
     {
-        int filerow = y + E.rowoff;
-        if (filerow >= E.numrows)
+        hlrun r = row->hl[i];
+        int rend = r.start + r.len;
+        if (rend <= at || r.start >= end)
         {
-            if (E.numrows == 0 && y == E.screenrows / 3)
-            {
-                char welcome[80];
-                int welcomelen = snprintf(welcome, sizeof(welcome),
-                                          "QTEdit -- version %s", VERSION);
-                if (welcomelen > E.screencols)
-                    welcomelen = E.screencols;
-                int padding = (E.screencols - welcomelen) / 2;
-                if (padding)
-                {
-                    abAppend(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--)
-                    abAppend(ab, " ", 1);
-                abAppend(ab, welcome, welcomelen);
-            }
-            else
+            if (!placed && r.start >= end)
             {
-                abAppend(ab, "~", 1);
+                out[n++] = mark;
+                placed = 1;
             }
+            out[n++] = r;
+            continue;
         }
-        else
+        if (r.start < at)
         {
-            // Start the row with line numbers
-            int maxlen = log10(E.numrows) + 2;
-            char starttext[8];
-            int nlen = sprintf(starttext, "%d ", filerow + 1);
-            char *start = malloc(maxlen + 1);
-            char *sp = start;
-            for (int i = 0; i < maxlen; i++)
-            {
-                if (i < nlen)
-                    *sp++ = starttext[i];
-                else
-                    *sp++ = ' ';
-            }
-            abAppend(ab, start, maxlen);
-            free(start);
-
-            // Append the actual content of the row
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0)
-                len = 0;
-            if (len > E.screencols - maxlen)
-                len = E.screencols - maxlen;
-            char *c = &E.row[filerow].render[E.coloff];       // Rendered content
-            unsigned char *hl = &E.row[filerow].hl[E.coloff]; // Syntax highlighting values
-            int cc = -1;                                      // Current color
-            int j;
-            for (j = 0; j < len; j++)
-            {
-                if (iscntrl(c[j]))
-                {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);
-                    if (cc != -1)
-                    {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", cc);
-                        abAppend(ab, buf, clen);
-                    }
-                }
-                else
-                {
-                    // Check if this position is selected
-                    int selected = isPositionSelected(filerow, E.coloff + j);
-                    int color;
-
-                    if (selected)
-                    {
-                        color = syntaxToColor(HL_SELECTION);
-                    }
-                    else if (hl[j] == HL_NORMAL)
-                    {
-                        color = -1; // No color for normal text
-                    }
-                    else
-                    {
-                        color = syntaxToColor(hl[j]);
-                    }
-
-                    if (color != cc)
-                    {
-                        if (cc != -1)
-                        {
-                            abAppend(ab, "\x1b[39m", 5); // Reset foreground
-                            if (cc == syntaxToColor(HL_SELECTION))
-                            {
-                                abAppend(ab, "\x1b[49m", 5); // Reset background
-                            }
-                        }
-                        cc = color;
-                        if (color != -1)
-                        {
-                            char buf[16];
-                            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                            abAppend(ab, buf, clen);
-                        }
-                    }
-                    abAppend(ab, &c[j], 1);
-                }
-            }
-            abAppend(ab, "\x1b[39m", 5); // Reset foreground color
-            abAppend(ab, "\x1b[49m", 5); // Reset background color
+            out[n] = r;
+            out[n].len = at - r.start;
+            n++;
         }
-
-        abAppend(ab, "\x1b[K", 3); // End the line
-        abAppend(ab, "\r\n", 2);
-    }
-}
-
-void drawBar(struct abuf *ab)
-{
-    // Appends a info bar to the buffer
-    abAppend(ab, "\x1b[7m", 4);
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-                       E.filename ? E.filename : "[No Name]", E.numrows,
-                       E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-                        E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
-    if (len > E.screencols)
-        len = E.screencols;
-    abAppend(ab, status, len);
-    while (len < E.screencols)
-    {
-        if (E.screencols - len == rlen)
+        if (!placed)
         {
-            abAppend(ab, rstatus, rlen);
-            break;
+            out[n++] = mark;
+            placed = 1;
         }
-        else
+        if (rend > end)
         {
-            abAppend(ab, " ", 1);
-            len++;
+            out[n] = r;
+            out[n].start = end;
+            out[n].len = rend - end;
+            n++;
         }
     }
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
-}
-
-void drawStatus(struct abuf *ab)
-{
-    abAppend(ab, "\x1b[K", 3);
-    int len = strlen(E.status);
-    if (len > E.screencols)
-        len = E.screencols;
-    if (len && time(NULL) - E.statustime < 5)
-        abAppend(ab, E.status, len);
-}
-
-void refreshScreen(void)
-{
-    scroll();
-
-    struct abuf ab = ABUF_INIT; // Initialize the append buffer
-
-    abAppend(&ab, "\x1b[?25l", 6); // Hide cursor
-    abAppend(&ab, "\x1b[H", 3);    // Move cursor to top-left corner
+    if (!placed)
+        out[n++] = mark;
 
-    drawRows(&ab);   // Draw the rows
-    drawBar(&ab);    // Draw the info bar
-    drawStatus(&ab); // Draw status message
-
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-    abAppend(&ab, buf, strlen(buf)); // Move cursor to the current position
-
-    abAppend(&ab, "\x1b[?25h", 6); // Show cursor
-
-    if (write(STDOUT_FILENO, ab.b, ab.len) == -1)
-        die("write"); // Write the buffer to stdout
-    abFree(&ab);      // Free the buffer
+    free(row->hl);
+    row->hl = out;
+    row->hlsize = n;
 }
 
-void setStatusMessage(const char *fmt, ...)
+int highlightRow(struct document *doc, erow *row)
 {
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(E.status, sizeof(E.status), fmt, ap);
-    va_end(ap);
-    E.statustime = time(NULL);
-}
-
-/** SYNTAX HIGLIGHTING **/
+    // Lex one row into highlight runs, returns 1 if whether it leaves a comment open changed
+    static unsigned char *hl = NULL; // Per-column scratch, compressed into runs once the row is lexed
+    static int hlcap = 0;
 
-void renderRowSyntax(erow *row)
-{
-    // Render the syntax of one row
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+    if (doc->syntax == NULL)
+    {
+        // Plain text has no runs, so there is nothing to lex
+        free(row->hl);
+        row->hl = NULL;
+        row->hlsize = 0;
+        return 0;
+    }
+    if (doc->hl_deferred)
+    {
+        row->hl_stale = HL_STALE_DEFERRED;
+        return 0;
+    }
+    long long started = doc->hl_clock ? monotonicNs() : 0;
 
-    if (E.syntax == NULL)
-        return;
+    if (row->rsize > hlcap)
+    {
+        hlcap = row->rsize;
+        hl = realloc(hl, hlcap);
+    }
+    memset(hl, HL_NORMAL, row->rsize);
 
-    char **keywords = E.syntax->keywords;
+    char **keywords = doc->syntax->keywords;
 
-    char *scs = E.syntax->sl_comment_start;
-    char *mcs = E.syntax->ml_comment_start;
-    char *mce = E.syntax->ml_comment_end;
+    char *scs = doc->syntax->sl_comment_start;
+    char *mcs = doc->syntax->ml_comment_start;
+    char *mce = doc->syntax->ml_comment_end;
 
     int scs_len = scs ? strlen(scs) : 0;
     int mcs_len = mcs ? strlen(mcs) : 0;
@@ -1251,19 +1676,19 @@ void renderRowSyntax(erow *row)
 
     int prev_sep = 1;
     int in_string = 0;
-    int in_comment = (row->index > 0 && E.row[row->index - 1].hl_open_comment);
+    int in_comment = (row->index > 0 && doc->row[row->index - 1].hl_open_comment);
 
     int i = 0;
     while (i < row->rsize)
     {
         char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+        unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
 
         if (scs_len && !in_string && !in_comment)
         {
             if (!strncmp(&row->render[i], scs, scs_len))
             {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+                memset(&hl[i], HL_COMMENT, row->rsize - i);
                 break;
             }
         }
@@ -1272,10 +1697,10 @@ void renderRowSyntax(erow *row)
         {
             if (in_comment)
             {
-                row->hl[i] = HL_MLCOMMENT;
+                hl[i] = HL_MLCOMMENT;
                 if (!strncmp(&row->render[i], mce, mce_len))
                 {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+                    memset(&hl[i], HL_MLCOMMENT, mce_len);
                     i += mce_len;
                     in_comment = 0;
                     prev_sep = 1;
@@ -1289,21 +1714,21 @@ void renderRowSyntax(erow *row)
             }
             else if (!strncmp(&row->render[i], mcs, mcs_len))
             {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+                memset(&hl[i], HL_MLCOMMENT, mcs_len);
                 i += mcs_len;
                 in_comment = 1;
                 continue;
             }
         }
 
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS)
+        if (doc->syntax->flags & HL_HIGHLIGHT_STRINGS)
         {
             if (in_string)
             {
-                row->hl[i] = HL_STRING;
+                hl[i] = HL_STRING;
                 if (c == '\\' && i + 1 < row->rsize)
                 {
-                    row->hl[i + 1] = HL_STRING;
+                    hl[i + 1] = HL_STRING;
                     i += 2;
                     continue;
                 }
@@ -1318,19 +1743,19 @@ void renderRowSyntax(erow *row)
                 if (c == '"' || c == '\'')
                 {
                     in_string = c;
-                    row->hl[i] = HL_STRING;
+                    hl[i] = HL_STRING;
                     i++;
                     continue;
                 }
             }
         }
 
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS)
+        if (doc->syntax->flags & HL_HIGHLIGHT_NUMBERS)
         {
             if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
                 (c == '.' && prev_hl == HL_NUMBER)) // Highlight numbers
             {
-                row->hl[i] = HL_NUMBER;
+                hl[i] = HL_NUMBER;
                 i++;
                 prev_sep = 0;
                 continue;
@@ -1349,7 +1774,7 @@ void renderRowSyntax(erow *row)
                 if (!strncmp(&row->render[i], keywords[j], klen) &&
                     is_separator(row->render[i + klen]))
                 {
-                    memset(&row->hl[i], kw2 ? HL_KEY1 : HL_KEY2, klen);
+                    memset(&hl[i], kw2 ? HL_KEY1 : HL_KEY2, klen);
                     i += klen;
                     break;
                 }
@@ -1425,7 +1850,7 @@ void renderRowSyntax(erow *row)
 
                 if (is_function)
                 {
-                    memset(&row->hl[i], HL_FUNC, len);
+                    memset(&hl[i], HL_FUNC, len);
                     i += len;
                     prev_sep = 0;
                     continue;
@@ -1523,7 +1948,7 @@ void renderRowSyntax(erow *row)
 
                 if (is_var)
                 {
-                    memset(&row->hl[i], HL_VAR, len);
+                    memset(&hl[i], HL_VAR, len);
                     i += len;
                     prev_sep = 0;
                     continue;
@@ -1535,58 +1960,56 @@ void renderRowSyntax(erow *row)
         i++;
     }
 
+    rowSetHighlight(row, hl);
+
     int changed = (row->hl_open_comment != in_comment);
     row->hl_open_comment = in_comment;
-    if (changed && row->index + 1 < E.numrows)
-        renderRowSyntax(&E.row[row->index + 1]);
+    row->hl_stale = 0;
+    if (doc->hl_clock)
+        *doc->hl_clock += monotonicNs() - started;
+    return changed;
 }
 
-int syntaxToColor(int hl)
+void flushHighlight(struct document *doc)
 {
-    // HL color assignments
-    switch (hl)
-    {
-    case HL_COMMENT:
-    case HL_MLCOMMENT:
-        return 32;
-    case HL_KEY1:
-        return 34;
-    case HL_KEY2:
-        return 35;
-    case HL_STRING:
-        return 91;
-    case HL_NUMBER:
-        return 92;
-    case HL_FUNC:
-        return 33;
-    case HL_VAR:
-        return 96;
-    case HL_MATCH:
-        return 93;
-    case HL_SELECTION:
-        return 47; // White background for selection
-    default:
-        return 37;
-    }
+    // Highlight the rows left stale while highlighting was deferred, in one sweep that
+    // also carries on past them while their comment state changed
+    int carry = 0;
+    for (int r = 0; r < doc->numrows; r++)
+        if (doc->row[r].hl_stale == HL_STALE_DEFERRED || carry)
+            carry = highlightRow(doc, &doc->row[r]);
+}
+
+void highlightLazy(struct document *doc, erow *row)
+{
+    // Lex a row read from the cache before it is shown. The comment state it ends in
+    // is already right, so the rows below need nothing.
+    if (row->hl_stale == HL_STALE_LAZY && !doc->hl_deferred)
+        highlightRow(doc, row);
+}
+
+void renderRowSyntax(struct document *doc, erow *row)
+{
+    // Render the syntax of one row, and of the rows below while its comment state carries over
+    int at = row->index;
+    while (highlightRow(doc, &doc->row[at]) && ++at < doc->numrows)
+        ;
 }
 
-void renderSyntax(void)
+void renderSyntax(struct document *doc)
 {
     // Render the whole file's syntax
     int filerow;
-    for (filerow = 0; filerow < E.numrows; filerow++)
+    for (filerow = 0; filerow < doc->numrows; filerow++)
     {
-        renderRowSyntax(&E.row[filerow]);
+        renderRowSyntax(doc, &doc->row[filerow]);
     }
 }
 
-void selectSyntax(void)
+struct editorSyntax *findSyntax(const char *filename)
 {
-    // Select syntax based on filename
-    E.syntax = NULL;
-    if (E.filename == NULL)
-        return;
-    char *ext = strrchr(E.filename, '.');
+    // Syntax a file name gets, NULL for plain text
+    char *ext = strrchr(filename, '.');
     for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
     {
         struct editorSyntax *s = &HLDB[j];
@@ -1595,280 +2018,21 @@ void selectSyntax(void)
         {
             int is_ext = (s->filematch[i][0] == '.');
             if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-                (!is_ext && strstr(E.filename, s->filematch[i])))
-            {
-                E.syntax = s;
-                renderSyntax();
-                return;
-            }
+                (!is_ext && strstr(filename, s->filematch[i])))
+                return s;
             i++;
         }
     }
+    return NULL;
 }
 
-/* SELECTION */
-
-void clearSelection(void)
-{
-    // Clear current selection
-    E.sel_active = 0;
-    E.sel_start_cx = E.sel_start_cy = 0;
-    E.sel_end_cx = E.sel_end_cy = 0;
-}
-
-void startSelection(void)
-{
-    // Start a new selection at current cursor position
-    int offset = log10(E.numrows) + 2;
-    E.sel_active = 1;
-    E.sel_start_cx = E.cx - offset;
-    E.sel_start_cy = E.cy;
-    E.sel_end_cx = E.cx - offset;
-    E.sel_end_cy = E.cy;
-}
-
-void updateSelection(void)
-{
-    // Update selection end to current cursor position
-    if (E.sel_active)
-    {
-        int offset = log10(E.numrows) + 2;
-        E.sel_end_cx = E.cx - offset;
-        E.sel_end_cy = E.cy;
-    }
-}
-
-int isPositionSelected(int row, int col)
-{
-    // Check if a position is within the current selection
-    if (!E.sel_active)
-        return 0;
-
-    int start_row = E.sel_start_cy;
-    int start_col = E.sel_start_cx;
-    int end_row = E.sel_end_cy;
-    int end_col = E.sel_end_cx;
-
-    // Normalize selection so start is always before end
-    if (start_row > end_row || (start_row == end_row && start_col > end_col))
-    {
-        int temp_row = start_row;
-        int temp_col = start_col;
-        start_row = end_row;
-        start_col = end_col;
-        end_row = temp_row;
-        end_col = temp_col;
-    }
-
-    // Check if position is within selection bounds
-    if (row < start_row || row > end_row)
-        return 0;
-    if (row == start_row && col < start_col)
-        return 0;
-    if (row == end_row && col >= end_col)
-        return 0;
-
-    return 1;
-}
-
-void deleteSelection(void)
-{
-    // Delete all text within the current selection
-    if (!E.sel_active)
-        return;
-
-    int start_row = E.sel_start_cy;
-    int start_col = E.sel_start_cx;
-    int end_row = E.sel_end_cy;
-    int end_col = E.sel_end_cx;
-
-    // Normalize selection so start is always before end
-    if (start_row > end_row || (start_row == end_row && start_col > end_col))
-    {
-        int temp_row = start_row;
-        int temp_col = start_col;
-        start_row = end_row;
-        start_col = end_col;
-        end_row = temp_row;
-        end_col = temp_col;
-    }
-
-    // Position cursor at selection start
-    int offset = log10(E.numrows) + 2;
-    E.cy = start_row;
-    E.cx = start_col + offset;
-
-    if (start_row == end_row)
-    {
-        // Selection is within a single row
-        erow *row = &E.row[start_row];
-        memmove(&row->chars[start_col], &row->chars[end_col],
-                row->size - end_col + 1);
-        row->size -= (end_col - start_col);
-        renderRow(row);
-        E.dirty++;
-    }
-    else
-    {
-        // Selection spans multiple rows
-
-        // First, modify the start row to remove everything from start_col to end
-        erow *start_row_ptr = &E.row[start_row];
-        start_row_ptr->size = start_col;
-        start_row_ptr->chars[start_col] = '\0';
-
-        // If end row exists, append the remainder of end row to start row
-        if (end_row < E.numrows)
-        {
-            erow *end_row_ptr = &E.row[end_row];
-            char *remaining = &end_row_ptr->chars[end_col];
-            int remaining_len = end_row_ptr->size - end_col;
-
-            start_row_ptr->chars = realloc(start_row_ptr->chars,
-                                           start_row_ptr->size + remaining_len + 1);
-            memcpy(&start_row_ptr->chars[start_row_ptr->size], remaining, remaining_len);
-            start_row_ptr->size += remaining_len;
-            start_row_ptr->chars[start_row_ptr->size] = '\0';
-        }
-
-        renderRow(start_row_ptr);
-
-        // Delete all rows between start_row+1 and end_row (inclusive)
-        for (int i = end_row; i > start_row; i--)
-        {
-            deleteRow(i);
-        }
-
-        E.dirty++;
-    }
-
-    clearSelection();
-}
-
-void copySelection(void)
-{
-    // Copy selected text to clipboard using pbcopy
-    if (!E.sel_active)
-        return;
-
-    int start_row = E.sel_start_cy;
-    int start_col = E.sel_start_cx;
-    int end_row = E.sel_end_cy;
-    int end_col = E.sel_end_cx;
-
-    // Normalize selection so start is always before end
-    if (start_row > end_row || (start_row == end_row && start_col > end_col))
-    {
-        int temp_row = start_row;
-        int temp_col = start_col;
-        start_row = end_row;
-        start_col = end_col;
-        end_row = temp_row;
-        end_col = temp_col;
-    }
-
-    // Create a pipe to pbcopy
-    FILE *pbcopy = popen("pbcopy", "w");
-    if (!pbcopy)
-    {
-        setStatusMessage("Error: Could not access clipboard");
-        return;
-    }
-
-    if (start_row == end_row)
-    {
-        // Selection is within a single row
-        erow *row = &E.row[start_row];
-        for (int i = start_col; i < end_col && i < row->size; i++)
-        {
-            fputc(row->chars[i], pbcopy);
-        }
-    }
-    else
-    {
-        // Selection spans multiple rows
-
-        // First row: from start_col to end of line
-        erow *row = &E.row[start_row];
-        for (int i = start_col; i < row->size; i++)
-        {
-            fputc(row->chars[i], pbcopy);
-        }
-        fputc('\n', pbcopy);
-
-        // Middle rows: entire rows
-        for (int r = start_row + 1; r < end_row; r++)
-        {
-            row = &E.row[r];
-            for (int i = 0; i < row->size; i++)
-            {
-                fputc(row->chars[i], pbcopy);
-            }
-            fputc('\n', pbcopy);
-        }
-
-        // Last row: from beginning to end_col
-        if (end_row < E.numrows)
-        {
-            row = &E.row[end_row];
-            for (int i = 0; i < end_col && i < row->size; i++)
-            {
-                fputc(row->chars[i], pbcopy);
-            }
-        }
-    }
-
-    pclose(pbcopy);
-    setStatusMessage("Text copied to clipboard");
-}
-
-void pasteFromClipboard(void)
+void selectSyntax(struct document *doc)
 {
-    // Delete selected text if any
-    if (E.sel_active)
-    {
-        deleteSelection();
-    }
-
-    // Get text from clipboard using pbpaste
-    FILE *pbpaste = popen("pbpaste", "r");
-    if (!pbpaste)
-    {
-        setStatusMessage("Error: Could not access clipboard");
+    // Select syntax based on filename
+    doc->syntax = NULL;
+    if (doc->filename == NULL)
         return;
-    }
-
-    // Read clipboard content directly and insert character by character
-    int c;
-    int char_count = 0;
-    while ((c = fgetc(pbpaste)) != EOF)
-    {
-        if (c == '\n')
-        {
-            insertNewline();
-        }
-        else if (c != '\r') // Skip carriage returns
-        {
-            insertChar(c);
-        }
-        char_count++;
-
-        // Prevent extremely long pastes from freezing the editor
-        if (char_count > 100000)
-        {
-            setStatusMessage("Paste truncated - too large");
-            break;
-        }
-    }
-
-    pclose(pbpaste);
-
-    if (char_count == 0)
-    {
-        setStatusMessage("Clipboard is empty");
-    }
-    else
-    {
-        setStatusMessage("Text pasted from clipboard");
-    }
+    doc->syntax = findSyntax(doc->filename);
+    if (doc->syntax)
+        renderSyntax(doc);
 }
@@ -1,38 +1,29 @@
 /* IMPORTS */
 
-#include <termios.h>
-#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 /* MACROS */
 
-#define CTRL_KEY(k) ((k) & 0x1f) // Macro to get the value of ctrl + some key
-#define ABUF_INIT {NULL, 0}      // Empty append buffer
 #define TAB_STOP 4               // How many chars each tab is
-#define QUIT_PROT 3              // Number of times to press Ctrl-X to quit when dirty
-
-#define VERSION "1.0.2"
-#define GUIDE_TEXT "Ctrl-S: Save | Ctrl-X: Quit | Ctrl-F: Find | Ctrl-G: Goto | Ctrl-K: Delete | Ctrl-C/V: Copy/Paste | Ctrl-H: Help" // Status message for help
-#define QUIT_TEXT "WARNING: File has unsaved changes. Press Ctrl-X %d more time%s to quit."                                                             // Status message for quit without saving warning
-#define FIND_TEXT "Search: %s (Use ESC/Arrows/Enter)"                                                                                                   // Status message for search
-
-enum keycodes // Codes for break characters
-{
-    BACKSPACE = 127,
-    ARROW_LEFT = 1000,
-    ARROW_RIGHT,
-    ARROW_UP,
-    ARROW_DOWN,
-    SHIFT_ARROW_LEFT,
-    SHIFT_ARROW_RIGHT,
-    SHIFT_ARROW_UP,
-    SHIFT_ARROW_DOWN,
-    HOME_KEY,
-    END_KEY,
-    PAGE_UP,
-    PAGE_DOWN,
-    DELETE_KEY,
-    SKIP_KEY, // Key that wont be processed
-};
+#define SEARCH_CACHE_MAX 4194304 // Most candidate positions find keeps for one query length
+#define SEARCH_PARALLEL_MIN 4096 // Fewest rows (or candidates) worth splitting across threads
+#define TRIGRAM_BITS 16          // Bits of the trigram hash, the index has 1 << TRIGRAM_BITS posting lists
+#define TRIGRAM_BUCKETS (1 << TRIGRAM_BITS)
+#define TRIGRAM_BLOCK_BYTES 16384 // Text gathered into one index block before the next is started
+#define TRIGRAM_STEP_BYTES 262144 // Text indexed between checks for a keypress
+#define GREP_BATCH 256           // Files searched between updates of the project search results
+#define UNDO_LIMIT 64            // Default megabytes of undo history kept
+#define JOURNAL_BATCH_MS 50      // Edits gathered into one write and fdatasync of a recovery journal
+#define JOURNAL_COMPACT 4194304  // Journal size past which it is rewritten as a copy of the text, when that is smaller
+#define JOURNAL_SUFFIX ".qtj"    // Journal of a file "dir/name" is "dir/.name.qtj"
+#define CACHE_MIN_BYTES 1048576  // Smallest highlighted file whose lines and comment states are cached
+#define CACHE_SUFFIX ".qtc"      // Cache of a file "dir/name" is "dir/.name.qtc"
+#define HIST_SUB_BITS 5          // Each power of two of a histogram is split in 1 << HIST_SUB_BITS buckets
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS) * HIST_SUB)
+#define MEM_HL_BYTES 12          // Rendered bytes per highlight run, to reckon what a file will take
 
 enum highlight // Highlight types
 {
@@ -53,6 +44,20 @@ enum highlight // Highlight types
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
+// Why a row's highlighting is stale
+#define HL_STALE_DEFERRED 1 // Edited while highlighting was deferred, see flushHighlight
+#define HL_STALE_LAZY 2     // Not lexed yet but its comment state is known, see highlightLazy
+
+// Undo op types
+#define UNDO_INSERT 0
+#define UNDO_DELETE 1
+#define JOURNAL_TEXT 2 // Journal record of the whole text, replacing what came before
+
+// Search flags
+#define SEARCH_ICASE (1 << 0) // Match regardless of letter case
+#define SEARCH_WORD (1 << 1)  // Only match whole words
+#define SEARCH_REGEX (1 << 2) // Treat the query as a regular expression
+
 /* STRUCTS */
 
 struct editorSyntax
@@ -66,92 +71,360 @@ struct editorSyntax
     int flags;
 };
 
+typedef struct hlrun
+{
+    int start;             // First render column covered by the run
+    unsigned int len : 24; // Number of columns covered
+    unsigned int type : 8; // Highlight type of the run
+} hlrun;
+
+#define HL_RUN_MAX 0xFFFFFF // Longest span a single run can cover
+
 typedef struct erow
 {
     int index;
-    char *chars;       // Actual content of a row
-    char *render;      // Whats visible to the user
-    unsigned char *hl; // Syntax highlighting
+    char *chars;  // Actual content of a row
+    char *render; // Whats visible to the user
+    hlrun *hl;    // Syntax highlighting, non-normal runs sorted by start
+    int hlsize;   // Number of highlight runs
     int size;
     int rsize;
     int hl_open_comment; // If the row has an open comment
+    int hl_stale;        // HL_STALE_* if the runs are not up to date, 0 if they are
 } erow;
 
-struct editorConfig
+struct regex;
+
+struct searchQuery
 {
-    int cx, cy;                  // Where cursor currently is
-    int rx;                      // Where cursor is visible after render changes
-    int screenrows, screencols;  // Size of screen
-    int numrows;                 // Rows of text in memory
-    int rowoff, coloff;          // Offsets of whats currently visible
-    erow *row;                   // Text in memory
-    int dirty;                   // If the file has been modified
-    char *filename;              // Name of open file
-    char status[200];            // Msg show at the bottom
-    time_t statustime;           // Timestamp of status
-    struct editorSyntax *syntax; // Syntax for open editor
-    struct termios orig_termios; // Original terminal
-
-    // Selection state
-    int sel_active;                 // Whether selection is active
-    int sel_start_cx, sel_start_cy; // Selection start position
-    int sel_end_cx, sel_end_cy;     // Selection end position
-};
-
-struct abuf
-{ // Append buffer to group up write operations
-    char *b;
+    char *needle;           // Pattern, lowercased when matching case-insensitively
+    struct regex *re;       // Compiled pattern for SEARCH_REGEX, NULL otherwise
+    const char *error;      // Why the regex did not compile, NULL if it did
+    int len;                // Length of the pattern
+    int flags;              // SEARCH_* flags
+    unsigned char first[2]; // Accepted values of the first byte
+    unsigned char last[2];  // Accepted values of the last byte
+};
+
+struct searchMatch
+{
+    int row; // Row the match is in
+    int col; // Offset of the match into chars
+    int len; // Length of the match in chars
+};
+
+struct searchLevel
+{
+    int qlen;                    // Length of the query prefix the candidates match
+    struct searchMatch *matches; // Candidate positions sorted by row then column
+    int count;                   // Number of candidates
+    int complete;                // 0 if there were too many candidates to keep
+};
+
+struct searchCache
+{
+    char *query;                 // Query the deepest level was built for
+    int flags;                   // SEARCH_* modes the levels were built with
+    struct searchLevel *levels;  // One level per cached query length, shortest first
+    int depth;                   // Number of cached levels
+};
+
+struct matchIndex
+{
+    struct searchQuery q;        // Query the index holds, needle is NULL when there is none
+    struct searchMatch *matches; // Every match sorted by row then column
+    int count;                   // Number of matches
+    int cap;                     // Allocated size of matches
+    int complete;                // 0 if there were too many matches to index
+    int current;                 // Match last shown, -1 if none
+    int origin_row, origin_col;  // Position find started from
+};
+
+struct trigramPosting
+{
+    uint32_t *blocks; // Sorted ids of the blocks holding a trigram
+    int count;
+    int cap;
+};
+
+struct trigramIndex
+{
+    struct trigramPosting *postings; // One list per trigram hash, NULL when there is no index
+    int *blockrows;                  // Rows in each block, blocks cover the rows in order
+    int *blockstart;                 // First row of each block, rebuilt lazily by trigramBlockOf
+    int starts;                      // Leading blocks whose blockstart is still right
+    int nblocks;
+    int blockcap;
+    int rows;                        // Rows covered by the blocks, later rows are not indexed yet
+    long fill;                       // Bytes in the last block while building
+    long entries;                    // Posting list entries over all trigrams
+    int building;                    // Whether rows are still left to index
+};
+
+struct undoOp
+{
+    long off;                   // Where the op's text starts in the arena
+    long len;                   // Bytes inserted or deleted, newlines between rows included
+    int row, col;               // Where in the document the text was inserted or deleted
+    int cur_row, cur_col;       // Cursor before the op's group, restored by undo
+    unsigned int group;         // Ops of one group are undone and redone together
+    unsigned char type;         // UNDO_INSERT or UNDO_DELETE
+    unsigned char backward;     // Text is stored last char first (a run of backspaces)
+    unsigned char run;          // Op is typing that later keystrokes may extend
+};
+
+struct undoLog
+{
+    char *arena;                // Text of every op, appended in order
+    long used;
+    long arenacap;
+    struct undoOp *ops;
+    int count;
+    int cap;
+    int done;                   // Ops currently applied, those after it can be redone
+    unsigned int group;         // Group new ops join
+    int cur_row, cur_col;       // Cursor when the group started
+    int sealed;                 // If the next op has to start a new run
+    int suspended;              // Recording is off while above 0
+    long limit;                 // Most bytes kept, the oldest groups are dropped past it
+    struct journal *journal;    // Where every op recorded is also written, NULL if none
+};
+
+struct journal
+{
+    int fd;                     // Journal file open for appending, -1 when there is none
+    char *path;
+    char *buf;                  // Records not handed to the writer yet
+    long len;
+    long cap;
+    long queued;                // How many records buf holds
+    char *spare;                // Buffer the writer is writing from
+    long sparecap;
+    long long size;             // Bytes written or queued, the journal is compacted past compact_at
+    long long compact_at;
+    long long base_size;        // File the records apply to, written in the header
+    long long base_mtime;
+    long long base_ino;
+    int fresh;                  // The header has to come before the next record
+    int rewrite;                // Records queued replace the journal instead of following it
+    int closing;                // Writer finishes what is queued and stops
+    int error;                  // errno of the last write that failed, 0 if none
+    long commits;               // Batches written and synced
+    long records;               // Records written in those batches
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        // Signalled when records are queued
+};
+
+struct grepTree
+{
+    char *root;                 // Directory the walk started from
+    char **files;               // Paths relative to the root, sorted
+    int nfiles;
+    int filecap;
+    struct grepIgnore **rules;  // Every rule set read, freed with the tree
+    int nrules;
+    int rulecap;
+};
+
+struct grepResult
+{
+    char *out;  // "path:line:col: text" lines for one file
     int len;
+    int cap;
+    long hits;
+    long bytes; // Size of the file searched
+};
+
+struct grepJob
+{
+    struct searchQuery *q;
+    struct grepTree *tree;
+    int first;                  // First file of the batch
+    int count;                  // Files in the batch
+    int nparts;
+    struct grepResult *results; // One per file of the batch
+};
+
+struct histogram
+{
+    uint64_t counts[HIST_BUCKETS]; // Values recorded in each bucket, see histRecord
+    uint64_t count;
+    long long sum;
+    long long min, max;
+};
+
+struct memUsage
+{
+    long rows;                   // Rows counted
+    size_t chars;                // Text of the rows
+    size_t render;               // Rows as drawn, tabs expanded
+    size_t hl;                   // Highlight runs
+    size_t row_array;            // erow entries of the rows
+    size_t row_slack;            // Space the row array has past them
+    size_t slack;                // Allocated past what the rows' text, render and runs hold
+    size_t headers;              // Allocator bookkeeping, a size header per allocation
+    size_t undo;                 // Undo history, see undoMemory
+    size_t trigrams;             // Trigram index, see trigramMemory
+    size_t search;               // Matches kept by find
+    size_t total;
+};
+
+struct document
+{
+    erow *row;                   // Text in memory
+    int numrows;                 // Rows of text in memory
+    int dirty;                   // If the text has been modified
+    char *filename;              // Name of the file, NULL for an unnamed document
+    struct editorSyntax *syntax; // Syntax picked from the file name, NULL for plain text
+    struct searchCache search;   // Candidate matches of the open find prompt
+    struct matchIndex matches;   // All matches of the last find query, kept up to date on edits
+    struct trigramIndex trigrams; // Blocks each trigram appears in, narrows find to candidate rows
+    struct undoLog undo;         // Edits that can be undone and redone
+    struct journal journal;      // Edits written to disk as they are made, see docJournal
+    int hl_deferred;             // Rows are only marked stale instead of highlighted, e.g. during replay
+    long long *hl_clock;         // Nanoseconds spent lexing are added here, NULL to not time it
+    long long disk_size;         // File as last read or written, see docChanged. -1 if unknown
+    long long disk_mtime;        // In nanoseconds, see statMtime
+    long long disk_ino;
 };
 
-/* FILETYPES FOR HL */
-
-/** C **/
-char *C_HL_extensions[] = {".c", ".h", ".cpp", NULL};
-char *C_HL_keywords[] = {
-    "switch", "if", "while", "for", "break", "continue",
-    "enum", "case", "#include", "return", "else", "#define",
-    "int|", "long|", "double|", "float|", "char|", "unsigned|",
-    "void|", "extern|", "size_t|", "ssize_t|", "static|",
-    "struct|", "union|", "class|", "typedef|", "signed|",
-    "time_t|", NULL};
-
-/**  JS/TS **/
-char *JS_HL_extensions[] = {".js", ".jsx", NULL};
-char *JS_HL_keywords[] = {
-    "switch", "if", "while", "for", "break", "continue",
-    "case", "return", "else", "import", "from", "export",
-    "default", "async", "await", "try", "catch", "finally",
-    "function|", "const|", "var|", "class|", "static|",
-    "let|", "extends|", "keyof|", "typeof|", "in|",
-    "of|", "new|", "this|", NULL};
-
-char *TS_HL_extensions[] = {".ts", ".tsx", NULL};
-char *TS_HL_keywords[] = {
-    "switch", "if", "while", "for", "break", "continue",
-    "enum", "case", "return", "else", "import", "from", "export",
-    "default", "async", "await", "try", "catch", "finally",
-    "function|", "string|", "number|", "const|", "var|",
-    "interface|", "type|", "class|", "String|", "boolean|",
-    "let|", "public|", "extends|", "keyof|", "typeof|", "in|",
-    "of|", "new|", "this|", "static|", "private|", NULL};
-
-struct editorSyntax HLDB[] = {
-    {"c",
-     C_HL_extensions,
-     C_HL_keywords,
-     "//", "/*", "*/",
-     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
-    {"javascript",
-     JS_HL_extensions,
-     JS_HL_keywords,
-     "//", "/*", "*/",
-     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
-    {"typescript",
-     TS_HL_extensions,
-     TS_HL_keywords,
-     "//", "/*", "*/",
-     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
-};
-
-#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+/* PROTOTYPES */
+
+// The editing engine, built into libqtedit.a. Every call works on the document it is
+// handed, so any number can be open at once.
+
+/** util.c **/
+
+int is_separator(int c);
+char *sidecarPath(const char *filename, const char *suffix);
+long long statMtime(const struct stat *st);
+
+/** search.c **/
+
+int isWordChar(int c);
+int compileQuery(struct searchQuery *q, const char *needle, int flags);
+void freeQuery(struct searchQuery *q);
+int matchAt(const struct searchQuery *q, const char *hay, int len, int at);
+int findInText(const struct searchQuery *q, const char *hay, int len, int from);
+int nextMatchFrom(const struct searchQuery *q, int at, int mlen);
+int findMatch(const struct searchQuery *q, const char *hay, int len, int from, int *mlen);
+
+/** trigram.c **/
+
+void trigramInit(struct trigramIndex *ix);
+void trigramFree(struct trigramIndex *ix);
+size_t trigramMemory(const struct trigramIndex *ix);
+int trigramBuildStep(struct trigramIndex *ix, erow *rows, int numrows, long budget);
+void trigramRowChanged(struct trigramIndex *ix, int at, const char *s, int len);
+void trigramRowsInserted(struct trigramIndex *ix, int at, int n);
+void trigramRowsDeleted(struct trigramIndex *ix, int at, int n);
+int trigramCandidates(const struct trigramIndex *ix, const char *lit, int len, uint32_t **blocks);
+
+/** undo.c **/
+
+void undoInit(struct undoLog *log, long limit);
+void undoClear(struct undoLog *log);
+long undoMemory(const struct undoLog *log);
+void undoStartGroup(struct undoLog *log, int cur_row, int cur_col);
+void undoSeal(struct undoLog *log);
+void undoRecord(struct undoLog *log, int type, int row, int col, const char *s, long len, int eol);
+char *undoText(const struct undoLog *log, const struct undoOp *op);
+
+/** journal.c **/
+
+int journalPending(const char *filename);
+void journalInit(struct journal *j);
+void journalAppend(struct journal *j, int type, int row, int col, const char *s, long len, int eol);
+int docRecover(struct document *doc);
+int docJournal(struct document *doc);
+void docJournalReset(struct document *doc);
+int docJournalCompact(struct document *doc);
+void docJournalClose(struct document *doc, int keep);
+
+/** cache.c **/
+
+uint64_t cacheHash(const char *s, long len);
+int docCacheLoad(struct document *doc, const char *data, long size, long long mtime, uint64_t hash);
+void docCacheStore(struct document *doc, const uint32_t *lens, long size, long long mtime, uint64_t hash);
+
+/** hist.c **/
+
+long long monotonicNs(void);
+void histInit(struct histogram *h);
+uint64_t histLowest(int bucket);
+void histRecord(struct histogram *h, long long v);
+long long histPercentile(const struct histogram *h, double p);
+
+/** mem.c **/
+
+void docMemory(struct document *doc, struct memUsage *m);
+long long fileMemory(const char *filename, int highlighted, long *lines);
+
+/** pool.c **/
+
+int poolSize(void);
+void poolRun(void (*fn)(void *, int), void *arg, int nparts);
+
+/** grep.c **/
+
+void grepWalk(struct grepTree *tree, const char *root);
+void grepFreeTree(struct grepTree *tree);
+void grepFile(struct searchQuery *q, const char *root, const char *rel, struct grepResult *res);
+
+/** core.c **/
+
+void renderRowText(erow *row);
+void renderRow(struct document *doc, erow *row);
+void insertRow(struct document *doc, int at, char *s, size_t len);
+int getCursorRx(erow *row, int cx);
+int getCursorCx(erow *row, int rx);
+void rowInsertChar(struct document *doc, erow *row, int at, char c);
+void rowDeleteChar(struct document *doc, erow *row, int at);
+void freeRow(erow *row);
+void deleteRow(struct document *doc, int at);
+void rowAppendString(struct document *doc, erow *row, char *s, size_t len);
+char *rangeToString(struct document *doc, int r0, int c0, int r1, int c1, long *len);
+erow *openRows(struct document *doc, int at, int n);
+void renderRows(struct document *doc, int from, int to);
+void insertText(struct document *doc, int r, int c, const char *s, long len);
+void deleteRange(struct document *doc, int r0, int c0, int r1, int c1);
+void recordRewrite(struct document *doc, int at, const char *old, int oldsize);
+void textEnd(int row, int col, const char *s, long len, int *end_row, int *end_col);
+void applyUndoOp(struct document *doc, struct undoOp *op, int forward);
+int docUndo(struct document *doc, int *row, int *col);
+int docRedo(struct document *doc, int *row, int *col);
+void *rowsToString(struct document *doc, int *buflen);
+void docInit(struct document *doc);
+void docClear(struct document *doc);
+int docOpen(struct document *doc, const char *filename);
+int docSave(struct document *doc);
+void docStat(struct document *doc);
+int docChanged(struct document *doc);
+int docReload(struct document *doc, int *at, int *removed, int *added);
+int docFollow(struct document *doc, int *added);
+int *candidateRows(struct document *doc, struct searchQuery *q, int *nrows);
+int collectMatches(struct document *doc, struct searchQuery *q, struct searchLevel *from, struct searchMatch **matches,
+                   int *count);
+void clearSearchCache(struct document *doc);
+void buildSearchLevel(struct document *doc, struct searchLevel *lv, char *query, int qlen, int flags,
+                      struct searchLevel *from);
+struct searchLevel *syncSearchCache(struct document *doc, char *query, int flags);
+void clearMatchIndex(struct document *doc);
+void buildMatchIndex(struct document *doc, char *query, int flags, struct searchLevel *lv);
+int matchLowerBound(struct document *doc, int row, int col);
+void indexRowChanged(struct document *doc, int at);
+void indexRowsShifted(struct document *doc, int at, int delta);
+void indexRowsDeleted(struct document *doc, int at, int n);
+int rewriteRow(struct searchQuery *q, erow *row, int lo, int hi, const char *with, int wlen, char **old);
+long replaceMatches(struct document *doc, struct searchQuery *q, const char *with, int r0, int c0, int r1, int c1);
+void grepPart(void *arg, int part);
+void rowSetHighlight(erow *row, unsigned char *hl);
+void rowOverlayHighlight(erow *row, int at, int len, int type);
+int highlightRow(struct document *doc, erow *row);
+void flushHighlight(struct document *doc);
+void highlightLazy(struct document *doc, erow *row);
+void renderRowSyntax(struct document *doc, erow *row);
+void renderSyntax(struct document *doc);
+struct editorSyntax *findSyntax(const char *filename);
+void selectSyntax(struct document *doc);
@@ -0,0 +1,461 @@
+/* IMPORTS */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* MACROS */
+
+#define GREP_TEXT_MAX 512    // Longest part of a matching line copied into a result
+#define GREP_BINARY_SCAN 8000 // Leading bytes checked for a NUL to tell binary files apart
+
+/* DATA */
+
+struct grepPattern
+{
+    char *glob;   // Pattern with any leading '!' or '/' and trailing '/' removed
+    int negate;   // Pattern started with '!', so matching un-ignores
+    int dironly;  // Pattern ended with '/', so it only applies to directories
+    int anchored; // Pattern has a '/' in it, so it matches paths from its base
+};
+
+struct grepIgnore
+{
+    struct grepIgnore *parent; // Rules of the directory above, NULL at the root
+    char *base;                // Directory the rules were read from, relative to the root
+    struct grepPattern *patterns;
+    int count;
+};
+
+struct grepDir
+{
+    char *rel;                // Path relative to the root, "" for the root itself
+    struct grepIgnore *rules; // Rules that apply to entries of the directory
+};
+
+/* FUNCTIONS */
+
+static void grepAppend(struct grepResult *res, const char *s, int len)
+{
+    if (res->len + len > res->cap)
+    {
+        res->cap = (res->len + len) * 2;
+        res->out = realloc(res->out, res->cap);
+    }
+    memcpy(&res->out[res->len], s, len);
+    res->len += len;
+}
+
+static char *grepJoin(const char *dir, const char *name)
+{
+    // dir/name, or just name when dir is empty
+    size_t dl = strlen(dir);
+    size_t nl = strlen(name);
+    char *path = malloc(dl + nl + 2);
+    memcpy(path, dir, dl);
+    if (dl)
+        path[dl++] = '/';
+    memcpy(&path[dl], name, nl + 1);
+    return path;
+}
+
+static struct grepIgnore *grepReadIgnore(const char *root, const char *rel, struct grepIgnore *parent)
+{
+    // Rules of the .gitignore in a directory, NULL if it has none
+    char *dir = grepJoin(root, rel);
+    char *path = grepJoin(dir, ".gitignore");
+    FILE *fp = fopen(path, "r");
+    free(dir);
+    free(path);
+    if (!fp)
+        return NULL;
+
+    struct grepIgnore *ig = malloc(sizeof(struct grepIgnore));
+    ig->parent = parent;
+    ig->base = strdup(rel);
+    ig->patterns = NULL;
+    ig->count = 0;
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &linecap, fp)) != -1)
+    {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' '))
+            line[--len] = '\0';
+        char *p = line;
+        if (len == 0 || p[0] == '#')
+            continue;
+
+        struct grepPattern pat = {NULL, 0, 0, 0};
+        if (p[0] == '!')
+        {
+            pat.negate = 1;
+            p++;
+        }
+        size_t pl = strlen(p);
+        if (pl > 0 && p[pl - 1] == '/')
+        {
+            pat.dironly = 1;
+            p[--pl] = '\0';
+        }
+        if (strchr(p, '/'))
+            pat.anchored = 1;
+        if (p[0] == '/')
+            p++;
+        if (p[0] == '\0')
+            continue;
+
+        pat.glob = strdup(p);
+        ig->patterns = realloc(ig->patterns, sizeof(struct grepPattern) * (ig->count + 1));
+        ig->patterns[ig->count++] = pat;
+    }
+    free(line);
+    fclose(fp);
+    return ig;
+}
+
+static int grepIgnored(struct grepIgnore *rules, const char *rel, const char *name, int isdir)
+{
+    // Whether an entry is ignored: rule sets apply from the root down and the last
+    // pattern that matches decides, so deeper files and later lines take precedence
+    struct grepIgnore *chain[64];
+    int depth = 0;
+    for (struct grepIgnore *r = rules; r && depth < 64; r = r->parent)
+        chain[depth++] = r;
+
+    int ignored = 0;
+    while (depth--)
+    {
+        struct grepIgnore *r = chain[depth];
+        size_t bl = strlen(r->base);
+        const char *sub = bl ? rel + bl + 1 : rel; // Entry path relative to the rules' directory
+        for (int i = 0; i < r->count; i++)
+        {
+            struct grepPattern *p = &r->patterns[i];
+            if (p->dironly && !isdir)
+                continue;
+            int hit;
+            if (p->anchored) // "**" may cross directories, so only a plain glob keeps '*' within one
+                hit = fnmatch(p->glob, sub, strstr(p->glob, "**") ? 0 : FNM_PATHNAME) == 0;
+            else
+                hit = fnmatch(p->glob, name, 0) == 0;
+            if (hit)
+                ignored = !p->negate;
+        }
+    }
+    return ignored;
+}
+
+struct walkJob
+{
+    struct grepTree *tree;
+    struct grepDir *dirs;    // Directories of the current level
+    int ndirs;
+    int nparts;
+    struct grepDir **subdirs; // Directories found by each part, for the next level
+    int *nsubdirs;
+    char ***files;            // Files found by each part
+    int *nfiles;
+    struct grepIgnore ***rules; // Rule sets read by each part
+    int *nrules;
+};
+
+static void walkPart(void *arg, int part)
+{
+    // List every nparts-th directory of the level
+    struct walkJob *job = arg;
+    int subcap = 0, filecap = 0;
+    job->subdirs[part] = NULL;
+    job->files[part] = NULL;
+    job->rules[part] = NULL;
+    job->nsubdirs[part] = job->nfiles[part] = job->nrules[part] = 0;
+
+    for (int d = part; d < job->ndirs; d += job->nparts)
+    {
+        struct grepDir *dir = &job->dirs[d];
+        struct grepIgnore *rules = grepReadIgnore(job->tree->root, dir->rel, dir->rules);
+        if (rules)
+        {
+            job->rules[part] = realloc(job->rules[part], sizeof(struct grepIgnore *) * (job->nrules[part] + 1));
+            job->rules[part][job->nrules[part]++] = rules;
+        }
+        else
+        {
+            rules = dir->rules;
+        }
+
+        char *path = grepJoin(job->tree->root, dir->rel);
+        DIR *dp = opendir(path);
+        if (!dp)
+        {
+            free(path);
+            continue;
+        }
+        struct dirent *ent;
+        while ((ent = readdir(dp)) != NULL)
+        {
+            char *name = ent->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strcmp(name, ".git") == 0)
+                continue;
+
+            int type = ent->d_type;
+            if (type == DT_UNKNOWN)
+            {
+                struct stat st;
+                if (fstatat(dirfd(dp), name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+                    continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+            }
+            if (type != DT_DIR && type != DT_REG)
+                continue; // Symlinks are skipped so the walk can't loop
+
+            char *rel = grepJoin(dir->rel, name);
+            if (grepIgnored(rules, rel, name, type == DT_DIR))
+            {
+                free(rel);
+            }
+            else if (type == DT_DIR)
+            {
+                if (job->nsubdirs[part] == subcap)
+                {
+                    subcap = subcap ? subcap * 2 : 16;
+                    job->subdirs[part] = realloc(job->subdirs[part], sizeof(struct grepDir) * subcap);
+                }
+                job->subdirs[part][job->nsubdirs[part]].rel = rel;
+                job->subdirs[part][job->nsubdirs[part]].rules = rules;
+                job->nsubdirs[part]++;
+            }
+            else
+            {
+                if (job->nfiles[part] == filecap)
+                {
+                    filecap = filecap ? filecap * 2 : 64;
+                    job->files[part] = realloc(job->files[part], sizeof(char *) * filecap);
+                }
+                job->files[part][job->nfiles[part]++] = rel;
+            }
+        }
+        closedir(dp);
+        free(path);
+    }
+}
+
+static int grepComparePath(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+void grepWalk(struct grepTree *tree, const char *root)
+{
+    // Collect the files under root that no .gitignore rules out, a directory level
+    // at a time with the directories of each level listed across the worker pool
+    tree->root = strdup(root);
+    tree->files = NULL;
+    tree->nfiles = tree->filecap = 0;
+    tree->rules = NULL;
+    tree->nrules = tree->rulecap = 0;
+
+    struct grepDir *level = malloc(sizeof(struct grepDir));
+    level[0].rel = strdup("");
+    level[0].rules = NULL;
+    int nlevel = 1;
+
+    while (nlevel > 0)
+    {
+        struct walkJob job;
+        job.tree = tree;
+        job.dirs = level;
+        job.ndirs = nlevel;
+        job.nparts = (nlevel < poolSize() * 4) ? nlevel : poolSize() * 4;
+        job.subdirs = malloc(sizeof(struct grepDir *) * job.nparts);
+        job.nsubdirs = malloc(sizeof(int) * job.nparts);
+        job.files = malloc(sizeof(char **) * job.nparts);
+        job.nfiles = malloc(sizeof(int) * job.nparts);
+        job.rules = malloc(sizeof(struct grepIgnore **) * job.nparts);
+        job.nrules = malloc(sizeof(int) * job.nparts);
+        if (job.nparts == 1)
+            walkPart(&job, 0);
+        else
+            poolRun(walkPart, &job, job.nparts);
+
+        struct grepDir *next = NULL;
+        int nnext = 0;
+        for (int p = 0; p < job.nparts; p++)
+        {
+            next = realloc(next, sizeof(struct grepDir) * (nnext + job.nsubdirs[p] + 1));
+            memcpy(&next[nnext], job.subdirs[p], sizeof(struct grepDir) * job.nsubdirs[p]);
+            nnext += job.nsubdirs[p];
+
+            if (tree->nfiles + job.nfiles[p] > tree->filecap)
+            {
+                tree->filecap = (tree->nfiles + job.nfiles[p]) * 2;
+                tree->files = realloc(tree->files, sizeof(char *) * tree->filecap);
+            }
+            memcpy(&tree->files[tree->nfiles], job.files[p], sizeof(char *) * job.nfiles[p]);
+            tree->nfiles += job.nfiles[p];
+
+            if (tree->nrules + job.nrules[p] > tree->rulecap)
+            {
+                tree->rulecap = (tree->nrules + job.nrules[p]) * 2;
+                tree->rules = realloc(tree->rules, sizeof(struct grepIgnore *) * tree->rulecap);
+            }
+            memcpy(&tree->rules[tree->nrules], job.rules[p], sizeof(struct grepIgnore *) * job.nrules[p]);
+            tree->nrules += job.nrules[p];
+
+            free(job.subdirs[p]);
+            free(job.files[p]);
+            free(job.rules[p]);
+        }
+        free(job.subdirs);
+        free(job.nsubdirs);
+        free(job.files);
+        free(job.nfiles);
+        free(job.rules);
+        free(job.nrules);
+
+        for (int d = 0; d < nlevel; d++)
+            free(level[d].rel);
+        free(level);
+        level = next;
+        nlevel = nnext;
+    }
+    free(level);
+
+    qsort(tree->files, tree->nfiles, sizeof(char *), grepComparePath);
+}
+
+void grepFreeTree(struct grepTree *tree)
+{
+    for (int i = 0; i < tree->nfiles; i++)
+        free(tree->files[i]);
+    free(tree->files);
+    for (int i = 0; i < tree->nrules; i++)
+    {
+        for (int j = 0; j < tree->rules[i]->count; j++)
+            free(tree->rules[i]->patterns[j].glob);
+        free(tree->rules[i]->patterns);
+        free(tree->rules[i]->base);
+        free(tree->rules[i]);
+    }
+    free(tree->rules);
+    free(tree->root);
+}
+
+static void grepReport(struct grepResult *res, const char *path, long line, const char *data, long ls, long le, long at)
+{
+    // Append one "path:line:col: text" result
+    while (le > ls && data[le - 1] == '\r')
+        le--;
+    int tlen = (le - ls > GREP_TEXT_MAX) ? GREP_TEXT_MAX : le - ls;
+    char head[64];
+    int hl = snprintf(head, sizeof(head), ":%ld:%ld: ", line, at - ls + 1);
+    grepAppend(res, path, strlen(path));
+    grepAppend(res, head, hl);
+    grepAppend(res, &data[ls], tlen);
+    grepAppend(res, "\n", 1);
+    res->hits++;
+}
+
+static long grepNewlines(const char *s, long len)
+{
+    long n = 0;
+    const char *end = s + len;
+    while ((s = memchr(s, '\n', end - s)) != NULL)
+    {
+        n++;
+        s++;
+    }
+    return n;
+}
+
+void grepFile(struct searchQuery *q, const char *root, const char *rel, struct grepResult *res)
+{
+    // Search one mmap'd file, reporting the first match of every matching line.
+    // Literals are searched over the whole mapping at once, a regex line by line.
+    res->out = NULL;
+    res->len = res->cap = 0;
+    res->hits = 0;
+    res->bytes = 0;
+
+    char *path = grepJoin(root, rel);
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0 || st.st_size > INT_MAX)
+    {
+        close(fd);
+        return;
+    }
+    long size = st.st_size;
+#ifdef MAP_POPULATE
+    int populate = MAP_POPULATE; // Fault the whole file in at once, it is read start to end
+#else
+    int populate = 0;
+#endif
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE | populate, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return;
+    res->bytes = size;
+
+    if (memchr(data, '\0', size < GREP_BINARY_SCAN ? size : GREP_BINARY_SCAN) == NULL)
+    {
+        const char *shown = (strcmp(root, ".") == 0) ? rel : NULL;
+        char *joined = shown ? NULL : grepJoin(root, rel);
+        if (!shown)
+            shown = joined;
+
+        long line = 1;
+        long counted = 0; // Newlines before this offset are in line
+        long pos = 0;
+        int mlen;
+        while (pos < size)
+        {
+            long at, ls, le;
+            if (q->re)
+            {
+                ls = pos;
+                const char *nl = memchr(&data[pos], '\n', size - pos);
+                le = nl ? nl - data : size;
+                at = findMatch(q, &data[ls], le - ls, 0, &mlen);
+                if (at == -1)
+                {
+                    pos = le + 1;
+                    line++;
+                    counted = pos;
+                    continue;
+                }
+                at += ls;
+            }
+            else
+            {
+                at = findMatch(q, data, size, pos, &mlen);
+                if (at == -1)
+                    break;
+                line += grepNewlines(&data[counted], at - counted);
+                counted = at;
+                const char *nl = memchr(&data[at], '\n', size - at);
+                le = nl ? nl - data : size;
+                ls = at;
+                while (ls > pos && data[ls - 1] != '\n')
+                    ls--;
+            }
+            grepReport(res, shown, line, data, ls, le, at);
+            pos = le + 1;
+            line++;
+            counted = pos;
+        }
+        free(joined);
+    }
+    munmap(data, size);
+}
@@ -0,0 +1,74 @@
+/* IMPORTS */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/* FUNCTIONS */
+
+long long monotonicNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void histInit(struct histogram *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+static int histBucket(uint64_t v)
+{
+    // Values below HIST_SUB each get a bucket, past that every power of two is split
+    // into HIST_SUB buckets, so a bucket is never wider than 1/HIST_SUB of its values
+    if (v < HIST_SUB)
+        return v;
+    int top = 63 - __builtin_clzll(v);
+    int shift = top - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((v >> shift) & (HIST_SUB - 1));
+}
+
+uint64_t histLowest(int bucket)
+{
+    // Smallest value that lands in a bucket
+    if (bucket < HIST_SUB)
+        return bucket;
+    int shift = bucket / HIST_SUB - 1;
+    return (uint64_t)(HIST_SUB + bucket % HIST_SUB) << shift;
+}
+
+void histRecord(struct histogram *h, long long v)
+{
+    if (v < 0)
+        v = 0;
+    h->counts[histBucket(v)]++;
+    if (h->count == 0 || v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+    h->count++;
+    h->sum += v;
+}
+
+long long histPercentile(const struct histogram *h, double p)
+{
+    // Value at or below which p percent of the recorded ones fall, to within a bucket.
+    // The top bucket reports the largest value recorded instead of its bound.
+    if (h->count == 0)
+        return 0;
+    uint64_t want = (uint64_t)(p / 100 * h->count + 0.5);
+    if (want < 1)
+        want = 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+    {
+        seen += h->counts[b];
+        if (seen >= want)
+        {
+            long long hi = (b + 1 < HIST_BUCKETS) ? (long long)histLowest(b + 1) - 1 : h->max;
+            return hi < h->max ? hi : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,438 @@
+/* IMPORTS */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/* DATA */
+
+#define JOURNAL_MAGIC "QTJRNL2" // First bytes of every journal, with the NUL
+
+struct journalHeader
+{
+    char magic[8];
+    int64_t size;  // File the records apply to, as docStat saw it
+    int64_t mtime; // Nanoseconds, see statMtime
+    int64_t ino;
+};
+
+struct journalRecord
+{
+    uint64_t len;  // Bytes of text after the record
+    int32_t row, col;
+    uint32_t type; // UNDO_INSERT, UNDO_DELETE or JOURNAL_TEXT
+    uint32_t sum;  // Of the record with sum 0 and its text, fails on a torn write
+};
+
+/* FUNCTIONS */
+
+static uint32_t journalSum(uint32_t h, const void *p, long len)
+{
+    // FNV-1a, going on from h
+    const unsigned char *s = p;
+    for (long i = 0; i < len; i++)
+        h = (h ^ s[i]) * 16777619u;
+    return h;
+}
+
+int journalPending(const char *filename)
+{
+    // Whether a file has a journal with records in it, left by a session that ended
+    // without saving them
+    char *path = sidecarPath(filename, JOURNAL_SUFFIX);
+    struct stat st;
+    int pending = stat(path, &st) == 0 && st.st_size > (off_t)sizeof(struct journalHeader);
+    free(path);
+    return pending;
+}
+
+void journalInit(struct journal *j)
+{
+    j->fd = -1;
+    j->path = NULL;
+    j->buf = NULL;
+    j->len = 0;
+    j->cap = 0;
+    j->queued = 0;
+    j->spare = NULL;
+    j->sparecap = 0;
+    j->size = 0;
+    j->compact_at = JOURNAL_COMPACT;
+    j->base_size = j->base_mtime = j->base_ino = -1;
+    j->fresh = 1;
+    j->rewrite = 0;
+    j->closing = 0;
+    j->error = 0;
+    j->commits = 0;
+    j->records = 0;
+}
+
+static void journalQueue(struct journal *j, const void *s, long len)
+{
+    // Add bytes for the writer, the lock is held
+    if (j->len + len > j->cap)
+    {
+        j->cap = (j->len + len) * 2;
+        j->buf = realloc(j->buf, j->cap);
+    }
+    memcpy(&j->buf[j->len], s, len);
+    j->len += len;
+    j->size += len;
+}
+
+static void journalQueueRecord(struct journal *j, int type, int row, int col, const char *s, long len, int eol)
+{
+    // Add a record of s (plus a newline if eol), after the header if it is the first
+    if (j->fresh)
+    {
+        struct journalHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, JOURNAL_MAGIC, sizeof(h.magic));
+        h.size = j->base_size;
+        h.mtime = j->base_mtime;
+        h.ino = j->base_ino;
+        journalQueue(j, &h, sizeof(h));
+        j->fresh = 0;
+    }
+    struct journalRecord rec = {len + eol, row, col, type, 0};
+    uint32_t sum = journalSum(journalSum(2166136261u, &rec, sizeof(rec)), s, len);
+    rec.sum = eol ? journalSum(sum, "\n", 1) : sum;
+    journalQueue(j, &rec, sizeof(rec));
+    journalQueue(j, s, len);
+    if (eol)
+        journalQueue(j, "\n", 1);
+    j->queued++;
+}
+
+void journalAppend(struct journal *j, int type, int row, int col, const char *s, long len, int eol)
+{
+    // Queue an op for the writer, it reaches the disk with the rest of its batch. The
+    // writer is only woken by the first op of a batch.
+    pthread_mutex_lock(&j->lock);
+    int idle = j->len == 0 && !j->rewrite;
+    journalQueueRecord(j, type, row, col, s, len, eol);
+    pthread_mutex_unlock(&j->lock);
+    if (idle)
+        pthread_cond_signal(&j->wake);
+}
+
+static int journalWrite(int fd, const char *s, long len)
+{
+    // Write and sync a batch, returns 0 or the errno of what failed
+    long done = 0;
+    while (done < len)
+    {
+        ssize_t w = write(fd, &s[done], len - done);
+        if (w == -1 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return w == -1 ? errno : EIO;
+        done += w;
+    }
+#ifdef __APPLE__
+    return fsync(fd) == -1 ? errno : 0;
+#else
+    return fdatasync(fd) == -1 ? errno : 0;
+#endif
+}
+
+static int journalReplace(struct journal *j, const char *s, long len)
+{
+    // Swap in a journal holding only s. It is written aside and renamed over the old
+    // one, so a crash part way leaves one or the other whole. Empty has nothing to
+    // recover and is just truncated.
+    if (len == 0)
+        return ftruncate(j->fd, 0) == -1 ? errno : 0;
+    char *tmp = malloc(strlen(j->path) + 5);
+    sprintf(tmp, "%s.new", j->path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    int err = (fd == -1) ? errno : journalWrite(fd, s, len);
+    if (!err && rename(tmp, j->path) == -1)
+        err = errno;
+    if (err && fd != -1)
+    {
+        close(fd);
+        unlink(tmp);
+    }
+    else if (!err)
+    {
+        close(j->fd);
+        j->fd = fd;
+    }
+    free(tmp);
+    return err;
+}
+
+static void *journalWriter(void *arg)
+{
+    // Write what is queued a batch at a time, waiting JOURNAL_BATCH_MS after the first
+    // op so the rest of a burst of typing joins it and the batch is synced once. Edits
+    // never wait for the disk, only the last batch is lost to a crash.
+    struct journal *j = arg;
+    pthread_mutex_lock(&j->lock);
+    while (1)
+    {
+        while (!j->len && !j->rewrite && !j->closing)
+            pthread_cond_wait(&j->wake, &j->lock);
+        if (!j->len && !j->rewrite)
+            break; // Closing with nothing left to write
+        if (!j->closing)
+        {
+            pthread_mutex_unlock(&j->lock);
+            struct timespec delay = {0, JOURNAL_BATCH_MS * 1000000L};
+            nanosleep(&delay, NULL);
+            pthread_mutex_lock(&j->lock);
+        }
+
+        // Take the batch, new ops go to the other buffer meanwhile
+        char *out = j->buf;
+        long outcap = j->cap;
+        long len = j->len;
+        long records = j->queued;
+        int rewrite = j->rewrite;
+        j->buf = j->spare;
+        j->cap = j->sparecap;
+        j->spare = out;
+        j->sparecap = outcap;
+        j->len = 0;
+        j->queued = 0;
+        j->rewrite = 0;
+        pthread_mutex_unlock(&j->lock);
+
+        int err = rewrite ? journalReplace(j, out, len) : journalWrite(j->fd, out, len);
+
+        pthread_mutex_lock(&j->lock);
+        if (err)
+        {
+            j->error = err;
+        }
+        else
+        {
+            j->commits++;
+            j->records += records;
+        }
+    }
+    pthread_mutex_unlock(&j->lock);
+    return NULL;
+}
+
+static void journalSnapshot(struct document *doc)
+{
+    // Queue a journal of just the whole text to replace the one on disk
+    struct journal *j = &doc->journal;
+    int len;
+    char *text = rowsToString(doc, &len);
+    pthread_mutex_lock(&j->lock);
+    j->len = 0;
+    j->queued = 0;
+    j->size = 0;
+    j->fresh = 1;
+    journalQueueRecord(j, JOURNAL_TEXT, 0, 0, text, len, 0);
+    j->rewrite = 1;
+    pthread_mutex_unlock(&j->lock);
+    pthread_cond_signal(&j->wake);
+    free(text);
+    j->compact_at = (j->size * 2 > JOURNAL_COMPACT) ? j->size * 2 : JOURNAL_COMPACT;
+}
+
+int docRecover(struct document *doc)
+{
+    // Replay the journal a session that ended without saving left for the document's
+    // file, as one undo group. A record cut short by the crash ends the replay, the
+    // journal is replaced by docJournal. Returns how many records were replayed, or -1
+    // with errno set, ESTALE if the journal is of another version of the file.
+    char *path = sidecarPath(doc->filename, JOURNAL_SUFFIX);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    long long size = st.st_size;
+    if (size < (long long)sizeof(struct journalHeader))
+    {
+        close(fd);
+        return 0;
+    }
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+
+    struct journalHeader h;
+    memcpy(&h, data, sizeof(h));
+    if (memcmp(h.magic, JOURNAL_MAGIC, sizeof(h.magic)) != 0 || h.size != doc->disk_size ||
+        h.mtime != doc->disk_mtime || h.ino != doc->disk_ino)
+    {
+        munmap(data, size);
+        close(fd);
+        errno = ESTALE;
+        return -1;
+    }
+
+    int ops = 0;
+    long long pos = sizeof(h);
+    undoSeal(&doc->undo);
+    undoStartGroup(&doc->undo, 0, 0);
+    while (pos + (long long)sizeof(struct journalRecord) <= size)
+    {
+        struct journalRecord rec;
+        memcpy(&rec, &data[pos], sizeof(rec));
+        const char *text = &data[pos + sizeof(rec)];
+        if (rec.len > (uint64_t)(size - pos - sizeof(rec)))
+            break;
+        uint32_t sum = rec.sum;
+        rec.sum = 0;
+        if (journalSum(journalSum(2166136261u, &rec, sizeof(rec)), text, rec.len) != sum)
+            break;
+
+        if (rec.type == JOURNAL_TEXT)
+        {
+            deleteRange(doc, 0, 0, doc->numrows, 0);
+            insertText(doc, 0, 0, text, rec.len);
+        }
+        else if (rec.type == UNDO_INSERT)
+        {
+            insertText(doc, rec.row, rec.col, text, rec.len);
+        }
+        else
+        {
+            int end_row, end_col;
+            textEnd(rec.row, rec.col, text, rec.len, &end_row, &end_col);
+            deleteRange(doc, rec.row, rec.col, end_row, end_col);
+        }
+        ops++;
+        pos += sizeof(rec) + rec.len;
+    }
+    undoSeal(&doc->undo);
+
+    munmap(data, size);
+    close(fd);
+    return ops;
+}
+
+int docJournal(struct document *doc)
+{
+    // Start writing every edit of a file's document to its journal, returns -1 (with
+    // errno set) if the journal can't be kept. A clean document starts it empty, a
+    // dirty one (just recovered, say) with a copy of its text.
+    struct journal *j = &doc->journal;
+    if (!doc->filename || j->fd != -1)
+        return 0;
+    j->path = sidecarPath(doc->filename, JOURNAL_SUFFIX);
+    j->fd = open(j->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (j->fd == -1 || (!doc->dirty && ftruncate(j->fd, 0) == -1))
+    {
+        int err = errno;
+        if (j->fd != -1)
+            close(j->fd);
+        free(j->path);
+        journalInit(j);
+        errno = err;
+        return -1;
+    }
+    j->base_size = doc->disk_size;
+    j->base_mtime = doc->disk_mtime;
+    j->base_ino = doc->disk_ino;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->wake, NULL);
+    int err = pthread_create(&j->writer, NULL, journalWriter, j);
+    if (err)
+    {
+        close(j->fd);
+        free(j->path);
+        journalInit(j);
+        errno = err;
+        return -1;
+    }
+    doc->undo.journal = j;
+    if (doc->dirty)
+        journalSnapshot(doc);
+    return 0;
+}
+
+void docJournalReset(struct document *doc)
+{
+    // Empty the journal once the file holds the text, after a save or a reload. Ops
+    // from now on apply to the file as it is now.
+    struct journal *j = doc->undo.journal;
+    if (!j)
+        return;
+    pthread_mutex_lock(&j->lock);
+    j->base_size = doc->disk_size;
+    j->base_mtime = doc->disk_mtime;
+    j->base_ino = doc->disk_ino;
+    j->fresh = 1;
+    j->len = 0;
+    j->queued = 0;
+    int written = j->size > 0;
+    j->size = 0;
+    j->compact_at = JOURNAL_COMPACT;
+    j->rewrite |= written; // Lines followed into a clean document change nothing on disk
+    pthread_mutex_unlock(&j->lock);
+    if (written)
+        pthread_cond_signal(&j->wake);
+}
+
+int docJournalCompact(struct document *doc)
+{
+    // Replace the journal with a copy of the text once it has grown to twice that (and
+    // past JOURNAL_COMPACT), so replaying it never reads much more than the file.
+    // Returns 1 if it was compacted.
+    struct journal *j = doc->undo.journal;
+    if (!j || j->size < j->compact_at)
+        return 0;
+    long long text = 0;
+    for (int r = 0; r < doc->numrows; r++)
+        text += doc->row[r].size + 1;
+    if (j->size < text * 2)
+    {
+        j->compact_at = text * 2; // Not rows rescanned on every check
+        return 0;
+    }
+    journalSnapshot(doc);
+    return 1;
+}
+
+void docJournalClose(struct document *doc, int keep)
+{
+    // Stop journaling. A kept journal gets what is queued written first, otherwise it
+    // is removed.
+    struct journal *j = &doc->journal;
+    if (j->fd == -1)
+        return;
+    doc->undo.journal = NULL;
+    pthread_mutex_lock(&j->lock);
+    if (!keep)
+    {
+        j->len = 0;
+        j->rewrite = 0;
+    }
+    j->closing = 1;
+    pthread_mutex_unlock(&j->lock);
+    pthread_cond_signal(&j->wake);
+    pthread_join(j->writer, NULL);
+    pthread_mutex_destroy(&j->lock);
+    pthread_cond_destroy(&j->wake);
+    close(j->fd);
+    if (!keep)
+        unlink(j->path);
+    free(j->path);
+    free(j->buf);
+    free(j->spare);
+    journalInit(j);
+}
@@ -0,0 +1,125 @@
+/* IMPORTS */
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#endif
+
+/* FUNCTIONS */
+
+static size_t heapSize(const void *p, size_t used)
+{
+    // Bytes the allocator set aside for p, used when it can't tell
+    if (p == NULL)
+        return 0;
+#if defined(__GLIBC__)
+    (void)used;
+    return malloc_usable_size((void *)p);
+#elif defined(__APPLE__)
+    (void)used;
+    return malloc_size(p);
+#else
+    return used;
+#endif
+}
+
+static size_t heapChunk(size_t n)
+{
+    // What asking for n bytes takes: glibc rounds a request and its size header up to
+    // 16 bytes, 32 at least
+    size_t chunk = (n + sizeof(size_t) + 15) & ~(size_t)15;
+    return chunk < 32 ? 32 : chunk;
+}
+
+static void heapCount(struct memUsage *m, size_t *field, const void *p, size_t used)
+{
+    // Add an allocation to its structure, what it holds past used to slack
+    if (p == NULL)
+        return;
+    size_t size = heapSize(p, used);
+    *field += used;
+    m->slack += size > used ? size - used : 0;
+    m->headers += sizeof(size_t);
+}
+
+void docMemory(struct document *doc, struct memUsage *m)
+{
+    // Add up the heap a document's rows and the structures kept beside them take
+    memset(m, 0, sizeof(*m));
+    m->rows = doc->numrows;
+    for (int i = 0; i < doc->numrows; i++)
+    {
+        erow *row = &doc->row[i];
+        heapCount(m, &m->chars, row->chars, row->size + 1);
+        heapCount(m, &m->render, row->render, row->rsize + 1);
+        heapCount(m, &m->hl, row->hl, sizeof(hlrun) * row->hlsize);
+    }
+    m->row_array = sizeof(erow) * doc->numrows;
+    size_t array = heapSize(doc->row, m->row_array);
+    m->row_slack = array > m->row_array ? array - m->row_array : 0;
+    m->headers += doc->row ? sizeof(size_t) : 0;
+
+    m->undo = undoMemory(&doc->undo);
+    m->trigrams = trigramMemory(&doc->trigrams);
+    m->search = sizeof(struct searchMatch) * doc->matches.cap;
+    for (int i = 0; i < doc->search.depth; i++)
+        m->search += sizeof(struct searchMatch) * doc->search.levels[i].count;
+    m->total = m->chars + m->render + m->hl + m->row_array + m->row_slack + m->slack + m->headers + m->undo +
+               m->trigrams + m->search;
+}
+
+long long fileMemory(const char *filename, int highlighted, long *lines)
+{
+    // Heap the rows of a file would take once opened, from its line lengths and tabs,
+    // without reading it into rows. Highlighted rows are reckoned one run per
+    // MEM_HL_BYTES of text. Returns -1 if the file can't be read.
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return -1;
+    }
+    long size = st.st_size;
+    char *data = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (data == MAP_FAILED)
+        return -1;
+
+    long long total = 0;
+    long n = 0;
+    long pos = 0;
+    while (pos < size)
+    {
+        const char *nl = memchr(&data[pos], '\n', size - pos);
+        long end = nl ? nl - data : size;
+        long len = end;
+        while (len > pos && data[len - 1] == '\r')
+            len--;
+        len -= pos;
+        long tabs = 0;
+        for (const char *p = &data[pos]; (p = memchr(p, '\t', &data[pos + len] - p)) != NULL; p++)
+            tabs++;
+
+        total += sizeof(erow) + heapChunk(len + 1) + heapChunk(len + tabs * (TAB_STOP - 1) + 1);
+        long runs = highlighted ? (len + tabs * (TAB_STOP - 1)) / MEM_HL_BYTES : 0;
+        if (runs)
+            total += heapChunk(sizeof(hlrun) * runs);
+        n++;
+        pos = end + 1;
+    }
+    if (data)
+        munmap(data, size);
+    if (lines)
+        *lines = n;
+    return total;
+}
@@ -0,0 +1,99 @@
+/* IMPORTS */
+
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+/* DATA */
+
+struct workerPool
+{
+    pthread_t *threads;
+    int nthreads;             // Number of workers, 0 until the pool is started
+    pthread_mutex_t lock;
+    pthread_cond_t work;      // Signalled when a job is posted
+    pthread_cond_t done;      // Signalled when the last part of a job finishes
+    void (*fn)(void *, int);  // Job being run
+    void *arg;
+    int nparts;               // Parts in the current job
+    int next;                 // Next part to hand out
+    int finished;             // Parts completed so far
+};
+
+static struct workerPool pool = {NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                                 PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0, 0};
+
+/* FUNCTIONS */
+
+static void *poolWorker(void *unused)
+{
+    // Take parts of the current job until the pool is torn down with the process
+    (void)unused;
+    pthread_mutex_lock(&pool.lock);
+    while (1)
+    {
+        while (pool.next >= pool.nparts)
+            pthread_cond_wait(&pool.work, &pool.lock);
+
+        int part = pool.next++;
+        void (*fn)(void *, int) = pool.fn;
+        void *arg = pool.arg;
+        pthread_mutex_unlock(&pool.lock);
+
+        fn(arg, part);
+
+        pthread_mutex_lock(&pool.lock);
+        if (++pool.finished == pool.nparts)
+            pthread_cond_signal(&pool.done);
+    }
+    return NULL;
+}
+
+int poolSize(void)
+{
+    // Start the workers on first use, one per online CPU
+    if (pool.nthreads)
+        return pool.nthreads;
+
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+        n = 1;
+    if (n > 64)
+        n = 64;
+    pool.threads = malloc(sizeof(pthread_t) * n);
+    for (long i = 0; i < n; i++)
+    {
+        if (pthread_create(&pool.threads[pool.nthreads], NULL, poolWorker, NULL) != 0)
+            break;
+        pthread_detach(pool.threads[pool.nthreads]);
+        pool.nthreads++;
+    }
+    return pool.nthreads;
+}
+
+void poolRun(void (*fn)(void *, int), void *arg, int nparts)
+{
+    // Run fn(arg, part) for every part on the workers and wait for all of them.
+    // Falls back to running the parts in order if no worker could be started.
+    if (nparts <= 0)
+        return;
+    if (poolSize() == 0)
+    {
+        for (int i = 0; i < nparts; i++)
+            fn(arg, i);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.fn = fn;
+    pool.arg = arg;
+    pool.finished = 0;
+    pool.next = 0;
+    pool.nparts = nparts;
+    pthread_cond_broadcast(&pool.work);
+    while (pool.finished < pool.nparts)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pool.nparts = 0;
+    pool.next = 0;
+    pthread_mutex_unlock(&pool.lock);
+}
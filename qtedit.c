@@ -1,5 +1,7 @@
 /* IMPORTS */
 
+#define _DEFAULT_SOURCE
+
 #include <unistd.h>
 #include <ctype.h>
 #include <stdio.h>
@@ -7,7 +9,7 @@
 #include <stdlib.h>
 #include <termios.h>
 
-#include "core.c"
+#include "term.c"
 
 /* DATA */
 
@@ -20,24 +22,57 @@ void init(void)
     E.cx = 0;
     E.rx = 0;
     E.cy = 0;
-    E.numrows = 0;
     E.rowoff = 0;
     E.coloff = 0;
-    E.row = NULL;
-    E.dirty = 0;
-    E.filename = NULL;
     E.status[0] = '\0';
     E.statustime = 0;
-    E.syntax = NULL;
+    E.search_flags = 0;
+    E.kills.head = 0;
+    E.kills.count = 0;
+    E.kills.back = 0;
+    E.kills.pasted = 0;
+    E.cursors = NULL;
+    E.ncursors = 0;
+    E.cursorcap = 0;
+    E.macro.keys = NULL;
+    E.macro.len = 0;
+    E.macro.cap = 0;
+    E.macro.recording = 0;
+    E.macro.playing = 0;
     E.sel_active = 0;
     E.sel_start_cx = 0;
     E.sel_start_cy = 0;
     E.sel_end_cx = 0;
     E.sel_end_cy = 0;
+    E.doc = NULL;
+    E.buffers = NULL;
+    E.nbuffers = 0;
+    E.current = E.last = 0;
+    E.windows = calloc(1, sizeof(struct window)); // Sized below
+    E.nwindows = 1;
+    E.active = 0;
+    E.termrows = E.termcols = 0;
+    E.watchfd = -1;
+    for (int i = 0; i < PROFILE_STAGES; i++)
+        histInit(&E.profile.stages[i]);
+    E.profile.overlay = 0;
+    E.profile.pending = 0;
+    E.profile.hl_ns = 0; // The dump file is set before, from the options
+    newBuffer();
 
-    if (getWindowSize(&E.screenrows, &E.screencols) == -1)
+    if (E.headless)
+    {
+        // Scripts never draw, the size only matters to cursor movement
+        resizeWindows(25, 80);
+        return;
+    }
+    int rows, cols;
+    if (getWindowSize(&rows, &cols) == -1)
         die("getWindowSize");
-    E.screenrows -= 2;
+#ifdef __linux__
+    E.watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC); // Files changed by other programs, see checkFiles
+#endif
+    resizeWindows(rows - 1, cols); // The status line is below the windows
 
     resetScreen();
 }
@@ -46,8 +81,14 @@ void init(void)
 
 int main(int argc, char *argv[])
 {
+    E.undo_limit = UNDO_LIMIT * 1048576L;
+    E.mem_budget = MEM_BUDGET * 1048576L;
     if (argc >= 2)
     {
+        char *script = NULL;
+        int follow = 0;
+        char **files = malloc(sizeof(char *) * argc);
+        int nfiles = 0;
         for (int i = 1; i < argc; i++)
         {
             char *arg = argv[i];
@@ -55,11 +96,71 @@ int main(int argc, char *argv[])
             {
                 if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0)
                 {
-                    fprintf(stderr, "Usage: %s [options] <filename>\n", argv[0]);
+                    fprintf(stderr, "Usage: %s [options] [filename...]\n", argv[0]);
                     fprintf(stderr, "Options:\n");
                     fprintf(stderr, "  -h, --help       Show this help message\n");
+                    fprintf(stderr, "  -i, --index      Keep a trigram index of the file for faster find\n");
+                    fprintf(stderr, "  -f, --follow     Show lines appended to the files as they are written, like tail -f\n");
+                    fprintf(stderr, "  -u, --undo-limit <MB>\n");
+                    fprintf(stderr, "                   Memory kept for undo history (default %d)\n", UNDO_LIMIT);
+                    fprintf(stderr, "  -m, --memory-budget <MB>\n");
+                    fprintf(stderr, "                   Ask before opening a file that would take more (default %d, 0 for no limit)\n", MEM_BUDGET);
+                    fprintf(stderr, "  --copy-cmd <cmd> Also pipe copies to cmd (e.g. pbcopy) instead of the terminal clipboard\n");
+                    fprintf(stderr, "  --paste-cmd <cmd>\n");
+                    fprintf(stderr, "                   Paste what cmd prints (e.g. pbpaste) instead of the last copy\n");
+                    fprintf(stderr, "  -p, --profile <file>\n");
+                    fprintf(stderr, "                   Write keypress to paint latency percentiles to file on exit\n");
+                    fprintf(stderr, "  -s, --script <file>\n");
+                    fprintf(stderr, "                   Run the commands in file (- for stdin) on each file without a terminal:\n");
+                    fprintf(stderr, "                   goto, find, mode, replace, insert, delete-line, save, print, memory\n");
                     exit(0);
                 }
+                else if (strcmp(arg, "-i") == 0 || strcmp(arg, "--index") == 0)
+                {
+                    E.indexing = 1;
+                }
+                else if (strcmp(arg, "-f") == 0 || strcmp(arg, "--follow") == 0)
+                {
+                    follow = 1;
+                }
+                else if ((strcmp(arg, "-u") == 0 || strcmp(arg, "--undo-limit") == 0) && i + 1 < argc)
+                {
+                    long undo_limit = atol(argv[++i]);
+                    E.undo_limit = undo_limit * 1048576L;
+                    if (undo_limit <= 0)
+                    {
+                        fprintf(stderr, "Invalid undo limit: %s\n", argv[i]);
+                        exit(1);
+                    }
+                }
+                else if ((strcmp(arg, "-m") == 0 || strcmp(arg, "--memory-budget") == 0) && i + 1 < argc)
+                {
+                    long budget = atol(argv[++i]);
+                    E.mem_budget = budget * 1048576L;
+                    if (budget < 0 || (budget == 0 && strcmp(argv[i], "0") != 0))
+                    {
+                        fprintf(stderr, "Invalid memory budget: %s\n", argv[i]);
+                        exit(1);
+                    }
+                }
+                else if ((strcmp(arg, "-s") == 0 || strcmp(arg, "--script") == 0) && i + 1 < argc)
+                {
+                    script = argv[++i];
+                    E.headless = 1;
+                }
+                else if ((strcmp(arg, "-p") == 0 || strcmp(arg, "--profile") == 0) && i + 1 < argc)
+                {
+                    E.profile.dump = argv[++i];
+                    atexit(dumpProfile);
+                }
+                else if (strcmp(arg, "--copy-cmd") == 0 && i + 1 < argc)
+                {
+                    E.copy_cmd = argv[++i];
+                }
+                else if (strcmp(arg, "--paste-cmd") == 0 && i + 1 < argc)
+                {
+                    E.paste_cmd = argv[++i];
+                }
                 else
                 {
                     fprintf(stderr, "Unknown option: %s\n", arg);
@@ -67,11 +168,27 @@ int main(int argc, char *argv[])
                     exit(1);
                 }
             }
+            else
+            {
+                files[nfiles++] = arg;
+            }
         }
         init();
+        if (script)
+            return runScript(script, files, nfiles);
         enableRawMode();
 
-        eopen(argv[argc - 1]);
+        // Every file gets its own buffer, the first one is shown
+        for (int f = 0; f < nfiles; f++)
+        {
+            if (openBuffer(files[f]) == -1)
+                die(files[f]);
+            if (follow)
+                toggleFollow();
+        }
+        if (nfiles > 0)
+            switchBuffer(0);
+        free(files);
     }
     else
     {
@@ -79,7 +196,8 @@ int main(int argc, char *argv[])
         enableRawMode();
     }
 
-    setStatusMessage(GUIDE_TEXT);
+    if (E.status[0] == '\0')
+        setStatusMessage(GUIDE_TEXT); // Unless opening the files had something to say
 
     while (1)
     {
@@ -0,0 +1,834 @@
+/* IMPORTS */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/* MACROS */
+
+#define RX_MAX_STATES 2048 // DFA states cached per scan direction before the cache is flushed
+#define RX_HASH_SIZE 4096  // Buckets of the DFA state table, kept above RX_MAX_STATES
+#define RX_MAX_PREFIX 64   // Longest literal prefix handed to the substring prefilter
+#define RX_UNKNOWN -2      // Transition that has not been computed yet
+#define RX_DEAD -1         // Transition into the empty set
+
+enum rxNodeType // Parsed pattern nodes
+{
+    RN_EMPTY = 0,
+    RN_SET,
+    RN_CAT,
+    RN_ALT,
+    RN_STAR,
+    RN_PLUS,
+    RN_QUEST,
+    RN_BOL, // ^, only true at the start of the text
+    RN_EOL  // $, only true at its end
+};
+
+enum rxOp // Program instructions
+{
+    RX_BYTE = 0, // Consume one byte in set, continue at x
+    RX_SPLIT,    // Continue at both x and y
+    RX_JMP,      // Continue at x
+    RX_BEGIN,    // Continue at x if the scan is at the edge of the text it started from
+    RX_END,      // Continue at x once the scan reaches the other edge
+    RX_MATCH
+};
+
+/* STRUCTS */
+
+struct rxNode
+{
+    int type;
+    int left, right;       // Children, -1 if unused
+    unsigned char set[32]; // Bytes an RN_SET node accepts
+};
+
+struct rxInst
+{
+    int op;
+    int x, y;
+    unsigned char set[32];
+};
+
+struct rxProg
+{
+    struct rxInst *inst;
+    int n;
+};
+
+struct rxDState
+{
+    int *set;       // Sorted program positions of the RX_BYTE, RX_END and RX_MATCH threads
+    int nset;
+    int accept;     // Whether a thread has reached RX_MATCH
+    int accept_end; // or would, if the text ended here
+    int next[256];  // Target state per byte, RX_UNKNOWN until first taken
+};
+
+struct rxDFA
+{
+    struct rxProg *prog;
+    int floating;             // Start a new thread at every byte (unanchored scan)
+    int *start_set;           // Closure of the program start, away from the edge of the text
+    int nstart;
+    struct rxDState *states;
+    int nstates;
+    int table[RX_HASH_SIZE];  // State ids + 1 by set hash, 0 for an empty bucket
+    int start;                // Start state id, -1 when it must be rebuilt
+    int start_edge;           // and for a scan starting at the edge of the text
+    int flushes;              // Times the cache was flushed
+    int *mark;                // Closure scratch, one generation stamp per instruction
+    int gen;
+    int *stack;
+    int *buf;
+};
+
+struct regex
+{
+    struct rxProg fwd;         // Pattern as written
+    struct rxProg rev;         // Pattern with every concatenation reversed
+    struct rxDFA scan;         // Forward, unanchored: finds how far the matches starting first reach
+    struct rxDFA back;         // Reverse, unanchored from there: finds the leftmost start
+    struct rxDFA longest;      // Forward, anchored at the start: finds the longest end
+    int bol;                   // Every match has to start at the start of the text
+    struct searchQuery prefix; // Literal every match starts with, len 0 if none
+    int shared;                // Programs and prefix belong to another regex
+};
+
+struct rxParser
+{
+    const char *p;
+    int icase;
+    struct rxNode *nodes;
+    int n, cap;
+    const char *error;
+};
+
+/* PARSER */
+
+static int rxNode(struct rxParser *ps, int type, int left, int right)
+{
+    if (ps->n == ps->cap)
+    {
+        ps->cap = ps->cap ? ps->cap * 2 : 32;
+        ps->nodes = realloc(ps->nodes, sizeof(struct rxNode) * ps->cap);
+    }
+    struct rxNode *nd = &ps->nodes[ps->n];
+    nd->type = type;
+    nd->left = left;
+    nd->right = right;
+    memset(nd->set, 0, sizeof(nd->set));
+    return ps->n++;
+}
+
+static void rxSetAdd(unsigned char *set, int c)
+{
+    set[c >> 3] |= 1 << (c & 7);
+}
+
+static int rxSetHas(const unsigned char *set, int c)
+{
+    return set[c >> 3] & (1 << (c & 7));
+}
+
+static void rxSetFold(unsigned char *set)
+{
+    // Make a byte set accept both cases of every letter it accepts
+    for (int c = 'a'; c <= 'z'; c++)
+    {
+        if (rxSetHas(set, c) || rxSetHas(set, toupper(c)))
+        {
+            rxSetAdd(set, c);
+            rxSetAdd(set, toupper(c));
+        }
+    }
+}
+
+static int rxClassEscape(unsigned char *set, int c)
+{
+    // Add a \d, \w or \s style class (or its negation) to a set, 0 if c is not one
+    int lower = tolower(c);
+    if (lower != 'd' && lower != 'w' && lower != 's')
+        return 0;
+    for (int b = 0; b < 256; b++)
+    {
+        int in = (lower == 'd') ? isdigit(b) : (lower == 'w') ? (isalnum(b) || b == '_') : isspace(b);
+        if (b >= 128)
+            in = 0;
+        if (isupper(c))
+            in = !in;
+        if (in)
+            rxSetAdd(set, b);
+    }
+    return 1;
+}
+
+static int rxParseAlt(struct rxParser *ps);
+
+static int rxParseClass(struct rxParser *ps)
+{
+    // Parse the inside of [...], the opening bracket already consumed
+    int id = rxNode(ps, RN_SET, -1, -1);
+    unsigned char set[32];
+    memset(set, 0, sizeof(set));
+
+    int negate = 0;
+    if (*ps->p == '^')
+    {
+        negate = 1;
+        ps->p++;
+    }
+
+    int first = 1;
+    while (*ps->p && (*ps->p != ']' || first))
+    {
+        first = 0;
+        int lo = (unsigned char)*ps->p++;
+        if (lo == '\\')
+        {
+            if (!*ps->p)
+                break;
+            lo = (unsigned char)*ps->p++;
+            if (rxClassEscape(set, lo))
+                continue;
+        }
+
+        int hi = lo;
+        if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']')
+        {
+            ps->p++;
+            hi = (unsigned char)*ps->p++;
+            if (hi == '\\' && *ps->p)
+                hi = (unsigned char)*ps->p++;
+            if (hi < lo)
+            {
+                ps->error = "bad range";
+                return -1;
+            }
+        }
+        for (int c = lo; c <= hi; c++)
+            rxSetAdd(set, c);
+    }
+    if (*ps->p != ']')
+    {
+        ps->error = "missing ]";
+        return -1;
+    }
+    ps->p++;
+
+    if (ps->icase)
+        rxSetFold(set);
+    if (negate)
+        for (int i = 0; i < 32; i++)
+            set[i] = ~set[i];
+    memcpy(ps->nodes[id].set, set, sizeof(set));
+    return id;
+}
+
+static int rxParseAtom(struct rxParser *ps)
+{
+    char c = *ps->p;
+    if (c == '(')
+    {
+        ps->p++;
+        int id = rxParseAlt(ps);
+        if (id < 0)
+            return -1;
+        if (*ps->p != ')')
+        {
+            ps->error = "missing )";
+            return -1;
+        }
+        ps->p++;
+        return id;
+    }
+    if (c == '[')
+    {
+        ps->p++;
+        return rxParseClass(ps);
+    }
+    if (c == '*' || c == '+' || c == '?')
+    {
+        ps->error = "nothing to repeat";
+        return -1;
+    }
+    if (c == '^' || c == '$')
+    {
+        ps->p++;
+        return rxNode(ps, (c == '^') ? RN_BOL : RN_EOL, -1, -1);
+    }
+
+    int id = rxNode(ps, RN_SET, -1, -1);
+    unsigned char *set = ps->nodes[id].set;
+    ps->p++;
+    if (c == '.')
+    {
+        memset(set, 0xff, 32);
+        return id;
+    }
+    if (c == '\\')
+    {
+        if (!*ps->p)
+        {
+            ps->error = "trailing \\";
+            return -1;
+        }
+        c = *ps->p++;
+        if (rxClassEscape(set, (unsigned char)c))
+            return id;
+        if (c == 't')
+            c = '\t';
+    }
+    rxSetAdd(set, (unsigned char)c);
+    if (ps->icase)
+        rxSetFold(set);
+    return id;
+}
+
+static int rxParseRepeat(struct rxParser *ps)
+{
+    int id = rxParseAtom(ps);
+    while (id >= 0 && (*ps->p == '*' || *ps->p == '+' || *ps->p == '?'))
+    {
+        int type = (*ps->p == '*') ? RN_STAR : (*ps->p == '+') ? RN_PLUS : RN_QUEST;
+        ps->p++;
+        id = rxNode(ps, type, id, -1);
+    }
+    return id;
+}
+
+static int rxParseCat(struct rxParser *ps)
+{
+    int id = rxNode(ps, RN_EMPTY, -1, -1);
+    while (*ps->p && *ps->p != '|' && *ps->p != ')')
+    {
+        int next = rxParseRepeat(ps);
+        if (next < 0)
+            return -1;
+        id = rxNode(ps, RN_CAT, id, next);
+    }
+    return id;
+}
+
+static int rxParseAlt(struct rxParser *ps)
+{
+    int id = rxParseCat(ps);
+    while (id >= 0 && *ps->p == '|')
+    {
+        ps->p++;
+        int right = rxParseCat(ps);
+        if (right < 0)
+            return -1;
+        id = rxNode(ps, RN_ALT, id, right);
+    }
+    return id;
+}
+
+/* COMPILER */
+
+static int rxEmit(struct rxProg *pg, int op, int x, int y)
+{
+    struct rxInst *in = &pg->inst[pg->n];
+    in->op = op;
+    in->x = x;
+    in->y = y;
+    return pg->n++;
+}
+
+static void rxCompileNode(struct rxProg *pg, struct rxNode *nodes, int id, int reverse)
+{
+    // Thompson construction, with concatenations emitted back to front for the reverse program
+    struct rxNode *nd = &nodes[id];
+    int l0, l1;
+    switch (nd->type)
+    {
+    case RN_EMPTY:
+        break;
+    case RN_SET:
+        l0 = rxEmit(pg, RX_BYTE, pg->n + 1, -1);
+        memcpy(pg->inst[l0].set, nd->set, 32);
+        break;
+    case RN_CAT:
+        rxCompileNode(pg, nodes, reverse ? nd->right : nd->left, reverse);
+        rxCompileNode(pg, nodes, reverse ? nd->left : nd->right, reverse);
+        break;
+    case RN_ALT:
+        l0 = rxEmit(pg, RX_SPLIT, pg->n + 1, -1);
+        rxCompileNode(pg, nodes, nd->left, reverse);
+        l1 = rxEmit(pg, RX_JMP, -1, -1);
+        pg->inst[l0].y = pg->n;
+        rxCompileNode(pg, nodes, nd->right, reverse);
+        pg->inst[l1].x = pg->n;
+        break;
+    case RN_STAR:
+        l0 = rxEmit(pg, RX_SPLIT, pg->n + 1, -1);
+        rxCompileNode(pg, nodes, nd->left, reverse);
+        rxEmit(pg, RX_JMP, l0, -1);
+        pg->inst[l0].y = pg->n;
+        break;
+    case RN_PLUS:
+        l0 = pg->n;
+        rxCompileNode(pg, nodes, nd->left, reverse);
+        rxEmit(pg, RX_SPLIT, l0, pg->n + 1);
+        break;
+    case RN_QUEST:
+        l0 = rxEmit(pg, RX_SPLIT, pg->n + 1, -1);
+        rxCompileNode(pg, nodes, nd->left, reverse);
+        pg->inst[l0].y = pg->n;
+        break;
+    case RN_BOL:
+    case RN_EOL:
+        // Scanning backwards, the end of the text is the edge the scan starts from
+        rxEmit(pg, ((nd->type == RN_BOL) == !reverse) ? RX_BEGIN : RX_END, pg->n + 1, -1);
+        break;
+    }
+}
+
+static void rxCompileProg(struct rxProg *pg, struct rxNode *nodes, int nnodes, int root, int reverse)
+{
+    pg->inst = calloc(nnodes * 2 + 1, sizeof(struct rxInst));
+    pg->n = 0;
+    rxCompileNode(pg, nodes, root, reverse);
+    rxEmit(pg, RX_MATCH, -1, -1);
+}
+
+static void rxCollectPrefix(struct rxNode *nodes, int id, int icase, char *buf, int *n, int *stop)
+{
+    // Gather the literal bytes every match has to start with
+    struct rxNode *nd = &nodes[id];
+    if (*stop || nd->type == RN_EMPTY || nd->type == RN_BOL || nd->type == RN_EOL)
+        return; // Nothing consumed, so the literal goes on after it
+    if (nd->type == RN_CAT)
+    {
+        rxCollectPrefix(nodes, nd->left, icase, buf, n, stop);
+        rxCollectPrefix(nodes, nd->right, icase, buf, n, stop);
+        return;
+    }
+
+    int count = 0, byte = -1;
+    if (nd->type == RN_SET)
+    {
+        for (int c = 0; c < 256; c++)
+        {
+            if (!rxSetHas(nd->set, c))
+                continue;
+            count++;
+            if (byte == -1 || (icase && islower(c)))
+                byte = c;
+        }
+    }
+    int literal = (count == 1) || (icase && count == 2 && isalpha(byte) &&
+                                   rxSetHas(nd->set, toupper(byte)));
+    if (!literal || *n == RX_MAX_PREFIX)
+    {
+        *stop = 1;
+        return;
+    }
+    buf[(*n)++] = byte;
+}
+
+static int rxAnchored(struct rxNode *nodes, int id, int *empty)
+{
+    // Whether every match of node id has to start at the start of the text. Sets
+    // *empty if the node matches nothing but the empty string, so what follows it
+    // decides.
+    struct rxNode *nd = &nodes[id];
+    *empty = (nd->type == RN_EMPTY || nd->type == RN_EOL);
+    if (nd->type == RN_BOL)
+        return 1;
+    if (nd->type == RN_CAT)
+    {
+        int left_empty, right_empty;
+        if (rxAnchored(nodes, nd->left, &left_empty))
+            return 1;
+        int anchored = left_empty && rxAnchored(nodes, nd->right, &right_empty);
+        *empty = left_empty && right_empty;
+        return anchored;
+    }
+    if (nd->type == RN_ALT)
+    {
+        int left_empty, right_empty;
+        return rxAnchored(nodes, nd->left, &left_empty) && rxAnchored(nodes, nd->right, &right_empty);
+    }
+    return 0;
+}
+
+/* LAZY DFA */
+
+static void rxInitDFA(struct rxDFA *d, struct rxProg *prog, int floating)
+{
+    d->prog = prog;
+    d->floating = floating;
+    d->states = NULL;
+    d->nstates = 0;
+    memset(d->table, 0, sizeof(d->table));
+    d->start = d->start_edge = -1;
+    d->flushes = 0;
+    d->mark = calloc(prog->n, sizeof(int));
+    d->gen = 0;
+    d->stack = malloc(sizeof(int) * (prog->n * 2 + 2));
+    d->buf = malloc(sizeof(int) * prog->n);
+    d->start_set = NULL;
+    d->nstart = 0;
+}
+
+static void rxFlushDFA(struct rxDFA *d)
+{
+    // Drop every cached state, the cache is rebuilt lazily by the scans that follow
+    for (int i = 0; i < d->nstates; i++)
+        free(d->states[i].set);
+    free(d->states);
+    d->states = NULL;
+    d->nstates = 0;
+    memset(d->table, 0, sizeof(d->table));
+    d->start = d->start_edge = -1;
+    d->flushes++;
+}
+
+static void rxFreeDFA(struct rxDFA *d)
+{
+    rxFlushDFA(d);
+    free(d->mark);
+    free(d->stack);
+    free(d->buf);
+    free(d->start_set);
+}
+
+static void rxAddThread(struct rxDFA *d, int pc, int *n, int edge)
+{
+    // Add the threads reachable from pc without consuming input, past RX_BEGIN only at
+    // the edge the scan starts from. Threads at RX_END wait there for the other edge.
+    int top = 0;
+    d->stack[top++] = pc;
+    while (top)
+    {
+        pc = d->stack[--top];
+        if (d->mark[pc] == d->gen)
+            continue;
+        d->mark[pc] = d->gen;
+        struct rxInst *in = &d->prog->inst[pc];
+        if (in->op == RX_JMP)
+        {
+            d->stack[top++] = in->x;
+        }
+        else if (in->op == RX_SPLIT)
+        {
+            d->stack[top++] = in->y;
+            d->stack[top++] = in->x;
+        }
+        else if (in->op == RX_BEGIN)
+        {
+            if (edge)
+                d->stack[top++] = in->x;
+        }
+        else
+        {
+            d->buf[(*n)++] = pc;
+        }
+    }
+}
+
+static int rxMatchesAtEnd(struct rxDFA *d, int pc)
+{
+    // Whether a thread waiting at RX_END reaches RX_MATCH once the text ends
+    int top = 0;
+    d->gen++;
+    d->stack[top++] = pc;
+    while (top)
+    {
+        pc = d->stack[--top];
+        if (d->mark[pc] == d->gen)
+            continue;
+        d->mark[pc] = d->gen;
+        struct rxInst *in = &d->prog->inst[pc];
+        if (in->op == RX_MATCH)
+            return 1;
+        if (in->op == RX_JMP || in->op == RX_END)
+            d->stack[top++] = in->x;
+        else if (in->op == RX_SPLIT)
+        {
+            d->stack[top++] = in->y;
+            d->stack[top++] = in->x;
+        }
+    }
+    return 0;
+}
+
+static int rxCompareInt(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+static int rxIntern(struct rxDFA *d, int *set, int n)
+{
+    // Find or add the state for a thread set, flushing the cache when it is full
+    qsort(set, n, sizeof(int), rxCompareInt);
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < n; i++)
+        h = (h ^ (unsigned int)set[i]) * 16777619u;
+
+    unsigned int slot = h % RX_HASH_SIZE;
+    while (d->table[slot])
+    {
+        struct rxDState *st = &d->states[d->table[slot] - 1];
+        if (st->nset == n && memcmp(st->set, set, sizeof(int) * n) == 0)
+            return d->table[slot] - 1;
+        slot = (slot + 1) % RX_HASH_SIZE;
+    }
+
+    if (d->nstates == RX_MAX_STATES)
+    {
+        rxFlushDFA(d);
+        slot = h % RX_HASH_SIZE;
+    }
+    if (d->nstates % 64 == 0)
+        d->states = realloc(d->states, sizeof(struct rxDState) * (d->nstates + 64));
+
+    struct rxDState *st = &d->states[d->nstates];
+    st->set = malloc(sizeof(int) * (n + 1));
+    memcpy(st->set, set, sizeof(int) * n);
+    st->nset = n;
+    st->accept = 0;
+    for (int i = 0; i < n; i++)
+        if (d->prog->inst[set[i]].op == RX_MATCH)
+            st->accept = 1;
+    st->accept_end = st->accept;
+    for (int i = 0; i < n && !st->accept_end; i++)
+        if (d->prog->inst[set[i]].op == RX_END)
+            st->accept_end = rxMatchesAtEnd(d, set[i]);
+    for (int c = 0; c < 256; c++)
+        st->next[c] = RX_UNKNOWN;
+    d->table[slot] = d->nstates + 1;
+    return d->nstates++;
+}
+
+static int rxStart(struct rxDFA *d, int edge)
+{
+    // A floating scan starts from no threads, since the start threads are added
+    // with every byte anyway; an anchored one starts from the program start. Either
+    // starts from the program start when the scan starts at the edge of the text,
+    // where RX_BEGIN holds.
+    if (!d->start_set)
+    {
+        int n = 0;
+        d->gen++;
+        rxAddThread(d, 0, &n, 0);
+        d->start_set = malloc(sizeof(int) * (n + 1));
+        memcpy(d->start_set, d->buf, sizeof(int) * n);
+        d->nstart = n;
+    }
+    if (edge)
+    {
+        if (d->start_edge == -1)
+        {
+            int n = 0;
+            d->gen++;
+            rxAddThread(d, 0, &n, 1);
+            d->start_edge = rxIntern(d, d->buf, n);
+        }
+        return d->start_edge;
+    }
+    if (d->start == -1)
+    {
+        memcpy(d->buf, d->start_set, sizeof(int) * d->nstart);
+        d->start = rxIntern(d, d->buf, d->floating ? 0 : d->nstart);
+    }
+    return d->start;
+}
+
+static int rxAccepts(struct rxDFA *d, int s, int at_end)
+{
+    // Whether state s has a match ending here, at_end if this is the far edge of the text
+    return at_end ? d->states[s].accept_end : d->states[s].accept;
+}
+
+static int rxStep(struct rxDFA *d, int s, unsigned char c)
+{
+    // Follow (and on first use compute) the transition of state s on byte c
+    int t = d->states[s].next[c];
+    if (t != RX_UNKNOWN)
+        return t;
+
+    int n = 0;
+    d->gen++;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        int *src = pass ? d->start_set : d->states[s].set;
+        int nsrc = pass ? (d->floating ? d->nstart : 0) : d->states[s].nset;
+        for (int i = 0; i < nsrc; i++)
+        {
+            struct rxInst *in = &d->prog->inst[src[i]];
+            if (in->op == RX_BYTE && rxSetHas(in->set, c))
+                rxAddThread(d, in->x, &n, 0);
+        }
+    }
+
+    // A flush while interning frees s, so only remember the edge if s survived
+    int flushes = d->flushes;
+    t = (n == 0 && !d->floating) ? RX_DEAD : rxIntern(d, d->buf, n);
+    if (d->flushes == flushes)
+        d->states[s].next[c] = t;
+    return t;
+}
+
+static int rxFurthestEnd(struct rxDFA *d, struct rxDFA *anchored, const char *text, int len, int from)
+{
+    // Scan forward to the end of the first non-empty match, which the leftmost match
+    // starts before, then go on without starting new threads. Returns the furthest
+    // end of a match starting before that first end, or -1 if there is none.
+    int s = rxStart(d, from == 0);
+    int i = from;
+    while (i < len)
+    {
+        s = rxStep(d, s, text[i++]);
+        if (rxAccepts(d, s, i == len))
+            break;
+    }
+    if (!rxAccepts(d, s, i == len))
+        return -1;
+
+    // The anchored DFA of the same program steps the same threads without adding any
+    int best = i;
+    int n = d->states[s].nset;
+    memcpy(anchored->buf, d->states[s].set, sizeof(int) * n);
+    s = rxIntern(anchored, anchored->buf, n);
+    for (; i < len; i++)
+    {
+        s = rxStep(anchored, s, text[i]);
+        if (s == RX_DEAD)
+            break;
+        if (rxAccepts(anchored, s, i + 1 == len))
+            best = i + 1;
+    }
+    return best;
+}
+
+static int rxLeftmostStart(struct rxDFA *d, const char *text, int len, int from, int end)
+{
+    // Smallest start at or after from of a non-empty match ending by end, scanning
+    // backwards from it with a thread started at every possible end
+    int best = -1;
+    int s = rxStart(d, end == len);
+    for (int i = end - 1; i >= from; i--)
+    {
+        s = rxStep(d, s, text[i]);
+        if (rxAccepts(d, s, i == 0))
+            best = i;
+    }
+    return best;
+}
+
+static int rxLongestEnd(struct rxDFA *d, const char *text, int len, int start)
+{
+    // Furthest end of a non-empty match beginning at start, or -1
+    int best = -1;
+    int s = rxStart(d, start == 0);
+    for (int i = start; i < len; i++)
+    {
+        s = rxStep(d, s, text[i]);
+        if (s == RX_DEAD)
+            break;
+        if (rxAccepts(d, s, i + 1 == len))
+            best = i + 1;
+    }
+    return best;
+}
+
+/* FUNCTIONS */
+
+struct regex *compileRegex(const char *pattern, int icase, const char **error)
+{
+    // Compile a pattern into forward and reverse programs with lazily built DFAs.
+    // Supports . [] [^] * + ? | () \d \w \s (and negations), and ^ and $ anywhere
+    // as the start and end of the text.
+    struct rxParser ps;
+    ps.p = pattern;
+    ps.icase = icase;
+    ps.nodes = NULL;
+    ps.n = ps.cap = 0;
+    ps.error = NULL;
+
+    int root = rxParseAlt(&ps);
+    if (root >= 0 && *ps.p == ')')
+        ps.error = "unmatched )";
+    if (root < 0 || ps.error)
+    {
+        *error = ps.error ? ps.error : "invalid pattern";
+        free(ps.nodes);
+        return NULL;
+    }
+
+    struct regex *re = malloc(sizeof(struct regex));
+    int empty;
+    re->bol = rxAnchored(ps.nodes, root, &empty);
+    re->shared = 0;
+    rxCompileProg(&re->fwd, ps.nodes, ps.n, root, 0);
+    rxCompileProg(&re->rev, ps.nodes, ps.n, root, 1);
+
+    char prefix[RX_MAX_PREFIX + 1];
+    int plen = 0, stop = 0;
+    rxCollectPrefix(ps.nodes, root, icase, prefix, &plen, &stop);
+    prefix[plen] = '\0';
+    compileQuery(&re->prefix, prefix, icase ? SEARCH_ICASE : 0);
+    free(ps.nodes);
+
+    rxInitDFA(&re->scan, &re->fwd, 1);
+    rxInitDFA(&re->back, &re->rev, 1);
+    rxInitDFA(&re->longest, &re->fwd, 0);
+    return re;
+}
+
+struct regex *cloneRegex(struct regex *src)
+{
+    // Share the compiled programs but give the copy its own DFA caches, so
+    // several threads can scan with the same pattern
+    struct regex *re = malloc(sizeof(struct regex));
+    *re = *src;
+    re->shared = 1;
+    rxInitDFA(&re->scan, &re->fwd, 1);
+    rxInitDFA(&re->back, &re->rev, 1);
+    rxInitDFA(&re->longest, &re->fwd, 0);
+    return re;
+}
+
+void freeRegex(struct regex *re)
+{
+    rxFreeDFA(&re->scan);
+    rxFreeDFA(&re->back);
+    rxFreeDFA(&re->longest);
+    if (!re->shared)
+    {
+        free(re->fwd.inst);
+        free(re->rev.inst);
+        freeQuery(&re->prefix);
+    }
+    free(re);
+}
+
+int regexFind(struct regex *re, const char *text, int len, int from, int *mlen)
+{
+    // Find the leftmost non-empty match at or after from, and its longest end. The
+    // leftmost match starts before the first match ends, so the forward scan stops
+    // starting threads there and runs on to where those threads can still match. The
+    // reverse scan from that end finds the leftmost start, and a forward anchored
+    // scan extends the match from it as far as it goes.
+    if (from < 0 || from >= len || (re->bol && from > 0))
+        return -1;
+
+    if (re->prefix.len)
+    {
+        // No match can start before the first occurrence of its literal prefix
+        from = findInText(&re->prefix, text, len, from);
+        if (from == -1 || (re->bol && from > 0))
+            return -1;
+    }
+
+    int end = rxFurthestEnd(&re->scan, &re->longest, text, len, from);
+    if (end == -1)
+        return -1;
+    int start = rxLeftmostStart(&re->back, text, len, from, end);
+    end = rxLongestEnd(&re->longest, text, len, start);
+    *mlen = end - start;
+    return start;
+}
@@ -0,0 +1,207 @@
+/* IMPORTS */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define SEARCH_SSE2
+#endif
+
+/* PROTOTYPES */
+
+struct regex *compileRegex(const char *pattern, int icase, const char **error);
+
+void freeRegex(struct regex *re);
+
+struct regex *cloneRegex(struct regex *src);
+
+int regexFind(struct regex *re, const char *text, int len, int from, int *mlen);
+
+/* MACROS */
+
+#define SWAR_ONES 0x0101010101010101ULL                        // 0x01 in every byte lane
+#define SWAR_HIGHS 0x8080808080808080ULL                       // 0x80 in every byte lane
+#define SWAR_ZERO(x) (((x) - SWAR_ONES) & ~(x) & SWAR_HIGHS)   // Flags zero lanes (may also flag lanes above one)
+
+/* FUNCTIONS */
+
+int isWordChar(int c)
+{
+    return isalnum(c) || c == '_';
+}
+
+int compileQuery(struct searchQuery *q, const char *needle, int flags)
+{
+    // Prepare a pattern once so every row scan only does the byte filter and verify.
+    // Returns -1 (leaving the reason in q->error) if a regex does not compile.
+    q->len = strlen(needle);
+    q->flags = flags;
+    q->re = NULL;
+    q->error = NULL;
+    if (flags & SEARCH_REGEX)
+    {
+        q->re = compileRegex(needle, flags & SEARCH_ICASE, &q->error);
+        if (q->re == NULL)
+            q->len = 0;
+    }
+
+    q->needle = malloc(q->len + 1);
+    for (int i = 0; i < q->len; i++)
+        q->needle[i] = (flags & SEARCH_ICASE) ? tolower((unsigned char)needle[i]) : needle[i];
+    q->needle[q->len] = '\0';
+
+    if (q->len == 0)
+        return q->error ? -1 : 0;
+    unsigned char f = q->needle[0];
+    unsigned char l = q->needle[q->len - 1];
+    q->first[0] = q->first[1] = f;
+    q->last[0] = q->last[1] = l;
+    if (flags & SEARCH_ICASE)
+    {
+        q->first[1] = toupper(f);
+        q->last[1] = toupper(l);
+    }
+    return 0;
+}
+
+void freeQuery(struct searchQuery *q)
+{
+    if (q->re)
+        freeRegex(q->re);
+    q->re = NULL;
+    free(q->needle);
+    q->needle = NULL;
+}
+
+static int verifyMatch(const struct searchQuery *q, const char *hay, int len, int at)
+{
+    // Check a candidate whose first and last bytes already matched
+    if (q->flags & SEARCH_ICASE)
+    {
+        for (int k = 1; k < q->len - 1; k++)
+            if (tolower((unsigned char)hay[at + k]) != (unsigned char)q->needle[k])
+                return 0;
+    }
+    else if (q->len > 2 && memcmp(&hay[at + 1], &q->needle[1], q->len - 2) != 0)
+    {
+        return 0;
+    }
+
+    if (q->flags & SEARCH_WORD)
+    {
+        if (at > 0 && isWordChar((unsigned char)hay[at - 1]))
+            return 0;
+        if (at + q->len < len && isWordChar((unsigned char)hay[at + q->len]))
+            return 0;
+    }
+    return 1;
+}
+
+static int candidateAt(const struct searchQuery *q, const char *hay, int len, int at)
+{
+    unsigned char f = hay[at];
+    unsigned char l = hay[at + q->len - 1];
+    return (f == q->first[0] || f == q->first[1]) &&
+           (l == q->last[0] || l == q->last[1]) &&
+           verifyMatch(q, hay, len, at);
+}
+
+int matchAt(const struct searchQuery *q, const char *hay, int len, int at)
+{
+    // Check whether the query matches starting exactly at this offset
+    if (q->len == 0 || at < 0 || at + q->len > len)
+        return 0;
+    return candidateAt(q, hay, len, at);
+}
+
+int findInText(const struct searchQuery *q, const char *hay, int len, int from)
+{
+    // Find the first match starting at or after from, -1 if there is none.
+    // Start positions are filtered a block at a time by comparing their first
+    // and last bytes in parallel (SSE2 when available, otherwise 8 lanes packed
+    // into a word), and only the flagged lanes are verified.
+    int m = q->len;
+    if (m == 0 || from < 0 || len - from < m)
+        return -1;
+    int lastpos = len - m;
+    int i = from;
+
+#ifdef SEARCH_SSE2
+    __m128i vf0 = _mm_set1_epi8(q->first[0]);
+    __m128i vf1 = _mm_set1_epi8(q->first[1]);
+    __m128i vl0 = _mm_set1_epi8(q->last[0]);
+    __m128i vl1 = _mm_set1_epi8(q->last[1]);
+    while (i + 15 <= lastpos)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)&hay[i]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&hay[i + m - 1]);
+        __m128i fa = _mm_or_si128(_mm_cmpeq_epi8(a, vf0), _mm_cmpeq_epi8(a, vf1));
+        __m128i lb = _mm_or_si128(_mm_cmpeq_epi8(b, vl0), _mm_cmpeq_epi8(b, vl1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(fa, lb));
+        while (mask)
+        {
+            int k = __builtin_ctz(mask);
+            if (verifyMatch(q, hay, len, i + k))
+                return i + k;
+            mask &= mask - 1;
+        }
+        i += 16;
+    }
+#endif
+
+    uint64_t f0 = SWAR_ONES * q->first[0];
+    uint64_t f1 = SWAR_ONES * q->first[1];
+    uint64_t l0 = SWAR_ONES * q->last[0];
+    uint64_t l1 = SWAR_ONES * q->last[1];
+
+    while (i + 7 <= lastpos)
+    {
+        uint64_t a, b;
+        memcpy(&a, &hay[i], 8);
+        memcpy(&b, &hay[i + m - 1], 8);
+        uint64_t hit = (SWAR_ZERO(a ^ f0) | SWAR_ZERO(a ^ f1)) &
+                       (SWAR_ZERO(b ^ l0) | SWAR_ZERO(b ^ l1));
+        if (hit)
+        {
+            for (int k = 0; k < 8; k++)
+                if (candidateAt(q, hay, len, i + k))
+                    return i + k;
+        }
+        i += 8;
+    }
+    for (; i <= lastpos; i++)
+        if (candidateAt(q, hay, len, i))
+            return i;
+    return -1;
+}
+
+int nextMatchFrom(const struct searchQuery *q, int at, int mlen)
+{
+    // Where to look for the match after one at `at`: literals report overlapping
+    // matches (the candidate cache relies on every start), regex matches do not
+    return q->re ? at + mlen : at + 1;
+}
+
+int findMatch(const struct searchQuery *q, const char *hay, int len, int from, int *mlen)
+{
+    // Find the next match of a literal or regex query and report its length
+    if (q->re == NULL)
+    {
+        *mlen = q->len;
+        return (q->flags & SEARCH_REGEX) ? -1 : findInText(q, hay, len, from);
+    }
+
+    int at;
+    while ((at = regexFind(q->re, hay, len, from, mlen)) != -1)
+    {
+        if (!(q->flags & SEARCH_WORD) ||
+            ((at == 0 || !isWordChar((unsigned char)hay[at - 1])) &&
+             (at + *mlen == len || !isWordChar((unsigned char)hay[at + *mlen]))))
+            return at;
+        from = at + 1;
+    }
+    return -1;
+}
@@ -0,0 +1,3388 @@
+/* IMPORTS */
+
+#include <termios.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include <math.h>
+#include <limits.h>
+#include <poll.h>
+#include <ctype.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "term.h"
+#include "clip.c"
+
+/* DATA */
+
+extern struct editorConfig E;
+
+char findPrompt[192];     // Find prompt with the active modes and match count filled in
+char *findLabel = "Search"; // What the find prompt is picking a query for
+
+/* PROTOTYPES */
+
+void setStatusMessage(const char *fmt, ...);
+
+void setCursor(int row, int col);
+
+void die(char *s);
+
+void resetScreen(void);
+
+void refreshScreen(void);
+
+char *askPrompt(char *prompt, void (*callback)(char *, int));
+
+char *readPrompt(char *prompt, void (*callback)(char *, int), int allow_empty);
+
+int readTerminalKey(void);
+
+int readKey(void);
+
+void updateFindPrompt(void);
+
+int syntaxToColor(int hl);
+
+void scroll(void);
+
+int getWindowSize(int *rows, int *cols);
+
+void clearSelection(void);
+
+void startSelection(void);
+
+void updateSelection(void);
+
+int isPositionSelected(int row, int col);
+
+int selectionSpan(int row, int *lo, int *hi);
+
+void deleteSelection(void);
+
+void copySelection(void);
+
+void pasteFromClipboard(void);
+
+void cyclePaste(void);
+
+void clearCursors(void);
+
+void addCursorBelow(void);
+
+void editCursors(int key);
+
+void moveCursors(int key);
+
+void drawCursors(struct abuf *ab);
+
+void toggleRecording(void);
+
+void replayMacro(void);
+
+void watchFile(const char *path);
+
+void startJournal(struct document *doc);
+
+void saveWindow(void);
+
+void loadWindow(int i);
+
+/* OPS */
+
+void insertChar(int c)
+{
+    // Insert char at cursor
+    int offset = log10(E.doc->numrows) + 2; // Offset for line numbers
+
+    if (E.cy == E.doc->numrows)
+    {
+        if (E.doc->numrows == 0)
+        {
+            E.cx = 2;
+        }
+        insertRow(E.doc, E.doc->numrows, "", 0);
+    }
+    rowInsertChar(E.doc, &E.doc->row[E.cy], E.cx - offset, c);
+    E.cx++;
+}
+
+void insertNewline(void)
+{
+    // Enter press basically
+    int offset = log10(E.doc->numrows) + 2; // Offset for line numbers
+
+    erow *row = &E.doc->row[E.cy];
+    char *indent = malloc(row->size + 1);
+    int i = 0;
+    while (row->chars[i] == ' ' || row->chars[i] == '\t')
+    {
+        indent[i] = row->chars[i];
+        i++;
+    }
+
+    if (E.cx == offset)
+    {
+        insertRow(E.doc, E.cy, "", 0);
+    }
+    else
+    {
+        memcpy(indent + i, &row->chars[E.cx - offset], row->size - E.cx + offset);
+        insertRow(E.doc, E.cy + 1, indent, row->size - E.cx + offset + i);
+        row = &E.doc->row[E.cy];
+        undoRecord(&E.doc->undo, UNDO_DELETE, E.cy, E.cx - offset, &row->chars[E.cx - offset],
+                   row->size - E.cx + offset, 0);
+        row->size = E.cx - offset;
+        row->chars[row->size] = '\0';
+        renderRow(E.doc, row);
+    }
+    free(indent);
+    setCursor(E.cy + 1, i); // The new row may have widened the line numbers
+}
+
+void deleteChar(void)
+{
+    // Delete char at cursor
+    int offset = log10(E.doc->numrows) + 2; // Offset for line numbers
+    if (E.cy == E.doc->numrows)
+        return;
+    if (E.cx == offset && E.cy == 0)
+        return;
+    erow *row = &E.doc->row[E.cy];
+    if (E.cx > offset)
+    {
+        rowDeleteChar(E.doc, row, E.cx - 1 - offset);
+        E.cx--;
+    }
+    else
+    {
+        E.cx = E.doc->row[E.cy - 1].size + offset; // Move to end of previous line
+        rowAppendString(E.doc, &E.doc->row[E.cy - 1], row->chars, row->size);
+        deleteRow(E.doc, E.cy);
+        E.cy--;
+    }
+}
+
+void delCurRow(void)
+{
+    deleteRow(E.doc, E.cy);
+}
+
+void paste(void)
+{
+}
+
+void setCursor(int row, int col)
+{
+    // Put the cursor at a text position, clamped to the text
+    if (row > E.doc->numrows)
+        row = E.doc->numrows;
+    if (row < 0)
+        row = 0;
+    int size = (row < E.doc->numrows) ? E.doc->row[row].size : 0;
+    if (col > size)
+        col = size;
+    if (col < 0)
+        col = 0;
+    E.cy = row;
+    E.cx = (E.doc->numrows ? (int)log10(E.doc->numrows) + 2 : 2) + col;
+}
+
+void undo(void)
+{
+    // Undo the last group of edits and put the cursor back where it was before them
+    int row, col;
+    if (docUndo(E.doc, &row, &col) == -1)
+    {
+        setStatusMessage("Nothing to undo");
+        return;
+    }
+    clearSelection();
+    setCursor(row, col);
+}
+
+void redo(void)
+{
+    // Redo the next undone group of edits and put the cursor after the last of them
+    int row, col;
+    if (docRedo(E.doc, &row, &col) == -1)
+    {
+        setStatusMessage("Nothing to redo");
+        return;
+    }
+    clearSelection();
+    setCursor(row, col);
+}
+
+/* FILES */
+
+void eclose(void)
+{
+    // Drop the open buffer, leaving an empty unnamed one
+    docClear(E.doc);
+    E.cx = E.cy = E.rx = 0;
+    E.rowoff = E.coloff = 0;
+    E.buffers[E.current].results = 0;
+    clearSelection();
+    clearCursors();
+}
+
+int eopen(char *filename)
+{
+    // Open a file and read its contents into memory, returns -1 (with errno set) if it
+    // can't be read, leaving the buffer as it was
+    if (docOpen(E.doc, filename) == -1)
+        return -1;
+
+    E.cx = log10(E.doc->numrows) + 2; // Set cursor to the start of the first line
+    if (E.indexing)
+        trigramInit(&E.doc->trigrams); // Filled in while waiting for keys, see idleIndex
+    watchFile(filename);
+    startJournal(E.doc);
+    return 0;
+}
+
+int esave(void)
+{
+    // Save the current text in memory to a file, returns -1 if it was not saved
+    if (E.doc->filename == NULL)
+    {
+        E.doc->filename = askPrompt("Save as: %s (ESC to cancel)", NULL);
+        if (E.doc->filename == NULL)
+        {
+            setStatusMessage("Save aborted");
+            return -1;
+        }
+        selectSyntax(E.doc);
+    }
+    else if (docChanged(E.doc))
+    {
+        setStatusMessage("%s changed on disk since it was read, overwrite it? (y: Yes | n: No)", E.doc->filename);
+        refreshScreen();
+        int key = readKey();
+        if (key != 'y' && key != 'Y')
+        {
+            setStatusMessage("Save aborted");
+            return -1;
+        }
+    }
+
+    if (docSave(E.doc) == -1)
+    {
+        setStatusMessage("Error saving to %s: %s", E.doc->filename, strerror(errno));
+        return -1;
+    }
+    watchFile(E.doc->filename);
+    if (!E.headless && E.doc->journal.fd == -1)
+        docJournal(E.doc); // Named just now, saved so there is nothing to recover
+    setStatusMessage("Saved to %s", E.doc->filename);
+    return 0;
+}
+
+void startJournal(struct document *doc)
+{
+    // Keep a journal of the edits to a file's document, first offering to replay the
+    // one a session that ended without saving left behind
+    if (E.headless || !doc->filename)
+        return;
+    if (journalPending(doc->filename))
+    {
+        setStatusMessage("Recover unsaved changes to %s from its journal? (y: Yes | n: No)", doc->filename);
+        refreshScreen();
+        int key = readKey();
+        if (key == 'y' || key == 'Y')
+        {
+            int ops = docRecover(doc);
+            if (ops == -1 && errno == ESTALE)
+                setStatusMessage("%s changed since its journal was written, the changes were dropped", doc->filename);
+            else if (ops == -1)
+                setStatusMessage("Can't read the journal of %s: %s", doc->filename, strerror(errno));
+            else
+                setStatusMessage("Recovered %d edit%s to %s, Ctrl-Z undoes them", ops, ops == 1 ? "" : "s",
+                                 doc->filename);
+        }
+    }
+    if (docJournal(doc) == -1)
+        setStatusMessage("Can't keep a journal of %s: %s", doc->filename, strerror(errno));
+}
+
+void checkJournals(void)
+{
+    // Compact the journals that grew too long and report the ones that can't be written
+    for (int i = 0; i < E.nbuffers; i++)
+    {
+        struct document *doc = E.buffers[i].doc;
+        if (!doc->undo.journal)
+            continue;
+        docJournalCompact(doc);
+        pthread_mutex_lock(&doc->journal.lock);
+        int err = doc->journal.error;
+        doc->journal.error = 0;
+        pthread_mutex_unlock(&doc->journal.lock);
+        if (err)
+            setStatusMessage("Can't write the journal of %s: %s", doc->filename, strerror(err));
+    }
+}
+
+void closeJournals(void)
+{
+    // Remove every journal, on quitting with the changes saved or thrown away
+    for (int i = 0; i < E.nbuffers; i++)
+        docJournalClose(E.buffers[i].doc, 0);
+}
+
+void watchFile(const char *path)
+{
+    // Watch the directory a file is in, editors and tools often replace a file by
+    // renaming a new one over it, which a watch on the file itself would lose
+#ifdef __linux__
+    if (E.watchfd == -1)
+        return;
+    char *dir = strdup(path);
+    char *slash = strrchr(dir, '/');
+    if (slash == dir)
+        slash[1] = '\0';
+    else if (slash)
+        *slash = '\0';
+    inotify_add_watch(E.watchfd, slash ? dir : ".", IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY);
+    free(dir);
+#else
+    (void)path;
+#endif
+}
+
+void fileChanged(int i)
+{
+    // Another program changed buffer i's file. A clean buffer takes the new text in,
+    // keeping the rows that did not change and moving views below the changed ones
+    // with their text. A modified one is left alone until saving asks what to do.
+    struct document *doc = E.buffers[i].doc;
+    if (doc->dirty)
+    {
+        setStatusMessage("%s changed on disk, it is not reloaded over your changes", doc->filename);
+        return;
+    }
+
+    saveWindow();
+    int at, removed, added;
+    if (docReload(doc, &at, &removed, &added) == -1)
+    {
+        setStatusMessage("Can't reload %s: %s", doc->filename, strerror(errno));
+        return;
+    }
+    if (removed == 0 && added == 0)
+        return;
+
+    if (E.buffers[i].row >= at + removed)
+        E.buffers[i].row += added - removed;
+    for (int w = 0; w < E.nwindows; w++)
+        if (E.windows[w].buffer == i && E.windows[w].row >= at + removed)
+            E.windows[w].row += added - removed;
+    if (i == E.current)
+    {
+        clearSelection();
+        clearCursors();
+    }
+    loadWindow(E.active);
+    setStatusMessage("Reloaded %d changed line%s of %s", added, added == 1 ? "" : "s", doc->filename);
+}
+
+void followBuffer(int i)
+{
+    // Add the lines appended to a followed buffer's file. Views on its last row move to
+    // the new last row, so the window scrolls along while the cursor is at the end.
+    struct document *doc = E.buffers[i].doc;
+    if (doc->dirty || !docChanged(doc))
+    {
+        if (doc->dirty && docChanged(doc))
+            fileChanged(i);
+        return;
+    }
+
+    saveWindow();
+    int last = doc->numrows - 1;
+    int added;
+    int res = docFollow(doc, &added);
+    if (res == 1)
+    {
+        fileChanged(i); // Truncated or replaced, e.g. by log rotation
+        return;
+    }
+    if (res == -1)
+    {
+        setStatusMessage("Can't follow %s: %s", doc->filename, strerror(errno));
+        return;
+    }
+
+    if (E.buffers[i].row >= last)
+        E.buffers[i].row = doc->numrows - 1;
+    for (int w = 0; w < E.nwindows; w++)
+        if (E.windows[w].buffer == i && E.windows[w].row >= last)
+            E.windows[w].row = doc->numrows - 1;
+    loadWindow(E.active);
+}
+
+void checkFiles(void)
+{
+    // Reload the buffers whose files changed since the last check. Events only say
+    // something in a watched directory was written, so each buffer compares its file.
+    // Followed ones take every write, others only finished or swapped in files.
+#ifdef __linux__
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    uint32_t mask = 0;
+    ssize_t n;
+    while (E.watchfd != -1 && (n = read(E.watchfd, events, sizeof(events))) > 0)
+    {
+        for (char *p = events; p < events + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+        {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (!ev->len || !strstr(ev->name, JOURNAL_SUFFIX)) // Our own journals are written all the time
+                mask |= ev->mask;
+        }
+    }
+    if (!mask)
+        return;
+    for (int i = 0; i < E.nbuffers; i++)
+    {
+        if (E.buffers[i].evicted)
+            continue;
+        if (E.buffers[i].follow)
+            followBuffer(i);
+        else if ((mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) && docChanged(E.buffers[i].doc))
+            fileChanged(i);
+    }
+    refreshScreen();
+#endif
+}
+
+void toggleFollow(void)
+{
+    // Start or stop following the current buffer's file, starting jumps to its end
+    struct buffer *b = &E.buffers[E.current];
+    if (!b->follow && E.doc->filename == NULL)
+    {
+        setStatusMessage("Only a file can be followed");
+        return;
+    }
+    b->follow = !b->follow;
+    if (!b->follow)
+    {
+        setStatusMessage("Stopped following %s", E.doc->filename);
+        return;
+    }
+    followBuffer(E.current);
+    setCursor(E.doc->numrows ? E.doc->numrows - 1 : 0, 0);
+    setStatusMessage("Following %s, new lines are shown as they are written (Ctrl-E stops)", E.doc->filename);
+}
+
+/* BUFFERS */
+
+int bufferShown(int i)
+{
+    for (int w = 0; w < E.nwindows; w++)
+        if (E.windows[w].buffer == i)
+            return 1;
+    return 0;
+}
+
+int reloadBuffer(struct buffer *b)
+{
+    // Read an evicted buffer's file again, returns -1 if it can't be
+    char *path = b->doc->filename;
+    b->doc->filename = NULL;
+    if (docOpen(b->doc, path) == -1)
+    {
+        b->doc->filename = path;
+        return -1;
+    }
+    free(path);
+    b->evicted = 0;
+    if (E.indexing)
+        trigramInit(&b->doc->trigrams);
+    watchFile(b->doc->filename);
+    startJournal(b->doc);
+    return 0;
+}
+
+void evictBuffers(void)
+{
+    // Drop the text of the least recently shown buffers past BUFFERS_LOADED. Only clean
+    // ones backed by a file go, since they can be read again as they were.
+    int loaded = 0;
+    for (int i = 0; i < E.nbuffers; i++)
+        loaded += !E.buffers[i].evicted;
+    while (loaded > BUFFERS_LOADED)
+    {
+        struct buffer *lru = NULL;
+        for (int i = 0; i < E.nbuffers; i++)
+        {
+            struct buffer *b = &E.buffers[i];
+            if (!bufferShown(i) && !b->evicted && !b->follow && !b->results && !b->doc->dirty && b->doc->filename &&
+                (!lru || b->used < lru->used))
+                lru = b;
+        }
+        if (!lru)
+            return;
+        char *path = lru->doc->filename; // Kept to read the file again
+        lru->doc->filename = NULL;
+        docClear(lru->doc);
+        lru->doc->filename = path;
+        lru->evicted = 1;
+        loaded--;
+    }
+}
+
+void switchBuffer(int i)
+{
+    // Show buffer i. Its document stayed rendered, so only the view changes, unless it
+    // was evicted and has to be read again.
+    static unsigned long clock = 0;
+    struct buffer *b = &E.buffers[i];
+    if (b->evicted && reloadBuffer(b) == -1)
+    {
+        setStatusMessage("Can't read %s again: %s", b->doc->filename, strerror(errno));
+        return;
+    }
+    if (E.doc && i != E.current)
+    {
+        struct buffer *cur = &E.buffers[E.current];
+        int offset = log10(E.doc->numrows) + 2;
+        cur->row = E.cy;
+        cur->col = E.doc->numrows ? E.cx - offset : 0;
+        cur->rowoff = E.rowoff;
+        cur->coloff = E.coloff;
+        E.last = E.current;
+    }
+    clearSelection();
+    clearCursors();
+    E.current = i;
+    E.windows[E.active].buffer = i;
+    E.doc = b->doc;
+    setCursor(b->row, b->col);
+    E.rowoff = b->rowoff;
+    E.coloff = b->coloff;
+    b->used = ++clock;
+    evictBuffers();
+}
+
+void newBuffer(void)
+{
+    // Add an empty buffer and show it
+    E.buffers = realloc(E.buffers, sizeof(struct buffer) * (E.nbuffers + 1));
+    struct buffer *b = &E.buffers[E.nbuffers];
+    b->doc = malloc(sizeof(struct document));
+    docInit(b->doc);
+    b->doc->undo.limit = E.undo_limit;
+    b->doc->hl_clock = &E.profile.hl_ns;
+    b->row = b->col = 0;
+    b->rowoff = b->coloff = 0;
+    b->results = 0;
+    b->follow = 0;
+    b->evicted = 0;
+    b->used = 0;
+    switchBuffer(E.nbuffers++);
+}
+
+void freshBuffer(void)
+{
+    // Show an empty buffer, the current one if it is empty and unnamed already
+    if (E.doc && E.doc->numrows == 0 && E.doc->filename == NULL && !E.doc->dirty &&
+        !E.buffers[E.current].results)
+        return;
+    newBuffer();
+}
+
+int checkBudget(const char *filename)
+{
+    // Ask before opening a file whose rows would take more memory than the budget,
+    // scripts only get a warning. Returns 0 if it is not to be opened.
+    long lines;
+    long long need = E.mem_budget ? fileMemory(filename, findSyntax(filename) != NULL, &lines) : -1;
+    if (need <= E.mem_budget)
+        return 1;
+    if (E.headless)
+    {
+        fprintf(stderr, "warning: %s would take about %lld MB for %ld lines, over the %ld MB budget\n", filename,
+                need / 1048576, lines, E.mem_budget / 1048576);
+        return 1;
+    }
+    setStatusMessage("%s would take about %lld MB for %ld lines, over the %ld MB budget. Open it anyway? (y: Yes | n: No)",
+                     filename, need / 1048576, lines, E.mem_budget / 1048576);
+    refreshScreen();
+    int key = readKey();
+    if (key == 'y' || key == 'Y')
+        return 1;
+    setStatusMessage("Did not open %s", filename);
+    return 0;
+}
+
+int openBuffer(char *filename)
+{
+    // Show the buffer holding a file, opening it into a new one if none does. Returns -1
+    // (with errno set) if the file can't be read, the other buffers are left as they were.
+    for (int i = 0; i < E.nbuffers; i++)
+    {
+        if (E.buffers[i].doc->filename && strcmp(E.buffers[i].doc->filename, filename) == 0)
+        {
+            switchBuffer(i);
+            return 0;
+        }
+    }
+    if (!checkBudget(filename))
+        return 0;
+    int current = E.current, last = E.last, nbuffers = E.nbuffers;
+    freshBuffer();
+    if (eopen(filename) == 0)
+        return 0;
+
+    int err = errno;
+    if (E.nbuffers > nbuffers)
+    {
+        // Drop the buffer made for the file and go back to the one shown before
+        switchBuffer(current);
+        E.last = last;
+        struct document *doc = E.buffers[--E.nbuffers].doc;
+        docClear(doc);
+        free(doc);
+    }
+    setStatusMessage("Can't open %s: %s", filename, strerror(err));
+    errno = err;
+    return -1;
+}
+
+int anyDirty(void)
+{
+    for (int i = 0; i < E.nbuffers; i++)
+        if (E.buffers[i].doc->dirty)
+            return 1;
+    return 0;
+}
+
+void openFile(void)
+{
+    // Open a file into its own buffer, or show the buffer that has it already
+    char *path = askPrompt("Open file: %s (ESC to cancel)", NULL);
+    if (path == NULL)
+        return;
+    if (access(path, R_OK) == -1)
+        setStatusMessage("Can't open %s: %s", path, strerror(errno));
+    else
+        openBuffer(path);
+    free(path);
+}
+
+void listBuffers(void)
+{
+    // Pick a buffer by its number from the list in the prompt, Enter alone goes back
+    // to the one shown before
+    char prompt[sizeof(E.status)];
+    int len = snprintf(prompt, sizeof(prompt), "Buffer: %%s (Enter for last |");
+    for (int i = 0; i < E.nbuffers && len < (int)sizeof(prompt) - 8; i++)
+    {
+        struct buffer *b = &E.buffers[i];
+        const char *name = b->results ? "[results]" : b->doc->filename ? b->doc->filename : "[No Name]";
+        len += snprintf(&prompt[len], sizeof(prompt) - len, " %d%s ", i + 1, i == E.current ? ">" : "");
+        for (const char *p = name; *p && len < (int)sizeof(prompt) - 8; p++)
+        {
+            prompt[len++] = *p;
+            if (*p == '%')
+                prompt[len++] = '%'; // The prompt is a format string
+        }
+        if (b->doc->dirty)
+            prompt[len++] = '*';
+    }
+    snprintf(&prompt[len], sizeof(prompt) - len, ")");
+
+    char *answer = readPrompt(prompt, NULL, 1);
+    if (answer == NULL)
+        return;
+    int i = answer[0] ? atoi(answer) - 1 : E.last;
+    free(answer);
+    if (i < 0 || i >= E.nbuffers)
+    {
+        setStatusMessage("No such buffer");
+        return;
+    }
+    switchBuffer(i);
+}
+
+static void writeUsage(FILE *fp, const char *name, size_t bytes, long rows, size_t total)
+{
+    fprintf(fp, "  %-18s %14zu bytes %10.1f per line %6.1f%%\n", name, bytes, rows ? (double)bytes / rows : 0.0,
+            total ? bytes * 100.0 / total : 0.0);
+}
+
+void writeMemory(FILE *fp)
+{
+    // Heap taken by every loaded buffer, split by structure, with the average per line
+    size_t all = 0;
+    for (int i = 0; i < E.nbuffers; i++)
+    {
+        struct buffer *b = &E.buffers[i];
+        const char *name = b->results ? "[results]" : b->doc->filename ? b->doc->filename : "[No Name]";
+        if (b->evicted)
+        {
+            fprintf(fp, "%s: not loaded\n", name);
+            continue;
+        }
+        struct memUsage m;
+        docMemory(b->doc, &m);
+        all += m.total;
+        fprintf(fp, "%s: %ld lines, %.2f MB\n", name, m.rows, m.total / 1048576.0);
+        writeUsage(fp, "chars", m.chars, m.rows, m.total);
+        writeUsage(fp, "render", m.render, m.rows, m.total);
+        writeUsage(fp, "hl", m.hl, m.rows, m.total);
+        writeUsage(fp, "row array", m.row_array, m.rows, m.total);
+        writeUsage(fp, "row array slack", m.row_slack, m.rows, m.total);
+        writeUsage(fp, "allocation slack", m.slack, m.rows, m.total);
+        writeUsage(fp, "allocator headers", m.headers, m.rows, m.total);
+        writeUsage(fp, "undo", m.undo, m.rows, m.total);
+        writeUsage(fp, "trigram index", m.trigrams, m.rows, m.total);
+        writeUsage(fp, "find matches", m.search, m.rows, m.total);
+    }
+    fprintf(fp, "All buffers: %.2f MB", all / 1048576.0);
+#ifdef __linux__
+    // Resident size of the whole process, to compare with
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm && fscanf(statm, "%*d %ld", &pages) == 1)
+        fprintf(fp, ", process resident %.2f MB", pages * sysconf(_SC_PAGESIZE) / 1048576.0);
+    if (statm)
+        fclose(statm);
+#endif
+    fprintf(fp, "\n");
+}
+
+void showMemory(void)
+{
+    // List what every buffer takes in memory in a new buffer
+    char *report = NULL;
+    size_t len = 0;
+    FILE *fp = open_memstream(&report, &len);
+    writeMemory(fp);
+    fclose(fp);
+
+    freshBuffer();
+    char *p = report;
+    char *end = report + len;
+    while (p < end)
+    {
+        char *nl = memchr(p, '\n', end - p);
+        insertRow(E.doc, E.doc->numrows, p, nl - p);
+        p = nl + 1;
+    }
+    free(report);
+    E.cx = log10(E.doc->numrows) + 2;
+    E.doc->dirty = 0;
+    setStatusMessage("Memory in use, as of now");
+}
+
+/* WINDOWS */
+
+int windowCols(struct window *w)
+{
+    // Text columns of a window, all but a divider if another window is to its right
+    return w->cols - (w->left + w->cols < E.termcols);
+}
+
+void saveWindow(void)
+{
+    // Keep the view of the active window, so another can be loaded into E
+    struct window *w = &E.windows[E.active];
+    int offset = log10(E.doc->numrows) + 2;
+    w->row = E.cy;
+    w->col = E.doc->numrows ? E.cx - offset : 0;
+    w->rowoff = E.rowoff;
+    w->coloff = E.coloff;
+}
+
+void loadWindow(int i)
+{
+    // Make window i the active one, its buffer and view become the ones edited
+    struct window *w = &E.windows[i];
+    E.active = i;
+    E.current = w->buffer;
+    E.doc = E.buffers[w->buffer].doc;
+    E.screenrows = w->rows - 1;
+    E.screencols = windowCols(w);
+    setCursor(w->row, w->col);
+    E.rowoff = w->rowoff;
+    E.coloff = w->coloff;
+}
+
+void resizeWindows(int rows, int cols)
+{
+    // Fit the windows to a new screen area, every edge moved in proportion so they
+    // still tile it. Falls back to the active window alone if one would be too small.
+    int small = 0;
+    for (int i = 0; i < E.nwindows; i++)
+    {
+        struct window *w = &E.windows[i];
+        if (E.termrows == 0)
+        {
+            w->top = w->left = 0; // First layout, the one window takes it all
+            w->rows = rows;
+            w->cols = cols;
+            continue;
+        }
+        int bottom = (w->top + w->rows) * rows / E.termrows;
+        int right = (w->left + w->cols) * cols / E.termcols;
+        w->top = w->top * rows / E.termrows;
+        w->left = w->left * cols / E.termcols;
+        w->rows = bottom - w->top;
+        w->cols = right - w->left;
+        small |= w->rows < 2 || w->cols < 2;
+    }
+    if (E.nwindows > 1)
+        saveWindow();
+    if (small)
+    {
+        E.windows[0] = E.windows[E.active];
+        E.windows[0].top = E.windows[0].left = 0;
+        E.windows[0].rows = rows;
+        E.windows[0].cols = cols;
+        E.nwindows = 1;
+        E.active = 0;
+    }
+    E.termrows = rows;
+    E.termcols = cols;
+    E.screenrows = E.windows[E.active].rows - 1;
+    E.screencols = windowCols(&E.windows[E.active]);
+}
+
+void splitWindow(int vertical)
+{
+    // Split the active window in two showing the same buffer, the new half becomes active
+    struct window *w = &E.windows[E.active];
+    if (vertical ? w->cols < 2 * WINDOW_MIN_COLS : w->rows < 2 * WINDOW_MIN_ROWS)
+    {
+        setStatusMessage("Window is too small to split");
+        return;
+    }
+    saveWindow();
+    E.windows = realloc(E.windows, sizeof(struct window) * (E.nwindows + 1));
+    w = &E.windows[E.active];
+    struct window *half = &E.windows[E.nwindows];
+    *half = *w;
+    if (vertical)
+    {
+        w->cols /= 2;
+        half->left += w->cols;
+        half->cols -= w->cols;
+    }
+    else
+    {
+        w->rows /= 2;
+        half->top += w->rows;
+        half->rows -= w->rows;
+    }
+    loadWindow(E.nwindows++);
+}
+
+int windowEdge(struct window *c, struct window *o, int side)
+{
+    // How much of c's side 0 (top), 1 (bottom), 2 (left) or 3 (right) window o lies
+    // along, 0 unless o is next to that side and within it
+    if (side < 2)
+    {
+        int along = side == 0 ? o->top + o->rows == c->top : o->top == c->top + c->rows;
+        return (along && o->left >= c->left && o->left + o->cols <= c->left + c->cols) ? o->cols : 0;
+    }
+    int along = side == 2 ? o->left + o->cols == c->left : o->left == c->left + c->cols;
+    return (along && o->top >= c->top && o->top + o->rows <= c->top + c->rows) ? o->rows : 0;
+}
+
+void closeWindow(void)
+{
+    // Close the active window, giving its space to the windows along one of its sides.
+    // Splitting only ever halves a window, so one side is always covered exactly.
+    if (E.nwindows == 1)
+    {
+        setStatusMessage("Only one window");
+        return;
+    }
+    struct window *c = &E.windows[E.active];
+    for (int side = 0; side < 4; side++)
+    {
+        int covered = 0;
+        for (int i = 0; i < E.nwindows; i++)
+            if (i != E.active)
+                covered += windowEdge(c, &E.windows[i], side);
+        if (covered != (side < 2 ? c->cols : c->rows))
+            continue;
+
+        int next = -1;
+        for (int i = 0; i < E.nwindows; i++)
+        {
+            struct window *o = &E.windows[i];
+            if (i == E.active || !windowEdge(c, o, side))
+                continue;
+            if (side < 2)
+            {
+                if (side == 1)
+                    o->top = c->top;
+                o->rows += c->rows;
+            }
+            else
+            {
+                if (side == 3)
+                    o->left = c->left;
+                o->cols += c->cols;
+            }
+            if (next == -1)
+                next = i > E.active ? i - 1 : i;
+        }
+        memmove(c, c + 1, sizeof(struct window) * (E.nwindows - E.active - 1));
+        E.nwindows--;
+        clearSelection();
+        clearCursors();
+        loadWindow(next);
+        return;
+    }
+}
+
+void nextWindow(void)
+{
+    saveWindow();
+    clearSelection();
+    clearCursors();
+    loadWindow((E.active + 1) % E.nwindows);
+}
+
+void windowCommand(void)
+{
+    // Ctrl-W is followed by the window command
+    setStatusMessage("Window: S split | V split side by side | W next | C close");
+    refreshScreen();
+    int c;
+    while ((c = readKey()) == SKIP_KEY)
+        refreshScreen();
+    setStatusMessage("");
+    switch (tolower(c))
+    {
+    case 's':
+        splitWindow(0);
+        break;
+    case 'v':
+        splitWindow(1);
+        break;
+    case 'w':
+    case CTRL_KEY('w'):
+        nextWindow();
+        break;
+    case 'c':
+        closeWindow();
+        break;
+    }
+}
+
+/* FIND */
+
+void search(char *query, int key)
+{
+    static int lm = -1; // Last matching row, used when there are too many matches to index
+    static int dir = 1;
+
+    static int saved_hl_line;
+    static hlrun *saved_hl = NULL;
+    static int saved_hlsize;
+
+    if (saved_hl)
+    {
+        // Put back the runs the match overlay replaced
+        free(E.doc->row[saved_hl_line].hl);
+        E.doc->row[saved_hl_line].hl = saved_hl;
+        E.doc->row[saved_hl_line].hlsize = saved_hlsize;
+        saved_hl = NULL;
+    }
+
+    int changed = 1; // Whether the query or its modes changed
+    if (key == 'r' || key == '\x1b')
+    {
+        lm = -1;
+        dir = 1;
+        return;
+    }
+    else if (key == CTRL_KEY('e') || key == CTRL_KEY('w') || key == CTRL_KEY('r'))
+    {
+        // Toggle a match mode and search again
+        E.search_flags ^= (key == CTRL_KEY('e')) ? SEARCH_ICASE : (key == CTRL_KEY('w')) ? SEARCH_WORD : SEARCH_REGEX;
+        lm = -1;
+        dir = 1;
+    }
+    else if (key == ARROW_RIGHT || key == ARROW_DOWN)
+    {
+        dir = 1;
+        changed = 0;
+    }
+    else if (key == ARROW_LEFT || key == ARROW_UP)
+    {
+        dir = -1;
+        changed = 0;
+    }
+    else if (key == '\r')
+    {
+        dir = 0; // Keep the match that is showing
+        changed = 0;
+    }
+    else
+    {
+        lm = -1;
+        dir = 1;
+    }
+
+    if (changed)
+    {
+        // Narrowing candidates only works for literals, a regex is matched from scratch
+        struct searchLevel *lv = (E.search_flags & SEARCH_REGEX) ? NULL : syncSearchCache(E.doc, query, E.search_flags);
+        buildMatchIndex(E.doc, query, E.search_flags, lv);
+    }
+
+    int cur = -1; // Row, offset and length of the match to show
+    int at = -1;
+    int mlen = 0;
+    if (E.doc->matches.complete && E.doc->matches.count > 0)
+    {
+        int k = E.doc->matches.current;
+        if (k == -1)
+        {
+            k = matchLowerBound(E.doc, E.doc->matches.origin_row, E.doc->matches.origin_col);
+            if (k == E.doc->matches.count)
+                k = 0;
+        }
+        else
+        {
+            k = (k + dir + E.doc->matches.count) % E.doc->matches.count;
+        }
+        E.doc->matches.current = k;
+        cur = E.doc->matches.matches[k].row;
+        at = E.doc->matches.matches[k].col;
+        mlen = E.doc->matches.matches[k].len;
+    }
+    else if (!E.doc->matches.complete && E.doc->matches.q.needle)
+    {
+        // Too many matches to index, so scan rows until one matches
+        if (lm == -1 || dir == 0)
+        {
+            lm = (lm < 0) ? -1 : lm - 1;
+            dir = 1;
+        }
+        int r = lm;
+        for (int i = 0; i < E.doc->numrows; i++)
+        {
+            r += dir;
+            if (r == -1)
+                r = E.doc->numrows - 1;
+            else if (r == E.doc->numrows)
+                r = 0;
+
+            at = findMatch(&E.doc->matches.q, E.doc->row[r].chars, E.doc->row[r].size, 0, &mlen);
+            if (at != -1)
+            {
+                cur = r;
+                break;
+            }
+        }
+    }
+
+    if (cur != -1)
+    {
+        erow *row = &E.doc->row[cur];
+        lm = cur;
+        E.cy = cur;
+        E.cx = at + mlen + log10(E.doc->numrows) + 2;
+        E.rowoff = E.doc->numrows;
+
+        // Matches are found in chars, so map them to render columns for the overlay
+        int rx = getCursorRx(row, at);
+        int rlen = getCursorRx(row, at + mlen) - rx;
+
+        highlightLazy(E.doc, row);
+        saved_hl_line = cur;
+        saved_hlsize = row->hlsize;
+        saved_hl = malloc(sizeof(hlrun) * (saved_hlsize + 1));
+        memcpy(saved_hl, row->hl, sizeof(hlrun) * saved_hlsize);
+        rowOverlayHighlight(row, rx, rlen, HL_MATCH);
+    }
+
+    updateFindPrompt();
+}
+
+void updateFindPrompt(void)
+{
+    // Rebuild the find prompt so it shows the active match modes and match count
+    char modes[48];
+    snprintf(modes, sizeof(modes), "%s%s%s",
+             (E.search_flags & SEARCH_ICASE) ? " [case-insensitive]" : "",
+             (E.search_flags & SEARCH_WORD) ? " [word]" : "",
+             (E.search_flags & SEARCH_REGEX) ? " [regex]" : "");
+
+    char count[48] = "";
+    if (E.doc->matches.q.needle && E.doc->matches.q.error)
+        snprintf(count, sizeof(count), " [invalid regex: %s]", E.doc->matches.q.error);
+    else if (E.doc->matches.q.needle && !E.doc->matches.complete)
+        snprintf(count, sizeof(count), " [over %d matches]", SEARCH_CACHE_MAX);
+    else if (E.doc->matches.q.needle && E.doc->matches.count == 0)
+        snprintf(count, sizeof(count), " [no matches]");
+    else if (E.doc->matches.q.needle)
+        snprintf(count, sizeof(count), " [match %d of %d]", E.doc->matches.current + 1, E.doc->matches.count);
+
+    snprintf(findPrompt, sizeof(findPrompt), FIND_TEXT, findLabel, modes, count);
+}
+
+void find(void)
+{
+    int scy = E.cy; // Save current cursor position
+    int scx = E.cx;
+    int sco = E.coloff;
+    int sro = E.rowoff;
+
+    clearMatchIndex(E.doc);
+    E.doc->matches.origin_row = E.cy;
+    E.doc->matches.origin_col = E.cx - (int)log10(E.doc->numrows) - 2;
+    updateFindPrompt();
+    clearSearchCache(E.doc); // Candidates are only valid while the prompt is open
+    char *query = askPrompt(findPrompt, search);
+    clearSearchCache(E.doc);
+
+    if (query)
+    {
+        if (E.doc->matches.complete && E.doc->matches.count > 0)
+            setStatusMessage("Match %d of %d", E.doc->matches.current + 1, E.doc->matches.count);
+        free(query);
+    }
+    else
+    {
+        // If search was cancelled, restore cursor position
+        E.cy = scy;
+        E.cx = scx;
+        E.coloff = sco;
+        E.rowoff = sro;
+    }
+}
+
+/** REPLACE **/
+
+void replace(void)
+{
+    // Pick a query with the find prompt, then replace its matches one by one or all at once
+    int scy = E.cy;
+    int scx = E.cx;
+    int sco = E.coloff;
+    int sro = E.rowoff;
+
+    clearMatchIndex(E.doc);
+    E.doc->matches.origin_row = E.cy;
+    E.doc->matches.origin_col = E.cx - (int)log10(E.doc->numrows) - 2;
+    findLabel = "Replace";
+    updateFindPrompt();
+    clearSearchCache(E.doc);
+    char *query = askPrompt(findPrompt, search);
+    clearSearchCache(E.doc);
+    findLabel = "Search";
+
+    char *with = query ? readPrompt("Replace with: %s (ESC to cancel)", NULL, 1) : NULL;
+    if (with == NULL)
+    {
+        clearMatchIndex(E.doc);
+        free(query);
+        E.cy = scy;
+        E.cx = scx;
+        E.coloff = sco;
+        E.rowoff = sro;
+        return;
+    }
+
+    struct searchQuery q;
+    compileQuery(&q, query, E.search_flags);
+    free(query);
+    clearMatchIndex(E.doc); // Rows are rescanned as they change, the prompt below doesn't need it
+
+    // Walk matches from where find started to the end, then wrap around to it
+    int wlen = strlen(with);
+    int sr = E.doc->matches.origin_row;
+    int sc = E.doc->matches.origin_col;
+    int r = sr, c = sc;
+    int wrapped = 0;
+    long replaced = 0;
+    while (q.len > 0)
+    {
+        int at = -1;
+        int mlen = 0;
+        while (1)
+        {
+            if (!wrapped && r >= E.doc->numrows)
+            {
+                wrapped = 1;
+                r = 0;
+                c = 0;
+            }
+            if (wrapped && r > sr)
+                break;
+            if (r < E.doc->numrows)
+                at = findMatch(&q, E.doc->row[r].chars, E.doc->row[r].size, c, &mlen);
+            if (at != -1 && wrapped && r == sr && at >= sc)
+                at = -1; // Back where the replacing started
+            if (at != -1 || (wrapped && r == sr))
+                break;
+            r++;
+            c = 0;
+        }
+        if (at == -1)
+            break;
+
+        int offset = log10(E.doc->numrows) + 2;
+        E.cy = r;
+        E.cx = at + mlen + offset;
+        E.sel_active = 1;
+        E.sel_start_cy = E.sel_end_cy = r;
+        E.sel_start_cx = at;
+        E.sel_end_cx = at + mlen;
+        setStatusMessage("Replace this match? (y: Yes | n: No | a: All remaining | ESC: Stop)");
+        refreshScreen();
+        int key = readKey();
+        clearSelection();
+
+        if (key == 'y' || key == 'Y')
+        {
+            char *old = NULL;
+            int oldsize = E.doc->row[r].size;
+            replaced += rewriteRow(&q, &E.doc->row[r], at, at + 1, with, wlen, &old);
+            if (old)
+                recordRewrite(E.doc, r, old, oldsize);
+            free(old);
+            renderRowSyntax(E.doc, &E.doc->row[r]);
+            indexRowChanged(E.doc, r);
+            trigramRowChanged(&E.doc->trigrams, r, E.doc->row[r].chars, E.doc->row[r].size);
+            E.doc->dirty++;
+            if (wrapped && r == sr)
+                sc += wlen - mlen; // The stopping point moved with the text before it
+            c = at + wlen;
+            E.cx = c + offset;
+        }
+        else if (key == 'n' || key == 'N')
+        {
+            c = at + mlen;
+        }
+        else if (key == 'a' || key == 'A')
+        {
+            if (wrapped)
+            {
+                replaced += replaceMatches(E.doc, &q, with, r, at, sr, sc);
+            }
+            else
+            {
+                replaced += replaceMatches(E.doc, &q, with, r, at, E.doc->numrows, 0);
+                replaced += replaceMatches(E.doc, &q, with, 0, 0, sr, sc);
+            }
+            break;
+        }
+        else if (key == '\x1b' || key == 'q')
+        {
+            break;
+        }
+    }
+
+    freeQuery(&q);
+    free(with);
+    setStatusMessage("Replaced %ld occurrence%s", replaced, replaced == 1 ? "" : "s");
+}
+
+/** PROJECT SEARCH **/
+
+void projectSearch(void)
+{
+    // Search every file under a directory and list the matching lines in a new buffer
+    char *dir = readPrompt("Search in directory: %s (Enter for current | ESC to cancel)", NULL, 1);
+    if (dir == NULL)
+        return;
+    char *query = askPrompt("Search files for: %s (ESC to cancel)", NULL);
+    if (query == NULL)
+    {
+        free(dir);
+        return;
+    }
+
+    struct searchQuery q;
+    if (compileQuery(&q, query, E.search_flags) == -1)
+    {
+        setStatusMessage("Invalid regex: %s", q.error);
+        freeQuery(&q);
+        free(query);
+        free(dir);
+        return;
+    }
+
+    setStatusMessage("Listing files in %s...", dir[0] ? dir : ".");
+    refreshScreen();
+    struct grepTree tree;
+    grepWalk(&tree, dir[0] ? dir : ".");
+
+    freshBuffer();
+    E.buffers[E.current].results = 1;
+
+    // Results are added a batch of files at a time, so they show up while the rest are searched
+    long hits = 0;
+    long bytes = 0;
+    int files = 0;
+    int done = 0;
+    struct grepJob job;
+    job.q = &q;
+    job.tree = &tree;
+    job.results = malloc(sizeof(struct grepResult) * GREP_BATCH);
+    while (done < tree.nfiles)
+    {
+        job.first = done;
+        job.count = (tree.nfiles - done < GREP_BATCH) ? tree.nfiles - done : GREP_BATCH;
+        job.nparts = (job.count < poolSize() * 4) ? job.count : poolSize() * 4;
+        poolRun(grepPart, &job, job.nparts);
+
+        for (int i = 0; i < job.count; i++)
+        {
+            struct grepResult *res = &job.results[i];
+            char *p = res->out;
+            char *end = res->out + res->len;
+            while (p < end)
+            {
+                char *nl = memchr(p, '\n', end - p);
+                insertRow(E.doc, E.doc->numrows, p, nl - p);
+                p = nl + 1;
+            }
+            hits += res->hits;
+            bytes += res->bytes;
+            files += (res->hits > 0);
+            free(res->out);
+        }
+        done += job.count;
+        if (E.doc->numrows)
+            E.cx = log10(E.doc->numrows) + 2; // Keep the cursor clear of the line numbers as they widen
+
+        setStatusMessage("Searched %d of %d files, %ld matches (ESC to stop)", done, tree.nfiles, hits);
+        refreshScreen();
+        struct pollfd in = {STDIN_FILENO, POLLIN, 0};
+        if (!E.unread && poll(&in, 1, 0) > 0)
+        {
+            // Other keys are left for the main loop, which records them too
+            int c = readTerminalKey();
+            if (c == '\x1b')
+                break;
+            E.unread = (c == SKIP_KEY) ? 0 : c;
+        }
+    }
+
+    setStatusMessage("%ld matches in %d of %d files (%.1f MB searched) | Enter: Open result",
+                     hits, files, done, bytes / 1048576.0);
+    E.doc->dirty = 0;
+    free(job.results);
+    grepFreeTree(&tree);
+    freeQuery(&q);
+    free(query);
+    free(dir);
+}
+
+int openResult(void)
+{
+    // Open the file of the "path:line:col: text" result under the cursor at the match.
+    // Returns 0 if the row isn't a result.
+    if (E.cy >= E.doc->numrows)
+        return 0;
+    char *s = E.doc->row[E.cy].chars;
+    char *end = NULL;
+    long line = 0, col = 0;
+    for (char *p = strchr(s, ':'); p && !end; p = strchr(p + 1, ':'))
+    {
+        char *q = p + 1;
+        if (!isdigit((unsigned char)*q))
+            continue;
+        line = strtol(q, &q, 10);
+        if (*q != ':' || !isdigit((unsigned char)q[1]))
+            continue;
+        col = strtol(q + 1, &q, 10);
+        if (*q == ':')
+            end = p;
+    }
+    if (!end)
+        return 0;
+
+    char *path = strndup(s, end - s);
+    if (access(path, R_OK) == -1)
+    {
+        setStatusMessage("Can't open %s: %s", path, strerror(errno));
+        free(path);
+        return 1;
+    }
+    int opened = openBuffer(path); // The results stay in their buffer, Ctrl-B goes back to them
+    free(path);
+    if (opened == -1)
+        return 1;
+
+    if (line > E.doc->numrows)
+        line = E.doc->numrows;
+    E.cy = line > 0 ? line - 1 : 0;
+    if (E.cy < E.doc->numrows && col - 1 > E.doc->row[E.cy].size)
+        col = E.doc->row[E.cy].size + 1;
+    E.cx = (col > 0 ? col - 1 : 0) + log10(E.doc->numrows) + 2;
+    setStatusMessage("%s:%ld", E.doc->filename, line);
+    return 1;
+}
+
+/* APPEND BUFFER */
+
+void abAppend(struct abuf *ab, const char *s, int len)
+{
+    // Append a string to the append buffer
+    char *new = realloc(ab->b, ab->len + len);
+
+    if (new == NULL)
+        return;
+    memcpy(&new[ab->len], s, len);
+    ab->b = new;
+    ab->len += len;
+}
+
+void abFree(struct abuf *ab)
+{
+    // Free the memory allocated for the append buffer
+    free(ab->b);
+}
+
+/* PROFILER */
+
+static const char *profileNames[PROFILE_STAGES] = {"decode", "edit", "highlight", "build", "write", "total"};
+
+void profileKey(void)
+{
+    // A key was read, time from its first byte starts unless an earlier key is still
+    // waiting to be drawn, then both show up in one frame
+    struct profiler *p = &E.profile;
+    long long now = monotonicNs();
+    if (!p->pending)
+    {
+        p->pending = 1;
+        p->start = p->key_at;
+        memset(p->spent, 0, sizeof(p->spent));
+    }
+    p->spent[PROFILE_DECODE] += now - p->key_at;
+    p->mark = now;
+    p->hl_mark = p->hl_ns;
+}
+
+void profileSplit(int stage)
+{
+    // End a part of the keys not drawn yet, lexing done meanwhile is counted apart
+    struct profiler *p = &E.profile;
+    if (!p->pending)
+        return;
+    long long now = monotonicNs();
+    long long lexing = p->hl_ns - p->hl_mark;
+    p->spent[stage] += now - p->mark - lexing;
+    p->spent[PROFILE_HIGHLIGHT] += lexing;
+    p->mark = now;
+    p->hl_mark = p->hl_ns;
+    if (stage != PROFILE_WRITE)
+        return;
+
+    // Written, so the keys are on screen
+    for (int i = 0; i < PROFILE_TOTAL; i++)
+        histRecord(&p->stages[i], p->spent[i]);
+    histRecord(&p->stages[PROFILE_TOTAL], now - p->start);
+    p->pending = 0;
+}
+
+void drawProfile(struct abuf *ab)
+{
+    // Percentiles of every part in a box at the top right, in microseconds
+    struct profiler *p = &E.profile;
+    const int width = 46;
+    if (!p->overlay || E.termcols < width)
+        return;
+    char line[128];
+    int n = snprintf(line, sizeof(line), "\x1b[1;%dH\x1b[7m %-13s %9s %9s %9s ", E.termcols - width + 1,
+                     "us per key", "p50", "p99", "max");
+    abAppend(ab, line, n);
+    for (int i = 0; i < PROFILE_STAGES; i++)
+    {
+        struct histogram *h = &p->stages[i];
+        n = snprintf(line, sizeof(line), "\x1b[%d;%dH %-13s %9.1f %9.1f %9.1f ", i + 2, E.termcols - width + 1,
+                     profileNames[i], histPercentile(h, 50) / 1e3, histPercentile(h, 99) / 1e3, h->max / 1e3);
+        abAppend(ab, line, n);
+    }
+    n = snprintf(line, sizeof(line), "\x1b[%d;%dH %-44s", PROFILE_STAGES + 2, E.termcols - width + 1, "");
+    n += snprintf(&line[n], sizeof(line) - n, "\x1b[%d;%dH %llu keys drawn", PROFILE_STAGES + 2,
+                  E.termcols - width + 1, (unsigned long long)p->stages[PROFILE_TOTAL].count);
+    abAppend(ab, line, n);
+    abAppend(ab, "\x1b[m", 3);
+}
+
+void toggleProfile(void)
+{
+    E.profile.overlay = !E.profile.overlay;
+    setStatusMessage(E.profile.overlay ? "Showing keypress to paint latency (Ctrl-Q hides it)" : "");
+}
+
+void dumpProfile(void)
+{
+    // Write the percentiles and the non-empty buckets of every part to the file given
+    // with --profile, for when the editor exits
+    struct profiler *p = &E.profile;
+    FILE *fp = p->dump ? fopen(p->dump, "w") : NULL;
+    if (!fp)
+        return;
+    fprintf(fp, "# qtedit keypress to paint latency, microseconds\n");
+    fprintf(fp, "# stage count min p50 p90 p99 p99.9 max mean\n");
+    for (int i = 0; i < PROFILE_STAGES; i++)
+    {
+        struct histogram *h = &p->stages[i];
+        fprintf(fp, "%s %llu %.3f %.3f %.3f %.3f %.3f %.3f %.3f\n", profileNames[i], (unsigned long long)h->count,
+                h->min / 1e3, histPercentile(h, 50) / 1e3, histPercentile(h, 90) / 1e3, histPercentile(h, 99) / 1e3,
+                histPercentile(h, 99.9) / 1e3, h->max / 1e3, h->count ? (double)h->sum / h->count / 1e3 : 0.0);
+    }
+    fprintf(fp, "# bucket stage lowest_ns count\n");
+    for (int i = 0; i < PROFILE_STAGES; i++)
+        for (int b = 0; b < HIST_BUCKETS; b++)
+            if (p->stages[i].counts[b])
+                fprintf(fp, "bucket %s %llu %llu\n", profileNames[i], (unsigned long long)histLowest(b),
+                        (unsigned long long)p->stages[i].counts[b]);
+    fclose(fp);
+}
+
+/* TERMINAL */
+
+/** CONFIG **/
+
+void die(char *s)
+{
+    resetScreen();
+    perror(s);
+    exit(1);
+}
+
+void resetScreen(void)
+{
+    if (E.headless)
+        return;
+    write(STDOUT_FILENO, "\x1b[2J", 4);
+    write(STDOUT_FILENO, "\x1b[H", 3);
+}
+
+void disableRawMode(void)
+{
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
+        die("tcsetattr");
+}
+
+void enableRawMode(void)
+{
+    if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1)
+        die("tcgetattr");
+    atexit(disableRawMode);
+
+    struct termios raw = E.orig_termios;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_oflag &= ~(OPOST);
+    raw.c_cflag |= (CS8);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 1;
+
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
+        die("tcsetattr");
+}
+
+/** INPUT **/
+
+void idleIndex(void)
+{
+    // Build the trigram index a slice at a time while no key is waiting,
+    // so a large file can be edited right away while it gets indexed
+    if (!E.doc->trigrams.building)
+        return;
+    struct pollfd in = {STDIN_FILENO, POLLIN, 0};
+    while (poll(&in, 1, 0) == 0)
+    {
+        if (!trigramBuildStep(&E.doc->trigrams, E.doc->row, E.doc->numrows, TRIGRAM_STEP_BYTES))
+        {
+            setStatusMessage("Indexed %d rows in %d blocks (%.1f MB)", E.doc->trigrams.rows, E.doc->trigrams.nblocks,
+                             trigramMemory(&E.doc->trigrams) / 1048576.0);
+            refreshScreen();
+            return;
+        }
+    }
+}
+
+int readTerminalKey(void)
+{
+    int nread;
+    char c;
+    idleIndex();
+    while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
+    {
+        checkFiles();
+        checkJournals();
+        int rows, cols;
+        if (getWindowSize(&rows, &cols) == 0 && (rows - 1 != E.termrows || cols != E.termcols))
+        {
+            resizeWindows(rows - 1, cols); // The status line is below the windows
+            return SKIP_KEY;
+        }
+
+        if (nread == -1 && errno != EAGAIN)
+            die("read");
+    }
+    E.profile.key_at = monotonicNs(); // Decoding starts, see profileKey
+
+    if (c == '\x1b') // Escape sequence
+    {
+        char seq[3];
+
+        if (read(STDIN_FILENO, &seq[0], 1) != 1)
+            return '\x1b';
+        if (read(STDIN_FILENO, &seq[1], 1) != 1)
+            return '\x1b';
+
+        if (seq[0] == '[') // Starts with '['
+        {
+            if (seq[1] >= '0' && seq[1] <= '9') // Possibly 3+ long sequences
+            {
+                if (read(STDIN_FILENO, &seq[2], 1) != 1)
+                    return '\x1b';
+
+                if (seq[2] == '~') // Ends with '~'
+                {
+                    switch (seq[1])
+                    {
+                    case '1':
+                        return HOME_KEY;
+                    case '3':
+                        return DELETE_KEY;
+                    case '4':
+                        return END_KEY;
+                    case '5':
+                        return PAGE_UP;
+                    case '6':
+                        return PAGE_DOWN;
+                    case '7':
+                        return HOME_KEY;
+                    case '8':
+                        return END_KEY;
+                    }
+                }
+                else if (seq[1] == '1' && seq[2] == ';') // Extended sequences like ESC[1;2A
+                {
+                    char modifier;
+                    char direction;
+                    if (read(STDIN_FILENO, &modifier, 1) != 1)
+                        return '\x1b';
+                    if (read(STDIN_FILENO, &direction, 1) != 1)
+                        return '\x1b';
+
+                    // Check for Shift modifier (2) and handle direction
+                    if (modifier == '2') // Shift modifier
+                    {
+                        switch (direction)
+                        {
+                        case 'A':
+                            return SHIFT_ARROW_UP;
+                        case 'B':
+                            return SHIFT_ARROW_DOWN;
+                        case 'C':
+                            return SHIFT_ARROW_RIGHT;
+                        case 'D':
+                            return SHIFT_ARROW_LEFT;
+                        default:
+                            return '\x1b';
+                        }
+                    }
+                    else // Other modifiers - just handle as normal arrows
+                    {
+                        switch (direction)
+                        {
+                        case 'A':
+                            return ARROW_UP;
+                        case 'B':
+                            return ARROW_DOWN;
+                        case 'C':
+                            return ARROW_RIGHT;
+                        case 'D':
+                            return ARROW_LEFT;
+                        default:
+                            return '\x1b';
+                        }
+                    }
+                }
+            }
+            else // 2 long sequences
+            {
+                switch (seq[1])
+                {
+                case 'A':
+                    return ARROW_UP;
+                case 'B':
+                    return ARROW_DOWN;
+                case 'C':
+                    return ARROW_RIGHT;
+                case 'D':
+                    return ARROW_LEFT;
+                case 'H':
+                    return HOME_KEY;
+                case 'F':
+                    return END_KEY;
+                }
+            }
+        }
+        else if (seq[0] == 'O') // Starts with 'O'
+        {
+            switch (seq[1])
+            {
+            case 'H':
+                return HOME_KEY;
+            case 'F':
+                return END_KEY;
+            }
+        }
+        return '\x1b';
+    }
+
+    return c;
+}
+
+int getCursorPosition(int *rows, int *cols)
+{
+    // This function sends an escape sequence to the terminal to request the cursor position
+    // and reads the response to determine the current cursor position.
+    // The response is expected to be in the format: ESC [ rows ; cols R
+    char buf[32];
+    unsigned int i = 0;
+
+    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
+        return -1;
+
+    while (i < sizeof(buf) - 1)
+    {
+        if (read(STDIN_FILENO, &buf[i], 1) != 1)
+            break;
+        if (buf[i] == 'R')
+            break;
+        i++;
+    }
+    buf[i] = '\0';
+
+    if (buf[0] != '\x1b' || buf[1] != '[')
+        return -1;
+
+    if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
+        return -1;
+
+    return -0;
+}
+
+int getWindowSize(int *rows, int *cols)
+{
+    struct winsize ws;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+    {
+        // If ioctl fails, fallback to using escape sequences
+        if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
+            return -1;
+        return getCursorPosition(rows, cols);
+    }
+    *rows = ws.ws_row;
+    *cols = ws.ws_col;
+
+    return 0;
+}
+
+char *readPrompt(char *prompt, void (*callback)(char *, int), int allow_empty)
+{
+    size_t bufsize = 128;
+    char *buf = malloc(bufsize);
+
+    size_t buflen = 0;
+    buf[0] = '\0';
+
+    while (1)
+    {
+        setStatusMessage(prompt, buf);
+        refreshScreen();
+
+        int c = readKey();
+        if (c == DELETE_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
+        {
+            if (buflen != 0)
+                buf[--buflen] = '\0';
+        }
+        else if (c == '\x1b')
+        {
+            setStatusMessage("");
+            if (callback)
+                callback(buf, c);
+            free(buf);
+            return NULL;
+        }
+        else if (c == '\r')
+        { // Enter key
+            if (buflen > 0 || allow_empty)
+            {
+                setStatusMessage("");
+                if (callback)
+                    callback(buf, c);
+                return buf;
+            }
+        }
+        else if (!iscntrl(c) && c < 128)
+        {
+            if (buflen == bufsize - 1)
+            {
+                bufsize *= 2;
+                buf = realloc(buf, bufsize);
+            }
+            buf[buflen++] = c;
+            buf[buflen] = '\0';
+        }
+
+        if (callback)
+            callback(buf, c);
+    }
+}
+
+char *askPrompt(char *prompt, void (*callback)(char *, int))
+{
+    return readPrompt(prompt, callback, 0);
+}
+
+void gotoLine(void)
+{
+    // Function to go to a specific line in the text
+    int line = 0;
+    char *line_str = askPrompt("Goto line: %s (ESC to cancel)", NULL);
+    if (line_str)
+    {
+        line = atoi(line_str);
+        free(line_str);
+    }
+
+    if (line > 0 && line <= E.doc->numrows)
+    {
+        E.cy = line - 1;
+        E.cx = log10(E.doc->numrows) + 2;
+        scroll();
+    }
+}
+
+int readKey(void)
+{
+    // Next key, from the macro being replayed or else the terminal. Keys read while
+    // recording are kept, except the Ctrl-T that stops it.
+    if (E.macro.playing)
+        return (E.macro.pos < E.macro.len) ? E.macro.keys[E.macro.pos++] : '\x1b';
+
+    int c = E.unread ? E.unread : readTerminalKey();
+    E.unread = 0;
+    if (c != SKIP_KEY)
+        profileKey();
+    if (E.macro.recording && c != SKIP_KEY && c != CTRL_KEY('t'))
+    {
+        if (E.macro.len == E.macro.cap)
+        {
+            E.macro.cap = E.macro.cap ? E.macro.cap * 2 : 64;
+            E.macro.keys = realloc(E.macro.keys, sizeof(int) * E.macro.cap);
+        }
+        E.macro.keys[E.macro.len++] = c;
+    }
+    return c;
+}
+
+/** LOGIC **/
+
+void moveCursor(int key)
+{
+    int offset = log10(E.doc->numrows) + 2; // Offset for line numbers
+
+    erow *row = (E.cy >= E.doc->numrows) ? NULL : &E.doc->row[E.cy];
+
+    switch (key)
+    {
+    case ARROW_LEFT: // Move left
+        if (E.cx > offset)
+        {
+            E.cx--;
+        }
+        else if (E.cy > 0)
+        {
+            E.cy--;
+            E.cx = E.doc->row[E.cy].size + offset;
+        }
+        break;
+    case ARROW_RIGHT: // Move right
+        if (row && E.cx < row->size + offset)
+        {
+            E.cx++;
+        }
+        else if (row && E.cx == row->size + offset)
+        {
+            E.cy++;
+            E.cx = offset;
+            E.coloff = 0;
+        }
+        break;
+    case ARROW_DOWN: // Move down
+        if (E.cy < E.doc->numrows)
+            E.cy++;
+        break;
+    case ARROW_UP: // Move up
+        if (E.cy > 0)
+            E.cy--;
+        break;
+    }
+
+    row = (E.cy >= E.doc->numrows) ? NULL : &E.doc->row[E.cy];
+    int rowlen = row ? row->size : 0;
+    rowlen += offset;
+    if (E.cx > rowlen)
+        E.cx = rowlen;
+    if (E.cx < offset)
+        E.cx = offset;
+}
+
+void moveCursorWithSelection(int key)
+{
+    // Handle cursor movement with selection
+    if (!E.sel_active)
+    {
+        startSelection();
+    }
+
+    // Convert shift+arrow keys to regular arrow keys for movement
+    int movement_key;
+    switch (key)
+    {
+    case SHIFT_ARROW_LEFT:
+        movement_key = ARROW_LEFT;
+        break;
+    case SHIFT_ARROW_RIGHT:
+        movement_key = ARROW_RIGHT;
+        break;
+    case SHIFT_ARROW_UP:
+        movement_key = ARROW_UP;
+        break;
+    case SHIFT_ARROW_DOWN:
+        movement_key = ARROW_DOWN;
+        break;
+    default:
+        return; // Should not happen
+    }
+
+    moveCursor(movement_key);
+    updateSelection();
+}
+
+void processKeypress(void)
+{
+    static int quit_count = QUIT_PROT; // Counter for quitting when dirty
+
+    int c = readKey();
+
+    int offset = log10(E.doc->numrows) + 2; // Offset for line numbers
+
+    if (c != SKIP_KEY)
+    {
+        // Typing and deleting extend the last undo run, any other key ends it
+        if ((c < 32 || c > BACKSPACE) && c != DELETE_KEY)
+            undoSeal(&E.doc->undo);
+        if (!E.macro.playing) // A whole replay is undone at once
+            undoStartGroup(&E.doc->undo, E.cy, E.doc->numrows ? E.cx - offset : 0);
+        if (c != CTRL_KEY('p'))
+            E.kills.pasted = 0; // Only a paste right before can be cycled
+
+        // Extra cursors follow typing, deleting and moving, any other key drops them
+        int follows = (c >= 32 && c < BACKSPACE) || c == BACKSPACE || c == DELETE_KEY ||
+                      c == ARROW_LEFT || c == ARROW_RIGHT || c == ARROW_UP || c == ARROW_DOWN ||
+                      c == HOME_KEY || c == END_KEY || c == CTRL_KEY('n');
+        if (E.ncursors && !follows)
+            clearCursors();
+    }
+
+    switch (c)
+    {
+    case SKIP_KEY:
+        return;
+
+    case '\r':
+        if (E.buffers[E.current].results && !E.sel_active && openResult())
+            break;
+        if (E.sel_active)
+        {
+            deleteSelection();
+        }
+        insertNewline();
+        break;
+
+    case CTRL_KEY('x'): // Exit on Ctrl-X
+        if (anyDirty() && --quit_count > 0)
+        {
+            setStatusMessage(QUIT_TEXT, quit_count, quit_count == 1 ? "" : "s");
+            return;
+        }
+        closeJournals();
+        resetScreen();
+        exit(0);
+        break;
+
+    case CTRL_KEY('s'): // Save on Ctrl-S
+        esave();
+        break;
+
+    case CTRL_KEY('g'): // Goto line on Ctrl-G
+        gotoLine();
+        break;
+
+    case CTRL_KEY('u'): // Memory report on Ctrl-U
+        showMemory();
+        break;
+
+    case CTRL_KEY('q'): // Latency overlay on Ctrl-Q
+        toggleProfile();
+        break;
+
+    case CTRL_KEY('h'): // Help on Ctrl-H
+        setStatusMessage(GUIDE_TEXT);
+        break;
+
+    case CTRL_KEY('k'):
+        delCurRow();
+        break;
+
+    case CTRL_KEY('o'): // Open a file into a new buffer on Ctrl-O
+        openFile();
+        break;
+
+    case CTRL_KEY('b'): // Switch buffers on Ctrl-B
+        listBuffers();
+        break;
+
+    case CTRL_KEY('e'): // Follow the file as it grows on Ctrl-E
+        toggleFollow();
+        break;
+
+    case CTRL_KEY('w'): // Split, switch or close windows on Ctrl-W and a letter
+        windowCommand();
+        break;
+
+    case CTRL_KEY('n'): // Add a cursor below on Ctrl-N
+        addCursorBelow();
+        break;
+
+    case CTRL_KEY('t'): // Start or stop recording a macro on Ctrl-T
+        toggleRecording();
+        break;
+
+    case CTRL_KEY('a'): // Replay the macro on Ctrl-A
+        replayMacro();
+        break;
+
+    case CTRL_KEY('c'): // Copy on Ctrl-C
+        copySelection();
+        break;
+
+    case CTRL_KEY('v'): // Paste on Ctrl-V
+        pasteFromClipboard();
+        break;
+
+    case CTRL_KEY('p'): // Swap the paste for an older copy on Ctrl-P
+        cyclePaste();
+        break;
+
+    case CTRL_KEY('z'): // Undo on Ctrl-Z
+        undo();
+        break;
+
+    case CTRL_KEY('y'): // Redo on Ctrl-Y
+        redo();
+        break;
+
+    case HOME_KEY: // Return to start of line on HOME
+        if (E.ncursors)
+        {
+            moveCursors(c);
+            break;
+        }
+        E.cx = offset;
+        break;
+    case END_KEY: // Skip to end of line on END
+        if (E.ncursors)
+        {
+            moveCursors(c);
+            break;
+        }
+        if (E.cy < E.doc->numrows)
+        {
+            E.cx = E.doc->row[E.cy].size;
+        }
+        break;
+
+    case CTRL_KEY('f'): // Find on Ctrl-F
+        find();
+        break;
+
+    case CTRL_KEY('r'): // Replace on Ctrl-R
+        replace();
+        break;
+
+    case CTRL_KEY('d'): // Search a directory on Ctrl-D
+        projectSearch();
+        break;
+
+    case BACKSPACE:
+    case DELETE_KEY:
+        if (E.ncursors)
+        {
+            editCursors(c);
+        }
+        else if (E.sel_active)
+        {
+            deleteSelection();
+        }
+        else
+        {
+            if (c == DELETE_KEY)
+                moveCursor(ARROW_RIGHT); // Move right if DELETE is pressed
+            deleteChar();
+        }
+        break;
+
+    case PAGE_UP: // Go to top/bottom of file on PAGE_UP/PAGE_DOWN
+    case PAGE_DOWN:
+    {
+        if (c == PAGE_UP)
+        {
+            E.cy = E.rowoff;
+        }
+        else
+        {
+            E.cy = E.rowoff + E.screenrows + 1;
+            if (E.cy > E.doc->numrows)
+                E.cy = E.doc->numrows;
+        }
+
+        int t = E.screenrows;
+        while (t--)
+            moveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+    }
+    break;
+
+    case ARROW_LEFT:      // Move left
+    case ARROW_RIGHT:     // Move right
+    case ARROW_DOWN:      // Move down
+    case ARROW_UP:        // Move up
+        clearSelection(); // Clear selection on normal movement
+        if (E.ncursors)
+            moveCursors(c);
+        else
+            moveCursor(c);
+        break;
+
+    case SHIFT_ARROW_LEFT:  // Move left with selection
+    case SHIFT_ARROW_RIGHT: // Move right with selection
+    case SHIFT_ARROW_DOWN:  // Move down with selection
+    case SHIFT_ARROW_UP:    // Move up with selection
+        moveCursorWithSelection(c);
+        break;
+
+    case CTRL_KEY('l'):
+    case '\x1b':
+        break;
+
+    default:
+        if (iscntrl(c) || c >= 127)
+        {
+            break;
+        }
+        if (E.ncursors)
+        {
+            editCursors(c);
+            break;
+        }
+        if (E.sel_active)
+        {
+            deleteSelection();
+        }
+        insertChar(c); // Insert character
+        break;
+    }
+
+    quit_count = QUIT_PROT; // Reset quit count after any keypress
+}
+
+/** OUTPUT **/
+
+void scroll(void)
+{
+    int offset = log10(E.doc->numrows) + 2; // Offset for line numbers
+
+    // Calculates scroll based on cursor position and text content
+    E.rx = E.cy < E.doc->numrows ? getCursorRx(&E.doc->row[E.cy], E.cx) : offset; // Past the end is column 0
+
+    if (E.cy < E.rowoff)
+    {
+        E.rowoff = E.cy;
+    }
+    if (E.cy >= E.rowoff + E.screenrows)
+    {
+        E.rowoff = E.cy - E.screenrows + 1;
+    }
+    if (E.rx - offset < E.coloff)
+    {
+        E.coloff = E.rx - offset;
+    }
+    if (E.rx >= E.coloff + E.screencols)
+    {
+        E.coloff = E.rx - E.screencols + 1;
+    }
+}
+
+void drawSegment(struct abuf *ab, char *s, int len, int color, int *cc)
+{
+    // Appends a span of rendered text that shares one color
+    if (color != *cc)
+    {
+        if (*cc != -1)
+        {
+            abAppend(ab, "\x1b[39m", 5); // Reset foreground
+            if (*cc == syntaxToColor(HL_SELECTION))
+            {
+                abAppend(ab, "\x1b[49m", 5); // Reset background
+            }
+        }
+        *cc = color;
+        if (color != -1)
+        {
+            char buf[16];
+            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+            abAppend(ab, buf, clen);
+        }
+    }
+
+    int from = 0;
+    for (int j = 0; j < len; j++)
+    {
+        if (!iscntrl(s[j]))
+            continue;
+
+        // Control characters are shown inverted, so flush the plain text before them
+        abAppend(ab, &s[from], j - from);
+        char sym = (s[j] <= 26) ? '@' + s[j] : '?';
+        abAppend(ab, "\x1b[7m", 4);
+        abAppend(ab, &sym, 1);
+        abAppend(ab, "\x1b[m", 3);
+        if (*cc != -1)
+        {
+            char buf[16];
+            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", *cc);
+            abAppend(ab, buf, clen);
+        }
+        from = j + 1;
+    }
+    abAppend(ab, &s[from], len - from);
+}
+
+void drawRows(struct abuf *ab, struct window *w, int active)
+{
+    // Calculates the rows visible in a window and appends them to the buffer, each
+    // placed at the window's column. The selection only shows in the active window.
+    int y;
+    for (y = 0; y < E.screenrows; y++)
+    {
+        char pos[32];
+        abAppend(ab, pos, snprintf(pos, sizeof(pos), "\x1b[%d;%dH", w->top + y + 1, w->left + 1));
+        int width; // Cells drawn so far
+
+        int filerow = y + E.rowoff;
+        if (filerow >= E.doc->numrows)
+        {
+            width = 1;
+            if (E.doc->numrows == 0 && y == E.screenrows / 3)
+            {
+                char welcome[80];
+                int welcomelen = snprintf(welcome, sizeof(welcome),
+                                          "QTEdit -- version %s", VERSION);
+                if (welcomelen > E.screencols)
+                    welcomelen = E.screencols;
+                int padding = (E.screencols - welcomelen) / 2;
+                width = padding + welcomelen;
+                if (padding)
+                {
+                    abAppend(ab, "~", 1);
+                    padding--;
+                }
+                while (padding--)
+                    abAppend(ab, " ", 1);
+                abAppend(ab, welcome, welcomelen);
+            }
+            else
+            {
+                abAppend(ab, "~", 1);
+            }
+        }
+        else
+        {
+            // Start the row with line numbers
+            int maxlen = log10(E.doc->numrows) + 2;
+            char starttext[16]; // Any int and the space after it
+            int nlen = snprintf(starttext, sizeof(starttext), "%d ", filerow + 1);
+            char *start = malloc(maxlen + 1);
+            char *sp = start;
+            for (int i = 0; i < maxlen; i++)
+            {
+                if (i < nlen)
+                    *sp++ = starttext[i];
+                else
+                    *sp++ = ' ';
+            }
+            abAppend(ab, start, maxlen);
+            free(start);
+
+            // Append the actual content of the row, one highlight run at a time
+            erow *row = &E.doc->row[filerow];
+            int len = row->rsize - E.coloff;
+            if (len < 0)
+                len = 0;
+            if (len > E.screencols - maxlen)
+                len = E.screencols - maxlen;
+            int end = E.coloff + len;
+            width = maxlen + (len > 0 ? len : 0);
+
+            int sel_lo, sel_hi;
+            int has_sel = active && selectionSpan(filerow, &sel_lo, &sel_hi);
+
+            highlightLazy(E.doc, row);
+            int r = 0; // First run that ends past the visible start
+            while (r < row->hlsize && row->hl[r].start + (int)row->hl[r].len <= E.coloff)
+                r++;
+
+            int cc = -1; // Current color
+            int j = E.coloff;
+            while (j < end)
+            {
+                int type = HL_NORMAL;
+                int next = end;
+                if (r < row->hlsize && row->hl[r].start <= j)
+                {
+                    type = row->hl[r].type;
+                    next = row->hl[r].start + row->hl[r].len;
+                }
+                else if (r < row->hlsize)
+                {
+                    next = row->hl[r].start;
+                }
+                if (next > end)
+                    next = end;
+
+                int color = (type == HL_NORMAL) ? -1 : syntaxToColor(type);
+                if (has_sel)
+                {
+                    // Selection overrides syntax colors, so split segments at its edges
+                    if (j >= sel_lo && j < sel_hi)
+                    {
+                        color = syntaxToColor(HL_SELECTION);
+                        if (next > sel_hi)
+                            next = sel_hi;
+                    }
+                    else if (j < sel_lo && next > sel_lo)
+                    {
+                        next = sel_lo;
+                    }
+                }
+
+                drawSegment(ab, &row->render[j], next - j, color, &cc);
+                j = next;
+                if (r < row->hlsize && j >= row->hl[r].start + (int)row->hl[r].len)
+                    r++;
+            }
+            abAppend(ab, "\x1b[39m", 5); // Reset foreground color
+            abAppend(ab, "\x1b[49m", 5); // Reset background color
+        }
+
+        if (w->left + w->cols < E.termcols)
+        {
+            // Clearing the line would wipe the window to the right, pad up to the divider
+            for (; width < E.screencols; width++)
+                abAppend(ab, " ", 1);
+            abAppend(ab, "\x1b[7m \x1b[m", 8);
+        }
+        else
+        {
+            abAppend(ab, "\x1b[K", 3); // End the line
+        }
+    }
+}
+
+void drawBar(struct abuf *ab, struct window *w, int active)
+{
+    // Appends a window's info bar to the buffer, in bold for the active one when split
+    char pos[32];
+    abAppend(ab, pos, snprintf(pos, sizeof(pos), "\x1b[%d;%dH", w->top + w->rows, w->left + 1));
+    if (active && E.nwindows > 1)
+        abAppend(ab, "\x1b[1;7m", 6);
+    else
+        abAppend(ab, "\x1b[7m", 4);
+    char status[80], rstatus[80], bufno[32] = "";
+    if (E.nbuffers > 1)
+        snprintf(bufno, sizeof(bufno), "[%d/%d] ", E.current + 1, E.nbuffers);
+    int len = snprintf(status, sizeof(status), "%s%.20s - %d lines %s", bufno,
+                       E.doc->filename ? E.doc->filename : "[No Name]", E.doc->numrows,
+                       E.doc->dirty ? "(modified)" : "");
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s | %d/%d", E.buffers[E.current].follow ? "follow | " : "",
+                        E.doc->syntax ? E.doc->syntax->filetype : "no ft", E.cy + 1, E.doc->numrows);
+    if (len > w->cols)
+        len = w->cols;
+    abAppend(ab, status, len);
+    while (len < w->cols)
+    {
+        if (w->cols - len == rlen)
+        {
+            abAppend(ab, rstatus, rlen);
+            break;
+        }
+        else
+        {
+            abAppend(ab, " ", 1);
+            len++;
+        }
+    }
+    abAppend(ab, "\x1b[m", 3);
+}
+
+void drawStatus(struct abuf *ab)
+{
+    char pos[32];
+    abAppend(ab, pos, snprintf(pos, sizeof(pos), "\x1b[%d;1H\x1b[K", E.termrows + 1));
+    int len = strlen(E.status);
+    if (len > E.termcols)
+        len = E.termcols;
+    if (len && time(NULL) - E.statustime < 5)
+        abAppend(ab, E.status, len);
+}
+
+void refreshScreen(void)
+{
+    if (E.macro.playing)
+        return; // Drawn once the replay is over
+
+    profileSplit(PROFILE_EDIT);
+    struct abuf ab = ABUF_INIT; // Initialize the append buffer
+
+    abAppend(&ab, "\x1b[?25l", 6); // Hide cursor
+
+    // Other windows are drawn from their own view loaded into E, windows showing the
+    // same buffer read the same rendered rows
+    int active = E.active;
+    saveWindow();
+    for (int i = 0; i < E.nwindows; i++)
+    {
+        if (i == active)
+            continue;
+        loadWindow(i);
+        scroll();
+        drawRows(&ab, &E.windows[i], 0);
+        drawBar(&ab, &E.windows[i], 0);
+        saveWindow();
+    }
+    loadWindow(active);
+
+    struct window *w = &E.windows[active];
+    scroll();
+    drawRows(&ab, w, 1);    // Draw the rows
+    drawBar(&ab, w, 1);     // Draw the info bar
+    drawStatus(&ab);  // Draw status message
+    drawCursors(&ab); // Draw the extra cursors over the rows
+    drawProfile(&ab); // Draw the latency overlay, if it is on
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", w->top + (E.cy - E.rowoff) + 1, w->left + (E.rx - E.coloff) + 1);
+    abAppend(&ab, buf, strlen(buf)); // Move cursor to the current position
+
+    abAppend(&ab, "\x1b[?25h", 6); // Show cursor
+
+    profileSplit(PROFILE_BUILD);
+    if (write(STDOUT_FILENO, ab.b, ab.len) == -1)
+        die("write"); // Write the buffer to stdout
+    profileSplit(PROFILE_WRITE);
+    abFree(&ab);      // Free the buffer
+}
+
+void setStatusMessage(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(E.status, sizeof(E.status), fmt, ap);
+    va_end(ap);
+    E.statustime = time(NULL);
+}
+
+/** SYNTAX COLORS **/
+
+int syntaxToColor(int hl)
+{
+    // HL color assignments
+    switch (hl)
+    {
+    case HL_COMMENT:
+    case HL_MLCOMMENT:
+        return 32;
+    case HL_KEY1:
+        return 34;
+    case HL_KEY2:
+        return 35;
+    case HL_STRING:
+        return 91;
+    case HL_NUMBER:
+        return 92;
+    case HL_FUNC:
+        return 33;
+    case HL_VAR:
+        return 96;
+    case HL_MATCH:
+        return 93;
+    case HL_SELECTION:
+        return 47; // White background for selection
+    default:
+        return 37;
+    }
+}
+
+/* SELECTION */
+
+void clearSelection(void)
+{
+    // Clear current selection
+    E.sel_active = 0;
+    E.sel_start_cx = E.sel_start_cy = 0;
+    E.sel_end_cx = E.sel_end_cy = 0;
+}
+
+void startSelection(void)
+{
+    // Start a new selection at current cursor position
+    int offset = log10(E.doc->numrows) + 2;
+    E.sel_active = 1;
+    E.sel_start_cx = E.cx - offset;
+    E.sel_start_cy = E.cy;
+    E.sel_end_cx = E.cx - offset;
+    E.sel_end_cy = E.cy;
+}
+
+void updateSelection(void)
+{
+    // Update selection end to current cursor position
+    if (E.sel_active)
+    {
+        int offset = log10(E.doc->numrows) + 2;
+        E.sel_end_cx = E.cx - offset;
+        E.sel_end_cy = E.cy;
+    }
+}
+
+int selectionSpan(int row, int *lo, int *hi)
+{
+    // Get the columns [lo, hi) of a row covered by the current selection, 0 if none are
+    if (!E.sel_active)
+        return 0;
+
+    int start_row = E.sel_start_cy;
+    int start_col = E.sel_start_cx;
+    int end_row = E.sel_end_cy;
+    int end_col = E.sel_end_cx;
+
+    // Normalize selection so start is always before end
+    if (start_row > end_row || (start_row == end_row && start_col > end_col))
+    {
+        int temp_row = start_row;
+        int temp_col = start_col;
+        start_row = end_row;
+        start_col = end_col;
+        end_row = temp_row;
+        end_col = temp_col;
+    }
+
+    if (row < start_row || row > end_row)
+        return 0;
+    *lo = (row == start_row) ? start_col : 0;
+    *hi = (row == end_row) ? end_col : INT_MAX;
+    return *lo < *hi;
+}
+
+int isPositionSelected(int row, int col)
+{
+    // Check if a position is within the current selection
+    int lo, hi;
+    return selectionSpan(row, &lo, &hi) && col >= lo && col < hi;
+}
+
+int selectionBounds(int *r0, int *c0, int *r1, int *c1)
+{
+    // Get the selected text as the range from (r0, c0) up to (r1, c1), 0 if nothing is
+    // selected. Past the last row the selection ends at the end of the text.
+    if (!E.sel_active)
+        return 0;
+
+    int start_row = E.sel_start_cy;
+    int start_col = E.sel_start_cx;
+    int end_row = E.sel_end_cy;
+    int end_col = E.sel_end_cx;
+
+    // Normalize selection so start is always before end
+    if (start_row > end_row || (start_row == end_row && start_col > end_col))
+    {
+        int temp_row = start_row;
+        int temp_col = start_col;
+        start_row = end_row;
+        start_col = end_col;
+        end_row = temp_row;
+        end_col = temp_col;
+    }
+
+    if (end_row >= E.doc->numrows && E.doc->numrows > 0)
+    {
+        end_row = E.doc->numrows - 1;
+        end_col = E.doc->row[end_row].size;
+    }
+    *r0 = start_row;
+    *c0 = start_col;
+    *r1 = end_row;
+    *c1 = end_col;
+    return 1;
+}
+
+void deleteSelection(void)
+{
+    // Delete all text within the current selection, the row it starts on stays even
+    // if it is left empty
+    int start_row, start_col, end_row, end_col;
+    if (!selectionBounds(&start_row, &start_col, &end_row, &end_col))
+        return;
+
+    deleteRange(E.doc, start_row, start_col, end_row, end_col);
+    setCursor(start_row, start_col);
+    clearSelection();
+}
+
+void copyText(char *text, long len)
+{
+    // Put text, which the kill ring takes over, on the clipboard: the kill ring always,
+    // and the copy command if one is set or else the terminal's clipboard
+    killPush(&E.kills, text, len);
+    if (E.copy_cmd)
+    {
+        FILE *fp = popen(E.copy_cmd, "w");
+        if (!fp || fwrite(text, 1, len, fp) != (size_t)len)
+            setStatusMessage("Error: Could not run %s, text kept for pasting", E.copy_cmd);
+        else
+            setStatusMessage("Text copied to clipboard");
+        if (fp)
+            pclose(fp);
+    }
+    else if (len > OSC52_MAX)
+    {
+        setStatusMessage("Text copied, too large for the terminal clipboard (%ld bytes)", len);
+    }
+    else
+    {
+        osc52Copy(STDOUT_FILENO, text, len);
+        setStatusMessage("Text copied to clipboard");
+    }
+}
+
+void copySelection(void)
+{
+    // Copy selected text to the clipboard
+    int start_row, start_col, end_row, end_col;
+    if (!selectionBounds(&start_row, &start_col, &end_row, &end_col))
+        return;
+
+    long len;
+    char *text = rangeToString(E.doc, start_row, start_col, end_row, end_col, &len);
+    copyText(text, len);
+}
+
+char *readPasteCommand(long *len)
+{
+    // Read everything the paste command prints, NULL if it could not be run
+    FILE *fp = popen(E.paste_cmd, "r");
+    if (!fp)
+        return NULL;
+    *len = 0;
+    long cap = 4096;
+    char *text = malloc(cap);
+    size_t n;
+    while ((n = fread(&text[*len], 1, cap - *len, fp)) > 0)
+    {
+        *len += n;
+        if (*len == cap)
+        {
+            cap *= 2;
+            text = realloc(text, cap);
+        }
+    }
+    pclose(fp);
+    return text;
+}
+
+void pasteText(const char *text, long len)
+{
+    // Insert text at the cursor in one step, leaving the cursor after it
+    int offset = log10(E.doc->numrows) + 2;
+    int row = E.cy;
+    int col = (E.doc->numrows && E.cy < E.doc->numrows) ? E.cx - offset : 0;
+    int end_row, end_col;
+    textEnd(row, col, text, len, &end_row, &end_col);
+    insertText(E.doc, row, col, text, len);
+    setCursor(end_row, end_col);
+
+    E.kills.pasted = 1;
+    E.kills.paste_row = row;
+    E.kills.paste_col = col;
+    E.kills.end_row = end_row;
+    E.kills.end_col = end_col;
+}
+
+void pasteFromClipboard(void)
+{
+    // Delete selected text if any
+    if (E.sel_active)
+    {
+        deleteSelection();
+    }
+
+    if (E.paste_cmd)
+    {
+        // The command's output becomes the newest copy, carriage returns dropped
+        long len;
+        char *text = readPasteCommand(&len);
+        if (!text)
+        {
+            setStatusMessage("Error: Could not run %s", E.paste_cmd);
+            return;
+        }
+        long kept = 0;
+        for (long i = 0; i < len; i++)
+            if (text[i] != '\r')
+                text[kept++] = text[i];
+        if (kept == 0)
+            free(text);
+        else
+            killPush(&E.kills, text, kept);
+    }
+
+    long len;
+    const char *text = killGet(&E.kills, 0, &len);
+    if (!text || len == 0)
+    {
+        setStatusMessage("Clipboard is empty");
+        return;
+    }
+    E.kills.back = 0;
+    pasteText(text, len);
+    setStatusMessage("Text pasted from clipboard");
+}
+
+void cyclePaste(void)
+{
+    // Swap the text just pasted for the copy before it in the kill ring
+    if (!E.kills.pasted || E.kills.count < 2)
+    {
+        setStatusMessage(E.kills.pasted ? "No older copies" : "Ctrl-P cycles through copies right after a paste");
+        return;
+    }
+    deleteRange(E.doc, E.kills.paste_row, E.kills.paste_col, E.kills.end_row, E.kills.end_col);
+    setCursor(E.kills.paste_row, E.kills.paste_col);
+
+    long len = 0;
+    E.kills.back = (E.kills.back + 1) % E.kills.count;
+    const char *text = killGet(&E.kills, E.kills.back, &len);
+    pasteText(text, len);
+    setStatusMessage("Pasted copy %d of %d", E.kills.back + 1, E.kills.count);
+}
+
+/* MULTIPLE CURSORS */
+
+void clearCursors(void)
+{
+    // Drop every cursor but the main one
+    E.ncursors = 0;
+}
+
+void addCursorBelow(void)
+{
+    // Add a cursor on the row below the lowest one, in the main cursor's column
+    int offset = log10(E.doc->numrows) + 2;
+    int row = E.ncursors ? E.cursors[E.ncursors - 1].row : E.cy;
+    if (row < E.cy)
+        row = E.cy;
+    if (row + 1 >= E.doc->numrows)
+    {
+        setStatusMessage("No row below to add a cursor to");
+        return;
+    }
+    clearSelection();
+    if (E.ncursors == E.cursorcap)
+    {
+        E.cursorcap = E.cursorcap ? E.cursorcap * 2 : 16;
+        E.cursors = realloc(E.cursors, sizeof(struct textPos) * E.cursorcap);
+    }
+    int col = E.cx - offset;
+    if (col > E.doc->row[row + 1].size)
+        col = E.doc->row[row + 1].size;
+    E.cursors[E.ncursors].row = row + 1;
+    E.cursors[E.ncursors].col = col;
+    E.ncursors++;
+    setStatusMessage("%d cursors (ESC to clear)", E.ncursors + 1);
+}
+
+int comparePos(const struct textPos *a, const struct textPos *b)
+{
+    return (a->row != b->row) ? a->row - b->row : a->col - b->col;
+}
+
+struct textPos *gatherCursors(int *n, int *main_at)
+{
+    // All cursors in one sorted array, the main one merged in where it belongs
+    int offset = log10(E.doc->numrows) + 2;
+    struct textPos main = {E.cy, E.doc->numrows ? E.cx - offset : 0};
+    int lo = 0, hi = E.ncursors;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (comparePos(&E.cursors[mid], &main) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    struct textPos *all = malloc(sizeof(struct textPos) * (E.ncursors + 1));
+    memcpy(all, E.cursors, sizeof(struct textPos) * lo);
+    all[lo] = main;
+    memcpy(&all[lo + 1], &E.cursors[lo], sizeof(struct textPos) * (E.ncursors - lo));
+    *n = E.ncursors + 1;
+    *main_at = lo;
+    return all;
+}
+
+void scatterCursors(struct textPos *all, int n, int main_at)
+{
+    // Store cursors back after they moved, in one pass that drops the ones that now
+    // share a position. Order must have been kept, so nothing is sorted again.
+    int k = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (i == main_at)
+        {
+            setCursor(all[i].row, all[i].col);
+            continue;
+        }
+        if ((i > 0 && comparePos(&all[i - 1], &all[i]) == 0) ||
+            (i + 1 == main_at && comparePos(&all[i], &all[main_at]) == 0))
+            continue;
+        E.cursors[k++] = all[i];
+    }
+    E.ncursors = k;
+    free(all);
+}
+
+void editCursorRow(erow *row, struct textPos *cur, int n, int key)
+{
+    // Apply one keystroke at every cursor of a row, building its new text in one pass.
+    // Each cursor's edit is logged where it lands after the ones before it on the row.
+    int size = row->size;
+    char *chars = malloc(size + n + 1);
+    int o = 0;
+    int from = 0;
+    int done = 0; // Edits made left of the current cursor
+    for (int i = 0; i < n; i++)
+    {
+        int col = (cur[i].col > size) ? size : cur[i].col;
+        if (key == BACKSPACE || key == DELETE_KEY)
+        {
+            int at = (key == BACKSPACE) ? col - 1 : col;
+            if (at < 0 || at >= size || at < from)
+            {
+                cur[i].col = col - done;
+                continue;
+            }
+            undoRecord(&E.doc->undo, UNDO_DELETE, row->index, at - done, &row->chars[at], 1, 0);
+            memcpy(&chars[o], &row->chars[from], at - from);
+            o += at - from;
+            from = at + 1;
+            done++;
+            cur[i].col = col - done + (key == DELETE_KEY); // Delete removes the char after the cursor
+        }
+        else
+        {
+            char c = key;
+            undoRecord(&E.doc->undo, UNDO_INSERT, row->index, col + done, &c, 1, 0);
+            memcpy(&chars[o], &row->chars[from], col - from);
+            o += col - from;
+            chars[o++] = c;
+            from = col;
+            done++;
+            cur[i].col = col + done;
+        }
+    }
+    memcpy(&chars[o], &row->chars[from], size - from);
+    o += size - from;
+    chars[o] = '\0';
+    free(row->chars);
+    row->chars = chars;
+    row->size = o;
+    renderRowText(row);
+}
+
+void editCursors(int key)
+{
+    // Type or delete at every cursor as one batch: each touched row is rewritten and
+    // highlighted once, and cursors are fixed up in the same sorted pass
+    int n, main_at;
+    struct textPos *all = gatherCursors(&n, &main_at);
+    int *touched = malloc(sizeof(int) * n);
+    int nt = 0;
+
+    undoSeal(&E.doc->undo);
+    for (int i = 0; i < n;)
+    {
+        int j = i;
+        while (j < n && all[j].row == all[i].row)
+            j++;
+        if (all[i].row < E.doc->numrows)
+        {
+            editCursorRow(&E.doc->row[all[i].row], &all[i], j - i, key);
+            touched[nt++] = all[i].row;
+        }
+        i = j;
+    }
+    undoSeal(&E.doc->undo);
+
+    // Highlight the touched rows in order, going past them only while a comment
+    // state carries over, so no row is lexed twice
+    int k = 0, carry = 0;
+    int r = nt ? touched[0] : E.doc->numrows;
+    while (r < E.doc->numrows && (k < nt || carry))
+    {
+        int is_touched = (k < nt && touched[k] == r);
+        if (!is_touched && !carry)
+        {
+            r = touched[k];
+            continue;
+        }
+        carry = highlightRow(E.doc, &E.doc->row[r]);
+        if (is_touched)
+        {
+            indexRowChanged(E.doc, r);
+            trigramRowChanged(&E.doc->trigrams, r, E.doc->row[r].chars, E.doc->row[r].size);
+            k++;
+        }
+        r++;
+    }
+    free(touched);
+    if (nt)
+        E.doc->dirty++;
+    scatterCursors(all, n, main_at);
+}
+
+void sortCursors(struct textPos *all, int n, int *main_at)
+{
+    // Put cursors back in order after a vertical move, where one stuck on the first or
+    // last row can end up behind one that moved onto it. They are nearly sorted, so an
+    // insertion sort is about one pass. The main cursor is followed.
+    for (int i = 1; i < n; i++)
+    {
+        struct textPos p = all[i];
+        int was_main = (*main_at == i);
+        int j = i;
+        while (j > 0 && comparePos(&all[j - 1], &p) > 0)
+        {
+            all[j] = all[j - 1];
+            if (*main_at == j - 1)
+                *main_at = j;
+            j--;
+        }
+        all[j] = p;
+        if (was_main)
+            *main_at = j;
+    }
+}
+
+void moveCursors(int key)
+{
+    // Move every cursor by an arrow, Home or End key. Extra cursors stay on their row
+    // for left and right, which keeps them in order; up and down sort them again and
+    // merge the ones that meet.
+    int n, main_at;
+    struct textPos *all = gatherCursors(&n, &main_at);
+    for (int i = 0; i < n; i++)
+    {
+        struct textPos *p = &all[i];
+        if (key == ARROW_UP && p->row > 0)
+            p->row--;
+        else if (key == ARROW_DOWN && p->row < E.doc->numrows - 1)
+            p->row++;
+        int size = (p->row < E.doc->numrows) ? E.doc->row[p->row].size : 0;
+        if (key == ARROW_LEFT && p->col > 0)
+            p->col--;
+        else if (key == ARROW_RIGHT && p->col < size)
+            p->col++;
+        else if (key == HOME_KEY)
+            p->col = 0;
+        else if (key == END_KEY)
+            p->col = size;
+        if (p->col > size)
+            p->col = size;
+    }
+    if (key == ARROW_UP || key == ARROW_DOWN)
+        sortCursors(all, n, &main_at);
+    scatterCursors(all, n, main_at);
+}
+
+void drawCursors(struct abuf *ab)
+{
+    // Show the extra cursors on screen as inverted cells
+    int offset = log10(E.doc->numrows) + 2;
+    int lo = 0, hi = E.ncursors;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (E.cursors[mid].row < E.rowoff)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (int i = lo; i < E.ncursors && E.cursors[i].row < E.rowoff + E.screenrows; i++)
+    {
+        struct textPos *p = &E.cursors[i];
+        if (p->row >= E.doc->numrows)
+            continue;
+        erow *row = &E.doc->row[p->row];
+        int rx = getCursorRx(row, p->col);
+        int x = offset + rx - E.coloff; // Within the active window
+        if (rx < E.coloff || x >= E.screencols)
+            continue;
+        char c = (rx < row->rsize) ? row->render[rx] : ' ';
+        if (iscntrl(c))
+            c = ' ';
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH\x1b[7m%c\x1b[27m", E.windows[E.active].top + p->row - E.rowoff + 1,
+                           E.windows[E.active].left + x + 1, c);
+        abAppend(ab, buf, len);
+    }
+}
+
+/* MACROS */
+
+void toggleRecording(void)
+{
+    // Start recording keys into a new macro, or stop recording
+    if (E.macro.recording)
+    {
+        E.macro.recording = 0;
+        setStatusMessage("Recorded a macro of %d key%s (Ctrl-A to replay)", E.macro.len, E.macro.len == 1 ? "" : "s");
+        return;
+    }
+    E.macro.len = 0;
+    E.macro.recording = 1;
+    setStatusMessage("Recording a macro, Ctrl-T to stop");
+}
+
+void replayMacro(void)
+{
+    // Replay the macro a number of times, or until it stops getting closer to the end of
+    // the text. Nothing is drawn and highlighting waits until the replay is over, so each
+    // run costs only its edits. ESC stops it, checked every MACRO_POLL_RUNS runs.
+    if (E.macro.playing)
+        return;
+    if (E.macro.recording)
+    {
+        setStatusMessage("Stop recording with Ctrl-T before replaying");
+        return;
+    }
+    if (E.macro.len == 0)
+    {
+        setStatusMessage("No macro recorded, Ctrl-T starts recording");
+        return;
+    }
+
+    char *times = readPrompt("Replay macro how many times (e: to end of file): %s (ESC to cancel)", NULL, 1);
+    if (times == NULL)
+        return;
+    int to_end = (times[0] == 'e' || times[0] == 'E');
+    long n = (times[0] && !to_end) ? atol(times) : 1;
+    free(times);
+    if (n <= 0)
+        return;
+    if (to_end || n > MACRO_RUNS_MAX)
+        n = MACRO_RUNS_MAX;
+
+    struct document *doc = E.doc; // The macro may switch buffers
+    E.macro.playing = 1;
+    doc->hl_deferred = 1;
+    long done = 0;
+    int stopped = 0;
+    while (done < n)
+    {
+        // To the end, every run has to move the cursor down and leave fewer rows below
+        // it, so a macro that adds a row for each one it passes still ends
+        int row = E.cy;
+        int below = E.doc->numrows - E.cy;
+        E.macro.pos = 0;
+        while (E.macro.pos < E.macro.len)
+            processKeypress();
+        done++;
+        if (to_end && (E.cy <= row || E.cy >= E.doc->numrows || E.doc->numrows - E.cy >= below))
+            break;
+        if (done % MACRO_POLL_RUNS == 0 && !E.unread)
+        {
+            struct pollfd in = {STDIN_FILENO, POLLIN, 0};
+            if (poll(&in, 1, 0) > 0)
+            {
+                // Other keys wait for the replay to end
+                int c = readTerminalKey();
+                stopped = (c == '\x1b');
+                E.unread = (stopped || c == SKIP_KEY) ? 0 : c;
+                if (stopped)
+                    break;
+            }
+        }
+    }
+    E.macro.playing = 0;
+    doc->hl_deferred = 0;
+    flushHighlight(doc);
+    setStatusMessage("%s the macro %ld time%s", stopped ? "Stopped after replaying" : "Replayed", done,
+                     done == 1 ? "" : "s");
+}
+
+/* SCRIPT */
+
+int scriptUnescape(char *s)
+{
+    // Turn \n, \t and \\ into the characters they stand for, in place. Returns the new length.
+    int o = 0;
+    for (int i = 0; s[i]; i++)
+    {
+        if (s[i] == '\\' && s[i + 1])
+        {
+            i++;
+            s[o++] = (s[i] == 'n') ? '\n' : (s[i] == 't') ? '\t' : s[i];
+        }
+        else
+            s[o++] = s[i];
+    }
+    s[o] = '\0';
+    return o;
+}
+
+int scriptFind(char *query)
+{
+    // Move the cursor to the next match after it, wrapping around. Returns -1 if none.
+    struct searchQuery q;
+    if (compileQuery(&q, query, E.search_flags) == -1 || q.len == 0)
+    {
+        freeQuery(&q);
+        return -1;
+    }
+    int offset = log10(E.doc->numrows) + 2;
+    int row = E.cy;
+    int from = (E.cy < E.doc->numrows) ? E.cx - offset + 1 : 0;
+    for (int n = 0; n <= E.doc->numrows; n++)
+    {
+        int r = (row + n) % (E.doc->numrows ? E.doc->numrows : 1);
+        if (r >= E.doc->numrows)
+            break;
+        int mlen;
+        int at = findMatch(&q, E.doc->row[r].chars, E.doc->row[r].size, n ? 0 : from, &mlen);
+        if (at != -1)
+        {
+            setCursor(r, at);
+            freeQuery(&q);
+            return 0;
+        }
+    }
+    freeQuery(&q);
+    return -1;
+}
+
+int runCommand(char *line)
+{
+    // Apply one script command to the open buffer, returns -1 with a message on error
+    char *arg = line + strcspn(line, " ");
+    int cmdlen = arg - line;
+    if (*arg)
+        arg++;
+    int offset = log10(E.doc->numrows) + 2;
+
+    if (cmdlen == 4 && strncmp(line, "goto", 4) == 0)
+    {
+        int row = 0, col = 0;
+        if (sscanf(arg, "%d %d", &row, &col) < 1 || row < 1)
+        {
+            fprintf(stderr, "goto needs a line number\n");
+            return -1;
+        }
+        setCursor(row - 1, col > 0 ? col - 1 : 0);
+    }
+    else if (cmdlen == 4 && strncmp(line, "find", 4) == 0)
+    {
+        scriptUnescape(arg);
+        if (scriptFind(arg) == -1)
+        {
+            fprintf(stderr, "not found: %s\n", arg);
+            return -1;
+        }
+    }
+    else if (cmdlen == 4 && strncmp(line, "mode", 4) == 0)
+    {
+        // Search modes for the find and replace commands after it: i, w and r
+        E.search_flags = (strchr(arg, 'i') ? SEARCH_ICASE : 0) | (strchr(arg, 'w') ? SEARCH_WORD : 0) |
+                         (strchr(arg, 'r') ? SEARCH_REGEX : 0);
+    }
+    else if (cmdlen == 7 && strncmp(line, "replace", 7) == 0)
+    {
+        // replace /old/new/, with any delimiter in place of /
+        char delim = arg[0];
+        char *old = delim ? arg + 1 : arg;
+        char *with = delim ? strchr(old, delim) : NULL;
+        char *end = with ? strchr(with + 1, delim) : NULL;
+        if (!end)
+        {
+            fprintf(stderr, "replace needs /old/new/\n");
+            return -1;
+        }
+        *with++ = '\0';
+        *end = '\0';
+        scriptUnescape(old);
+        scriptUnescape(with);
+        struct searchQuery q;
+        if (compileQuery(&q, old, E.search_flags) == -1)
+        {
+            fprintf(stderr, "bad pattern: %s\n", q.error ? q.error : old);
+            freeQuery(&q);
+            return -1;
+        }
+        replaceMatches(E.doc, &q, with, 0, 0, E.doc->numrows, 0);
+        freeQuery(&q);
+    }
+    else if (cmdlen == 6 && strncmp(line, "insert", 6) == 0)
+    {
+        long len = scriptUnescape(arg);
+        int row = E.cy;
+        int col = (E.cy < E.doc->numrows) ? E.cx - offset : 0;
+        int end_row, end_col;
+        textEnd(row, col, arg, len, &end_row, &end_col);
+        insertText(E.doc, row, col, arg, len);
+        setCursor(end_row, end_col);
+    }
+    else if (cmdlen == 11 && strncmp(line, "delete-line", 11) == 0)
+    {
+        int n = *arg ? atoi(arg) : 1;
+        if (n > 0)
+            deleteRange(E.doc, E.cy, 0, E.cy + n, 0);
+        setCursor(E.cy, 0);
+    }
+    else if (cmdlen == 4 && strncmp(line, "save", 4) == 0)
+    {
+        if (*arg)
+        {
+            free(E.doc->filename);
+            E.doc->filename = strdup(arg);
+        }
+        if (E.doc->filename == NULL || esave() == -1)
+        {
+            fprintf(stderr, "could not save %s: %s\n", E.doc->filename ? E.doc->filename : "unnamed buffer",
+                    E.doc->filename ? strerror(errno) : "no file name");
+            return -1;
+        }
+    }
+    else if (cmdlen == 6 && strncmp(line, "memory", 6) == 0)
+    {
+        writeMemory(stdout);
+    }
+    else if (cmdlen == 5 && strncmp(line, "print", 5) == 0)
+    {
+        int len;
+        char *buf = rowsToString(E.doc, &len);
+        fwrite(buf, 1, len, stdout);
+        free(buf);
+    }
+    else
+    {
+        fprintf(stderr, "unknown command: %.*s\n", cmdlen, line);
+        return -1;
+    }
+    return 0;
+}
+
+int runScript(const char *path, char **files, int nfiles)
+{
+    // Apply a script of commands, one per line, to each file in turn (or to an empty
+    // buffer if there are none) without a terminal. Returns the exit status.
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!fp)
+    {
+        perror(path);
+        return 1;
+    }
+    char **lines = NULL;
+    int nlines = 0;
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    while ((linelen = getline(&line, &linecap, fp)) != -1)
+    {
+        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+            line[--linelen] = '\0';
+        lines = realloc(lines, sizeof(char *) * (nlines + 1));
+        lines[nlines++] = strdup(line);
+    }
+    free(line);
+    if (fp != stdin)
+        fclose(fp);
+
+    int status = 0;
+    for (int f = 0; f < (nfiles ? nfiles : 1); f++)
+    {
+        if (nfiles)
+        {
+            checkBudget(files[f]);
+            if (eopen(files[f]) == -1)
+            {
+                perror(files[f]);
+                status = 1;
+                continue;
+            }
+        }
+        for (int i = 0; i < nlines; i++)
+        {
+            if (lines[i][0] == '\0' || lines[i][0] == '#')
+                continue;
+            char *cmd = strdup(lines[i]); // Commands unescape their argument in place
+            int res = runCommand(cmd);
+            free(cmd);
+            if (res == -1)
+            {
+                fprintf(stderr, "%s:%d: in %s\n", path, i + 1, nfiles ? files[f] : "empty buffer");
+                status = 1;
+                break;
+            }
+        }
+        eclose();
+    }
+
+    for (int i = 0; i < nlines; i++)
+        free(lines[i]);
+    free(lines);
+    return status;
+}
@@ -0,0 +1,166 @@
+/* IMPORTS */
+
+#include <termios.h>
+#include <time.h>
+
+#include "core.h"
+
+/* MACROS */
+
+// The terminal frontend, built on the engine in core.h. Its state is the global E.
+
+#define CTRL_KEY(k) ((k) & 0x1f) // Macro to get the value of ctrl + some key
+#define ABUF_INIT {NULL, 0}      // Empty append buffer
+#define QUIT_PROT 3              // Number of times to press Ctrl-X to quit when dirty
+#define MACRO_RUNS_MAX 1000000   // Most runs of one macro replay
+#define MACRO_POLL_RUNS 64       // Runs of a replay between checks for ESC
+#define KILL_RING_SIZE 16        // Copies kept for pasting, Ctrl-P cycles back through them
+#define OSC52_MAX 1048576        // Largest copy sent to the terminal clipboard, bigger ones stay in the kill ring
+#define WINDOW_MIN_ROWS 3        // Smallest window made by a split, counting its info bar
+#define WINDOW_MIN_COLS 12       // and narrowest
+#define BUFFERS_LOADED 8         // Buffers kept in memory, the least recently shown clean ones are read again when shown
+#define MEM_BUDGET 1024          // Default megabytes a file may take in memory before opening it asks first
+
+#define VERSION "1.0.2"
+#define GUIDE_TEXT "Ctrl-S: Save | Ctrl-O: Open | Ctrl-B: Buffers | Ctrl-W: Windows | Ctrl-E: Follow | Ctrl-Q: Latency | Ctrl-U: Memory | Ctrl-X: Quit | Ctrl-F: Find | Ctrl-R: Replace | Ctrl-D: Search files | Ctrl-G: Goto | Ctrl-K: Delete | Ctrl-N: Add cursor | Ctrl-T/A: Record/Replay | Ctrl-Z/Y: Undo/Redo | Ctrl-C/V/P: Copy/Paste/Cycle | Ctrl-H: Help" // Status message for help
+#define QUIT_TEXT "WARNING: File has unsaved changes. Press Ctrl-X %d more time%s to quit."                                                                                                                                                                                                                                                                        // Status message for quit without saving warning
+#define FIND_TEXT "%s%s: %%s%s (Use ESC/Arrows/Enter | Ctrl-E: Case | Ctrl-W: Word | Ctrl-R: Regex)"                                                                                                                                                                                                                                                               // Status message for search, filled with the label, active modes and match count
+
+enum keycodes // Codes for break characters
+{
+    BACKSPACE = 127,
+    ARROW_LEFT = 1000,
+    ARROW_RIGHT,
+    ARROW_UP,
+    ARROW_DOWN,
+    SHIFT_ARROW_LEFT,
+    SHIFT_ARROW_RIGHT,
+    SHIFT_ARROW_UP,
+    SHIFT_ARROW_DOWN,
+    HOME_KEY,
+    END_KEY,
+    PAGE_UP,
+    PAGE_DOWN,
+    DELETE_KEY,
+    SKIP_KEY, // Key that wont be processed
+};
+
+enum profileStage // Parts of the time from a keypress to its paint
+{
+    PROFILE_DECODE = 0, // Reading the rest of the key's bytes
+    PROFILE_EDIT,       // Acting on it, but for lexing
+    PROFILE_HIGHLIGHT,  // Lexing rows, while editing or drawing
+    PROFILE_BUILD,      // Building the frame, but for lexing
+    PROFILE_WRITE,      // Writing it to the terminal
+    PROFILE_TOTAL,      // From the first byte to the end of the write
+    PROFILE_STAGES
+};
+
+/* STRUCTS */
+
+struct textPos
+{
+    int row, col; // Column in chars, without the line number offset
+};
+
+struct macro
+{
+    int *keys; // Keys as readKey returned them
+    int len;
+    int cap;
+    int recording;
+    int playing; // readKey hands out the recorded keys instead of reading the terminal
+    int pos;     // Next key to hand out
+};
+
+struct killRing
+{
+    char *text[KILL_RING_SIZE]; // Copies, newest at head
+    long len[KILL_RING_SIZE];
+    int head;
+    int count;
+    int back;                   // How far back the last paste reached
+    int pasted;                 // If the last key pasted, so Ctrl-P may swap it for an older copy
+    int paste_row, paste_col;   // Where that paste started
+    int end_row, end_col;       // and ended
+};
+
+struct buffer
+{
+    struct document *doc;        // Kept rendered while in the background, NULL never
+    int row, col;                // Cursor when the buffer was last shown
+    int rowoff, coloff;          // and what was visible
+    int results;                 // If the buffer lists project search results, Enter opens one
+    int follow;                  // Lines appended to the file are added as they are written, see followBuffer
+    int evicted;                 // Text was dropped to save memory, read again from the file when shown
+    unsigned long used;          // When the buffer was last shown, the oldest are evicted first
+};
+
+struct window
+{
+    int top, left;               // Screen cell of the window's first row and column
+    int rows, cols;              // Size, counting its info bar and the divider on its right
+    int buffer;                  // Buffer shown, windows showing the same one share its document
+    int row, col;                // Cursor while another window is active
+    int rowoff, coloff;          // and what was visible
+};
+
+struct profiler
+{
+    struct histogram stages[PROFILE_STAGES]; // One per profileStage
+    int overlay;                 // Ctrl-Q shows their percentiles over the text
+    char *dump;                  // File they are written to on exit, NULL for none
+    int pending;                 // Keys were read that are not drawn yet
+    long long key_at;            // When the first byte of the key being read arrived
+    long long start;             // and of the oldest key not drawn yet
+    long long mark;              // End of the last part timed
+    long long hl_ns;             // Lexing time of every document, see hl_clock
+    long long hl_mark;           // hl_ns at mark
+    long long spent[PROFILE_TOTAL]; // Time in each part for the keys not drawn yet
+};
+
+struct editorConfig
+{
+    int cx, cy;                  // Where cursor currently is
+    int rx;                      // Where cursor is visible after render changes
+    int screenrows, screencols;  // Size of the active window's text
+    int rowoff, coloff;          // Offsets of whats currently visible
+    struct document *doc;        // Document being edited, the current buffer's
+    struct buffer *buffers;      // Open buffers, see switchBuffer
+    int nbuffers;
+    int current;                 // Buffer shown
+    int last;                    // Buffer shown before it, Ctrl-B goes back to it
+    long undo_limit;             // Bytes of undo history each buffer keeps
+    long mem_budget;             // Bytes a file's rows may take before opening it asks first, 0 for no limit
+    struct window *windows;      // Windows tiling the screen above the status line
+    int nwindows;
+    int active;                  // Window being edited, its view is the one in E
+    int termrows, termcols;      // Screen area the windows tile
+    int watchfd;                 // inotify descriptor watching the open files' directories, -1 without one
+    char status[512];            // Msg show at the bottom
+    time_t statustime;           // Timestamp of status
+    int search_flags;            // SEARCH_* modes used by find
+    int indexing;                // Whether opened files get a trigram index
+    struct killRing kills;       // Copied text, the clipboard paste reads from
+    char *copy_cmd;              // Optional command copies are also piped to, e.g. pbcopy
+    char *paste_cmd;             // Optional command paste reads from instead of the kill ring
+    struct textPos *cursors;     // Cursors besides the main one, sorted by position
+    int ncursors;
+    int cursorcap;
+    struct macro macro;          // Recorded keys, replayed with Ctrl-A
+    int unread;                  // Key read ahead and given back, readKey returns it next. 0 for none
+    int headless;                // Running a script with no terminal, see runScript
+    struct profiler profile;     // Time from keypress to paint, see profileKey
+    struct termios orig_termios; // Original terminal
+
+    // Selection state
+    int sel_active;                 // Whether selection is active
+    int sel_start_cx, sel_start_cy; // Selection start position
+    int sel_end_cx, sel_end_cy;     // Selection end position
+};
+
+struct abuf
+{ // Append buffer to group up write operations
+    char *b;
+    int len;
+};
@@ -0,0 +1,271 @@
+/* IMPORTS */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/* FUNCTIONS */
+
+static unsigned char trigramFold[256]; // Lower case of every byte, filled by trigramInit
+
+static unsigned int trigramHash(const char *p)
+{
+    // Bucket of the three bytes at p, folded to lower case so one index serves both case modes
+    unsigned int t = (unsigned int)trigramFold[(unsigned char)p[0]] << 16 |
+                     (unsigned int)trigramFold[(unsigned char)p[1]] << 8 |
+                     (unsigned int)trigramFold[(unsigned char)p[2]];
+    return (t * 2654435761u) >> (32 - TRIGRAM_BITS);
+}
+
+void trigramInit(struct trigramIndex *ix)
+{
+    // Start an empty index, rows are added by trigramBuildStep
+    for (int c = 0; c < 256; c++)
+        trigramFold[c] = tolower(c);
+    ix->postings = calloc(TRIGRAM_BUCKETS, sizeof(struct trigramPosting));
+    ix->blockrows = NULL;
+    ix->blockstart = NULL;
+    ix->starts = 0;
+    ix->nblocks = 0;
+    ix->blockcap = 0;
+    ix->rows = 0;
+    ix->fill = 0;
+    ix->entries = 0;
+    ix->building = 1;
+}
+
+void trigramFree(struct trigramIndex *ix)
+{
+    if (ix->postings)
+        for (int i = 0; i < TRIGRAM_BUCKETS; i++)
+            free(ix->postings[i].blocks);
+    free(ix->postings);
+    free(ix->blockrows);
+    free(ix->blockstart);
+    ix->postings = NULL;
+    ix->blockrows = NULL;
+    ix->blockstart = NULL;
+    ix->starts = 0;
+    ix->nblocks = 0;
+    ix->blockcap = 0;
+    ix->rows = 0;
+    ix->entries = 0;
+    ix->building = 0;
+}
+
+size_t trigramMemory(const struct trigramIndex *ix)
+{
+    // Bytes held by the index, posting lists counted at their allocated size
+    if (!ix->postings)
+        return 0;
+    size_t bytes = sizeof(struct trigramPosting) * TRIGRAM_BUCKETS + sizeof(int) * 2 * ix->blockcap;
+    for (int i = 0; i < TRIGRAM_BUCKETS; i++)
+        bytes += sizeof(uint32_t) * ix->postings[i].cap;
+    return bytes;
+}
+
+static void trigramPost(struct trigramIndex *ix, unsigned int h, uint32_t block)
+{
+    // Add a block to a bucket's sorted list unless it is already there
+    struct trigramPosting *p = &ix->postings[h];
+    int at = p->count;
+    if (at > 0 && p->blocks[at - 1] == block)
+        return; // Trigrams repeat a lot within a block
+    if (at > 0 && p->blocks[at - 1] > block)
+    {
+        // Edits land in earlier blocks, building only ever appends
+        int lo = 0, hi = at;
+        while (lo < hi)
+        {
+            int mid = lo + (hi - lo) / 2;
+            if (p->blocks[mid] < block)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo < p->count && p->blocks[lo] == block)
+            return;
+        at = lo;
+    }
+    if (p->count == p->cap)
+    {
+        p->cap = p->cap ? p->cap * 2 : 4;
+        p->blocks = realloc(p->blocks, sizeof(uint32_t) * p->cap);
+    }
+    memmove(&p->blocks[at + 1], &p->blocks[at], sizeof(uint32_t) * (p->count - at));
+    p->blocks[at] = block;
+    p->count++;
+    ix->entries++;
+}
+
+static void trigramAddText(struct trigramIndex *ix, int block, const char *s, int len)
+{
+    for (int i = 0; i + 3 <= len; i++)
+        trigramPost(ix, trigramHash(&s[i]), block);
+}
+
+static void trigramGrow(struct trigramIndex *ix, int cap)
+{
+    ix->blockcap = cap;
+    ix->blockrows = realloc(ix->blockrows, sizeof(int) * cap);
+    ix->blockstart = realloc(ix->blockstart, sizeof(int) * cap);
+}
+
+static int trigramBlockOf(struct trigramIndex *ix, int row)
+{
+    // Block holding an indexed row, -1 if the row is past the indexed ones. Block
+    // starts an edit moved are summed again first, then searched for the row.
+    if (row < 0 || row >= ix->rows)
+        return -1;
+    if (ix->starts == 0 && ix->nblocks > 0)
+    {
+        ix->blockstart[0] = 0;
+        ix->starts = 1;
+    }
+    for (; ix->starts < ix->nblocks; ix->starts++)
+        ix->blockstart[ix->starts] = ix->blockstart[ix->starts - 1] + ix->blockrows[ix->starts - 1];
+
+    // Last block starting at or before row, skipping blocks emptied by deletes
+    int lo = 0, hi = ix->nblocks;
+    while (hi - lo > 1)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (ix->blockstart[mid] <= row)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void trigramMoved(struct trigramIndex *ix, int b)
+{
+    // Rows of block b changed, so the blocks after it start somewhere else
+    if (ix->starts > b + 1)
+        ix->starts = b + 1;
+}
+
+int trigramBuildStep(struct trigramIndex *ix, erow *rows, int numrows, long budget)
+{
+    // Index rows after the ones already covered until about budget bytes were read.
+    // Returns 1 while there are rows left, 0 once the index covers them all.
+    while (ix->rows < numrows && budget > 0)
+    {
+        if (ix->nblocks == 0 || ix->fill >= TRIGRAM_BLOCK_BYTES)
+        {
+            if (ix->nblocks == ix->blockcap)
+                trigramGrow(ix, ix->blockcap ? ix->blockcap * 2 : 64);
+            ix->blockrows[ix->nblocks++] = 0;
+            ix->fill = 0;
+        }
+        erow *row = &rows[ix->rows];
+        trigramAddText(ix, ix->nblocks - 1, row->chars, row->size);
+        ix->blockrows[ix->nblocks - 1]++;
+        ix->fill += row->size + 1;
+        ix->rows++;
+        budget -= row->size + 1;
+    }
+    ix->building = ix->rows < numrows;
+    return ix->building;
+}
+
+void trigramRowChanged(struct trigramIndex *ix, int at, const char *s, int len)
+{
+    // Post the trigrams of an edited row. Trigrams the edit removed stay posted,
+    // which only costs an extra block check on queries that hit them.
+    int b = trigramBlockOf(ix, at);
+    if (b != -1)
+        trigramAddText(ix, b, s, len);
+}
+
+void trigramRowsInserted(struct trigramIndex *ix, int at, int n)
+{
+    // Grow the block new rows land in, so no block is renumbered
+    if (!ix->postings || at > ix->rows || (at == ix->rows && ix->building))
+        return; // Rows past the indexed ones are picked up by the build
+    int b = (at == ix->rows) ? ix->nblocks - 1 : trigramBlockOf(ix, at);
+    if (b == -1)
+    {
+        // Index of an empty buffer, start its first block
+        trigramGrow(ix, 64);
+        ix->blockrows[0] = 0;
+        ix->nblocks = 1;
+        ix->starts = 0;
+        b = 0;
+    }
+    ix->blockrows[b] += n;
+    ix->rows += n;
+    trigramMoved(ix, b);
+}
+
+void trigramRowsDeleted(struct trigramIndex *ix, int at, int n)
+{
+    // Shrink the blocks that held deleted rows, from the one the first of them is in
+    if (at >= ix->rows)
+        return;
+    int hi = (at + n < ix->rows) ? at + n : ix->rows;
+    int first = trigramBlockOf(ix, at);
+    int start = ix->blockstart[first]; // First row of block b
+    trigramMoved(ix, first);
+    for (int b = first; b < ix->nblocks && start < hi; b++)
+    {
+        int end = start + ix->blockrows[b];
+        int from = (start > at) ? start : at;
+        int to = (end < hi) ? end : hi;
+        if (from < to)
+            ix->blockrows[b] -= to - from;
+        start = end;
+    }
+    ix->rows -= hi - at;
+}
+
+static int trigramCompareCount(const void *a, const void *b)
+{
+    return (*(struct trigramPosting *const *)a)->count - (*(struct trigramPosting *const *)b)->count;
+}
+
+static int trigramHas(const struct trigramPosting *p, uint32_t block)
+{
+    int lo = 0, hi = p->count;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (p->blocks[mid] < block)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < p->count && p->blocks[lo] == block;
+}
+
+int trigramCandidates(const struct trigramIndex *ix, const char *lit, int len, uint32_t **blocks)
+{
+    // Blocks that hold every trigram of a literal, sorted. Returns how many, or -1
+    // if the literal is too short to have a trigram and every block is a candidate.
+    *blocks = NULL;
+    if (!ix->postings || len < 3)
+        return -1;
+
+    int n = len - 2;
+    struct trigramPosting **lists = malloc(sizeof(struct trigramPosting *) * n);
+    for (int i = 0; i < n; i++)
+        lists[i] = &ix->postings[trigramHash(&lit[i])];
+    qsort(lists, n, sizeof(struct trigramPosting *), trigramCompareCount);
+
+    // Walk the shortest list and keep the blocks every other list has too
+    int count = 0;
+    *blocks = malloc(sizeof(uint32_t) * (lists[0]->count + 1));
+    for (int i = 0; i < lists[0]->count; i++)
+    {
+        uint32_t b = lists[0]->blocks[i];
+        int all = 1;
+        for (int j = 1; j < n && all; j++)
+            if (lists[j] != lists[j - 1])
+                all = trigramHas(lists[j], b);
+        if (all)
+            (*blocks)[count++] = b;
+    }
+    free(lists);
+    return count;
+}
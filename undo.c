@@ -0,0 +1,181 @@
+/* IMPORTS */
+
+#include <stdlib.h>
+#include <string.h>
+
+/* FUNCTIONS */
+
+void undoInit(struct undoLog *log, long limit)
+{
+    log->arena = NULL;
+    log->used = 0;
+    log->arenacap = 0;
+    log->ops = NULL;
+    log->count = 0;
+    log->cap = 0;
+    log->done = 0;
+    log->group = 0;
+    log->cur_row = log->cur_col = 0;
+    log->sealed = 1;
+    log->suspended = 0;
+    log->limit = limit;
+    log->journal = NULL;
+}
+
+void undoClear(struct undoLog *log)
+{
+    // Forget all history, e.g. when another file is opened. The journal goes on.
+    struct journal *journal = log->journal;
+    free(log->arena);
+    free(log->ops);
+    undoInit(log, log->limit);
+    log->journal = journal;
+}
+
+long undoMemory(const struct undoLog *log)
+{
+    return log->used + (long)sizeof(struct undoOp) * log->count;
+}
+
+void undoStartGroup(struct undoLog *log, int cur_row, int cur_col)
+{
+    // Ops recorded from now on are undone together, and put the cursor back here
+    log->group++;
+    log->cur_row = cur_row;
+    log->cur_col = cur_col;
+}
+
+void undoSeal(struct undoLog *log)
+{
+    // Make the next op start a new run instead of extending the last one
+    log->sealed = 1;
+}
+
+static void undoAppend(struct undoLog *log, const char *s, long len)
+{
+    if (log->used + len > log->arenacap)
+    {
+        log->arenacap = (log->used + len) * 2;
+        log->arena = realloc(log->arena, log->arenacap);
+    }
+    memcpy(&log->arena[log->used], s, len);
+    log->used += len;
+}
+
+static void undoTrim(struct undoLog *log)
+{
+    // Drop the oldest groups until the log is back under three quarters of its limit,
+    // so the arena is compacted once per many ops rather than on every one
+    int drop = 0;
+    long freed = 0;
+    long target = log->limit / 4 * 3;
+    while (drop < log->count && undoMemory(log) - freed > target)
+    {
+        unsigned int g = log->ops[drop].group;
+        while (drop < log->count && log->ops[drop].group == g)
+        {
+            freed += log->ops[drop].len + sizeof(struct undoOp);
+            drop++;
+        }
+    }
+    if (drop == 0)
+        return;
+
+    long off = (drop < log->count) ? log->ops[drop].off : log->used;
+    memmove(log->arena, &log->arena[off], log->used - off);
+    log->used -= off;
+    memmove(log->ops, &log->ops[drop], sizeof(struct undoOp) * (log->count - drop));
+    log->count -= drop;
+    log->done = (log->done > drop) ? log->done - drop : 0;
+    for (int i = 0; i < log->count; i++)
+        log->ops[i].off -= off;
+}
+
+void undoRecord(struct undoLog *log, int type, int row, int col, const char *s, long len, int eol)
+{
+    // Log an insert or delete of s (plus a newline if eol) at (row, col). Single
+    // characters typed or deleted next to the last ones extend its run instead.
+    if (log->suspended || (len == 0 && !eol))
+        return;
+    if (log->journal)
+        journalAppend(log->journal, type, row, col, s, len, eol);
+
+    // A new edit after undoing makes the undone ops unreachable
+    if (log->done < log->count)
+    {
+        log->used = log->ops[log->done].off;
+        log->count = log->done;
+        log->sealed = 1;
+    }
+
+    struct undoOp *last = log->count ? &log->ops[log->count - 1] : NULL;
+    if (!log->sealed && last && last->run && last->type == type && last->row == row &&
+        len == 1 && !eol && s[0] != '\n')
+    {
+        if (type == UNDO_INSERT && col == last->col + last->len)
+        {
+            undoAppend(log, s, 1);
+            last->len++;
+            return;
+        }
+        if (type == UNDO_DELETE && col == last->col && !last->backward)
+        {
+            undoAppend(log, s, 1); // Delete key, each char follows the last
+            last->len++;
+            return;
+        }
+        if (type == UNDO_DELETE && col == last->col - 1 && (last->backward || last->len == 1))
+        {
+            undoAppend(log, s, 1); // Backspace, the run is kept last char first
+            last->backward = 1;
+            last->col = col;
+            last->len++;
+            return;
+        }
+    }
+
+    if (len + eol + (long)sizeof(struct undoOp) > log->limit)
+    {
+        // Too big to keep, and older ops can't be replayed without it
+        undoClear(log);
+        return;
+    }
+
+    if (log->count == log->cap)
+    {
+        log->cap = log->cap ? log->cap * 2 : 256;
+        log->ops = realloc(log->ops, sizeof(struct undoOp) * log->cap);
+    }
+    struct undoOp *op = &log->ops[log->count++];
+    op->off = log->used;
+    op->len = len + eol;
+    op->row = row;
+    op->col = col;
+    op->cur_row = log->cur_row;
+    op->cur_col = log->cur_col;
+    op->group = log->group;
+    op->type = type;
+    op->backward = 0;
+    op->run = (len == 1 && !eol && s[0] != '\n');
+    undoAppend(log, s, len);
+    if (eol)
+        undoAppend(log, "\n", 1);
+    log->done = log->count;
+    log->sealed = 0;
+
+    if (undoMemory(log) > log->limit)
+        undoTrim(log);
+}
+
+char *undoText(const struct undoLog *log, const struct undoOp *op)
+{
+    // Copy of an op's text in document order
+    char *s = malloc(op->len + 1);
+    if (op->backward)
+        for (long i = 0; i < op->len; i++)
+            s[i] = log->arena[op->off + op->len - 1 - i];
+    else
+        memcpy(s, &log->arena[op->off], op->len);
+    s[op->len] = '\0';
+    return s;
+}
@@ -1,8 +1,33 @@
 /* IMPORTS */
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
+#include <sys/stat.h>
 
 /* FUNCTIONS */
 int is_separator(int c) {
   return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
+
+char *sidecarPath(const char *filename, const char *suffix)
+{
+    // "dir/.name<suffix>" for "dir/name", hidden next to the file it belongs to
+    const char *slash = strrchr(filename, '/');
+    int dirlen = slash ? slash - filename + 1 : 0;
+    char *path = malloc(strlen(filename) + strlen(suffix) + 2);
+    sprintf(path, "%.*s.%s%s", dirlen, filename, &filename[dirlen], suffix);
+    return path;
+}
+
+long long statMtime(const struct stat *st)
+{
+    // Modification time in nanoseconds, so a rewrite within the same second still shows
+#if defined(__APPLE__)
+    return st->st_mtimespec.tv_sec * 1000000000LL + st->st_mtimespec.tv_nsec;
+#elif defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200809L
+    return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+#else
+    return st->st_mtime * 1000000000LL;
+#endif
+}